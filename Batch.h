@@ -0,0 +1,297 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "Common.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Evaluator.h"
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace calc {
+
+// Batch mode: evaluate one compiled Program over many rows of input at once
+// Variables can be bound to contiguous columns (one value per row), the others keep their scalar value from the AvailableVariables
+// Instead of walking the program once per row, each instruction is applied to a whole block of rows with SIMD kernels
+// Results are the same, bit for bit, as evaluate() gives for each row, and a failed check raises the error of the first row failing
+//
+//	BatchInputs in;
+//	in.bind(vt, "x", xs);      // xs and ys hold rows values each
+//	in.bind(vt, "y", ys);
+//	evaluateBatch(p, vt, in, rows, results);
+
+class BatchInputs {
+public:
+	void bind(AvailableVariables& vt, std::string_view name, const double* column);
+	const double* column(int slot) const;
+private:
+	std::vector<int> slots;
+	std::vector<const double*> columns;
+};
+
+void evaluateBatch (const Program&, AvailableVariables&, const BatchInputs&, size_t rows, double* out);
+void rowError (const Program&, AvailableVariables&, const BatchInputs&, size_t first, int n);      // Always throws
+
+
+// BatchInputs function definitions
+
+inline void BatchInputs::bind(AvailableVariables& vt, std::string_view name, const double* column){
+	int slot = vt.getSlot(name);
+	for (int i = 0; i < slots.size(); i++) {
+		if (slots[i] == slot) {      // Binding the same variable again replaces the column
+			columns[i] = column;
+			return;
+		}
+	}
+	slots.push_back(slot);
+	columns.push_back(column);
+}
+
+inline const double* BatchInputs::column(int slot) const {    // Column bound to a slot, nullptr if it stays scalar
+	for (int i = 0; i < slots.size(); i++) if (slots[i] == slot) return columns[i];
+	return nullptr;
+}
+
+
+// Kernels working on n contiguous doubles, the widest vectors the compiler was allowed to use and a scalar tail
+
+namespace batch {
+
+#if defined(__AVX__)
+	typedef __m256d Lanes;
+	const int width = 4;
+	inline Lanes load(const double* p) { return _mm256_loadu_pd(p); }
+	inline void store(double* p, Lanes v) { _mm256_storeu_pd(p, v); }
+	inline Lanes splat(double d) { return _mm256_set1_pd(d); }
+	inline Lanes add(Lanes a, Lanes b) { return _mm256_add_pd(a, b); }
+	inline Lanes sub(Lanes a, Lanes b) { return _mm256_sub_pd(a, b); }
+	inline Lanes mul(Lanes a, Lanes b) { return _mm256_mul_pd(a, b); }
+	inline Lanes div(Lanes a, Lanes b) { return _mm256_div_pd(a, b); }
+	inline Lanes sqrt(Lanes a) { return _mm256_sqrt_pd(a); }
+	inline Lanes flipSign(Lanes a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+	inline bool anyEqual(Lanes a, Lanes b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_EQ_OQ)) != 0; }
+	inline bool anyLess(Lanes a, Lanes b) { return _mm256_movemask_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ)) != 0; }
+#elif defined(__SSE2__)
+	typedef __m128d Lanes;
+	const int width = 2;
+	inline Lanes load(const double* p) { return _mm_loadu_pd(p); }
+	inline void store(double* p, Lanes v) { _mm_storeu_pd(p, v); }
+	inline Lanes splat(double d) { return _mm_set1_pd(d); }
+	inline Lanes add(Lanes a, Lanes b) { return _mm_add_pd(a, b); }
+	inline Lanes sub(Lanes a, Lanes b) { return _mm_sub_pd(a, b); }
+	inline Lanes mul(Lanes a, Lanes b) { return _mm_mul_pd(a, b); }
+	inline Lanes div(Lanes a, Lanes b) { return _mm_div_pd(a, b); }
+	inline Lanes sqrt(Lanes a) { return _mm_sqrt_pd(a); }
+	inline Lanes flipSign(Lanes a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+	inline bool anyEqual(Lanes a, Lanes b) { return _mm_movemask_pd(_mm_cmpeq_pd(a, b)) != 0; }
+	inline bool anyLess(Lanes a, Lanes b) { return _mm_movemask_pd(_mm_cmplt_pd(a, b)) != 0; }
+#else
+	typedef double Lanes;      // Scalar fallback, one lane
+	const int width = 1;
+	inline Lanes load(const double* p) { return *p; }
+	inline void store(double* p, Lanes v) { *p = v; }
+	inline Lanes splat(double d) { return d; }
+	inline Lanes add(Lanes a, Lanes b) { return a + b; }
+	inline Lanes sub(Lanes a, Lanes b) { return a - b; }
+	inline Lanes mul(Lanes a, Lanes b) { return a * b; }
+	inline Lanes div(Lanes a, Lanes b) { return a / b; }
+	inline Lanes sqrt(Lanes a) { return std::sqrt(a); }
+	inline Lanes flipSign(Lanes a) { return -a; }
+	inline bool anyEqual(Lanes a, Lanes b) { return a == b; }
+	inline bool anyLess(Lanes a, Lanes b) { return a < b; }
+#endif
+
+	// a = a op b, element by element
+	template<class Operation>
+	void binary(double* a, const double* b, int n, Operation op){
+		int i = 0;
+		for (; i + width <= n; i += width) store(a+i, op(load(a+i), load(b+i)));
+		for (; i < n; i++) {
+			Lanes x = splat(a[i]);
+			double r[width];
+			store(r, op(x, splat(b[i])));
+			a[i] = r[0];
+		}
+	}
+
+	// True if any of the n values compares equal to / less than d
+	inline bool anyEqual(const double* a, int n, double d){
+		int i = 0;
+		Lanes v = splat(d);
+		for (; i + width <= n; i += width) if (anyEqual(load(a+i), v)) return true;
+		for (; i < n; i++) if (a[i] == d) return true;
+		return false;
+	}
+
+	inline bool anyLess(const double* a, int n, double d){
+		int i = 0;
+		Lanes v = splat(d);
+		for (; i + width <= n; i += width) if (anyLess(load(a+i), v)) return true;
+		for (; i < n; i++) if (a[i] < d) return true;
+		return false;
+	}
+
+	inline void fill(double* a, int n, double d){
+		int i = 0;
+		Lanes v = splat(d);
+		for (; i + width <= n; i += width) store(a+i, v);
+		for (; i < n; i++) a[i] = d;
+	}
+
+	inline void negate(double* a, int n){      // Only the sign bit changes, as -x does: -0 for 0 and the other way round
+		int i = 0;
+		for (; i + width <= n; i += width) store(a+i, flipSign(load(a+i)));
+		for (; i < n; i++) a[i] = -a[i];
+	}
+
+	inline void squareRoot(double* a, int n){
+		int i = 0;
+		for (; i + width <= n; i += width) store(a+i, sqrt(load(a+i)));
+		for (; i < n; i++) a[i] = std::sqrt(a[i]);
+	}
+}
+
+
+// Batch evaluation
+
+inline void evaluateBatch(const Program& p, AvailableVariables& vt, const BatchInputs& in, size_t rows, double* out){
+
+	// Rows are processed in blocks small enough for the whole stack of columns to stay in cache
+	const int blockSize = 512;
+	std::vector<double> buffers((std::max(p.maxDepth, 1) + p.temps) * blockSize);
+	double* stack = buffers.data();
+	double* temps = stack + std::max(p.maxDepth, 1) * blockSize;     // Columns for the temporary slots of optimized programs
+
+	// Resolve every load once: either a bound column or a scalar read from the variable table
+	std::vector<const double*> loadColumns(p.code.size(), nullptr);
+	std::vector<double> loadValues(p.code.size(), 0);
+	for (int i = 0; i < p.code.size(); i++) {
+		const Instruction& ins = p.code[i];
+		if (ins.op == Op::store || ins.op == Op::define || ins.op == Op::bind) error("Assignments are not supported in batch evaluation.");
+		if (ins.op == Op::call) error("Calls to functions that were not inlined are not supported in batch evaluation.");
+		if (ins.op == Op::reduce) error("Reductions are not supported in batch evaluation.");
+		if (ins.op == Op::arg) error("Function bodies are not supported in batch evaluation.");
+		if (ins.op != Op::load) continue;
+		loadColumns[i] = in.column(ins.slot);
+		if (loadColumns[i]) continue;
+		if (!vt.isDefined(ins.slot)) {      // Every row fails, at this load or before it
+			if (rows > 0) rowError(p, vt, in, 0, std::min<size_t>(blockSize, rows));
+			return;
+		}
+		loadValues[i] = vt.getValue(ins.slot);
+	}
+
+	const Instruction* code = p.code.data();
+	int size = p.code.size();
+
+	for (size_t first = 0; first < rows; first += blockSize) {
+		int n = std::min<size_t>(blockSize, rows - first);
+		int top = -1;
+
+		for (int i = 0; i < size; i++) {
+			const Instruction& ins = code[i];
+			double* next = stack + (top+1) * blockSize;     // Column a push writes to
+			double* a = next - blockSize;                    // Column on top of the stack
+			double* b = a - blockSize;                       // Column below it
+
+			switch (ins.op) {
+			case Op::number:
+				batch::fill(next, n, ins.value);
+				top++;
+				break;
+			case Op::load:
+				if (loadColumns[i]) std::memcpy(next, loadColumns[i] + first, n * sizeof(double));
+				else batch::fill(next, n, loadValues[i]);
+				top++;
+				break;
+			case Op::add:
+				batch::binary(b, a, n, [](batch::Lanes x, batch::Lanes y) { return batch::add(x, y); });
+				top--;
+				break;
+			case Op::sub:
+				batch::binary(b, a, n, [](batch::Lanes x, batch::Lanes y) { return batch::sub(x, y); });
+				top--;
+				break;
+			case Op::mul:
+				batch::binary(b, a, n, [](batch::Lanes x, batch::Lanes y) { return batch::mul(x, y); });
+				top--;
+				break;
+			case Op::div:
+				if (batch::anyEqual(a, n, 0)) rowError(p, vt, in, first, n);
+				batch::binary(b, a, n, [](batch::Lanes x, batch::Lanes y) { return batch::div(x, y); });
+				top--;
+				break;
+			case Op::mod:      // fmod has no vector instruction, it goes through libm one row at a time
+				if (batch::anyEqual(a, n, 0)) rowError(p, vt, in, first, n);
+				for (int r = 0; r < n; r++) b[r] = std::fmod(b[r], a[r]);
+				top--;
+				break;
+			case Op::neg:
+				batch::negate(a, n);
+				break;
+			case Op::sqrt:
+				if (batch::anyLess(a, n, 0)) rowError(p, vt, in, first, n);
+				batch::squareRoot(a, n);
+				break;
+			case Op::pow:      // Same libm call as evaluate(), so results stay identical to the interpreter
+				for (int r = 0; r < n; r++) {
+					int x = int(a[r]);
+					if (double(x) != a[r]) rowError(p, vt, in, first, n);      // Same test as narrow_cast<int>
+					b[r] = std::pow(b[r], x);
+				}
+				top--;
+				break;
+			case Op::fact:
+				for (int r = 0; r < n; r++) {
+					int x = int(a[r]);
+					if (double(x) != a[r]) rowError(p, vt, in, first, n);
+					int fact = 1;
+					for (int j = 1; j <= x; j++) {
+						fact *= j;
+						if (fact < 0) rowError(p, vt, in, first, n);
+					}
+					a[r] = fact;
+				}
+				break;
+			case Op::keep:
+				std::memcpy(temps + ins.slot * blockSize, a, n * sizeof(double));
+				break;
+			case Op::recall:
+				std::memcpy(next, temps + ins.slot * blockSize, n * sizeof(double));
+				top++;
+				break;
+			case Op::pop:
+				std::memcpy(temps + ins.slot * blockSize, a, n * sizeof(double));
+				top--;
+				break;
+			default:      // An op without a kernel would leave the stack wrong for every op after it
+				error("Instruction not supported in batch evaluation.");
+			}
+		}
+		std::memcpy(out + first, stack, n * sizeof(double));
+	}
+}
+
+// A check failed for some row of the block: its rows are run one at a time by evaluate(), with the values of the row
+// as numbers in place of the columns, so the error raised is the one of the first failing row, as a loop over the rows gives
+inline void rowError(const Program& p, AvailableVariables& vt, const BatchInputs& in, size_t first, int n){
+	Program row = p;
+	for (int r = 0; r < n; r++) {
+		for (int i = 0; i < p.code.size(); i++) {
+			const Instruction& ins = p.code[i];
+			const double* column = ins.op == Op::load ? in.column(ins.slot) : nullptr;
+			if (column) row.code[i] = Instruction{Op::number, false, 0, column[first + r]};
+		}
+		evaluate(row, vt);
+	}
+	error("Batch evaluation failed.");      // Not reached, the rows fail as the block did
+}
+
+}	// namespace calc
+
+#endif
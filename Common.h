@@ -0,0 +1,50 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+// Standard headers and the few helpers the calculator uses, for the headers of the library (namespace calc)
+// Unlike std_lib_facilities.h it puts nothing in the global namespace and pulls nothing into calc: no using namespace std,
+// no macros, so the library can be included next to any other code. The headers write std:: in full
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+#include <memory>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cstdint>
+#include <charconv>
+#include <variant>
+#include <filesystem>
+
+namespace calc {
+
+inline void error(const std::string& s){      // Same as error() in std_lib_facilities.h
+	throw std::runtime_error(s);
+}
+
+template<class R, class A> R narrow_cast(const A& a){      // Throws "info loss" if a does not fit in R
+	R r = R(a);
+	if (A(r) != a) error("info loss");
+	return r;
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,472 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include "Common.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Optimizer.h"
+
+namespace calc {
+
+// Parser for the grammar documented at the top of calculator.cpp, see expression() for how it works
+// Instead of calculating values while parsing, each function emits instructions into a Program,
+// so a statement is only parsed once and can then be evaluated as many times as needed
+// Variables are resolved to their slot in the AvailableVariables at compile time
+//
+// User functions (# f(x, y) = x*x + y) get their body compiled once, reading the parameters with Op::arg
+// A call to a small function is inlined: the arguments go to temporary slots (or straight into the body when they are
+// a single number or variable) and the body is copied in place, so the call itself costs nothing when the program runs
+// Reductions (sum(i, 1, n, body), prod, min, max) compile their body the same way, with the index as its last parameter
+//
+// Errors do not throw: each function returns false once the error is recorded in the TokenStream (see TokenStream::fail),
+// and its caller returns false in turn, so a bad statement costs no more than a good one
+// compileStatement (TokenStream&, AvailableVariables&) throws the message instead, for callers that want exceptions
+//
+// Every function is a template on the number type of the table it compiles for (see Number.h)
+// The lexer reads numbers as doubles, literalValue() reads their chars again for the other types
+
+template<class T> BasicProgram<T> compileStatement (TokenStream&, BasicVariables<T>&);
+template<class T> bool compileStatement (TokenStream&, BasicVariables<T>&, BasicProgram<T>&);
+template<class T> bool definition (TokenStream&, BasicVariables<T>&, BasicProgram<T>&, bool statement = false);
+template<class T> bool functionDefinition (TokenStream&, BasicVariables<T>&, std::string_view name);
+template<class T> bool call (TokenStream&, BasicVariables<T>&, BasicProgram<T>&, int function);
+template<class T> bool reduction (TokenStream&, BasicVariables<T>&, BasicProgram<T>&, std::string_view name, Reduction);
+template<class T> void append (BasicProgram<T>&, const BasicProgram<T>&, const std::vector<BasicInstruction<T>>* args = nullptr);
+template<class T> bool expression (TokenStream&, BasicVariables<T>&, BasicProgram<T>&);
+template<class T> bool variable (TokenStream&, BasicVariables<T>&, BasicProgram<T>&, Token name, int& assigned);
+template<class T> bool literalValue (const Token&, T& value);
+
+
+template<class T> BasicProgram<T> compileStatement(TokenStream& ts, BasicVariables<T>& vt){
+	BasicProgram<T> p;
+	if (!compileStatement(ts, vt, p)) error(ts.diagnostic().message);
+	return p;
+}
+
+template<class T> bool compileStatement(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>& p){
+	STATS_TIME(compile);
+	Token t = ts.get();
+	bool compiled;
+	if (t.kind == let) compiled = definition(ts, vt, p, true);     // Only a whole statement can define a function, it leaves p empty
+	else {
+		ts.putBack(t);
+		compiled = expression(ts, vt, p);
+	}
+	return compiled && !ts.failed();      // The lexer may have met a char it does not know after the last token used
+}
+
+
+// The expression parser is a loop over explicit stacks rather than one C++ call per level of the grammar:
+// operands and operators are read in turn, binary operators wait on the frame stack until one of lower precedence
+// (or the end of the expression) comes, and everything that encloses an expression, eg. '(' or sqrt, is a frame too
+// So nesting costs a frame on the heap instead of four on the native stack, and input like ((((...)))) or ----x
+// of any depth compiles in bounded stack space. Calls, reductions and definitions still compile their parts
+// with a nested expression(), which starts its own frames above the ones already there
+//
+// Same grammar as the recursive descent it replaced: unary - and + bind tighter than ! and k,
+// and sqrt, assignments and definitions take the whole expression that follows them
+
+struct ParseFrame {
+	enum Kind : char {
+		binary,        // Operator waiting for its right operand
+		negate,        // Unary -, applied once its primary is complete
+		paren, brace,  // Expects ')' or '}' at the end of the expression
+		root,          // sqrt of the expression
+		assign,        // Store the expression in slot
+		powBase, powExponent      // First and second argument of pow(
+	};
+	Kind kind;
+	char op = 0;       // Token of a binary operator
+	int slot = 0;
+};
+
+inline thread_local std::vector<ParseFrame> parseFrames;      // Reused by every statement, so parsing allocates nothing once it is big enough
+
+inline int precedence(char kind){      // Binary operators, 0 for any other token
+	switch (kind) {
+	case '+': case '-': return 1;
+	case '*': case '/': case '%': return 2;
+	default: return 0;
+	}
+}
+
+inline Op binaryOp(char kind){
+	switch (kind) {
+	case '+': return Op::add;
+	case '-': return Op::sub;
+	case '*': return Op::mul;
+	case '/': return Op::div;      // Division by zero is checked when the program runs
+	default: return Op::mod;
+	}
+}
+
+
+template<class T> bool expression(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>& p) {
+	std::vector<ParseFrame>& frames = parseFrames;
+	const size_t base = frames.size();      // Frames below belong to the expression this one is part of
+	struct Release {
+		std::vector<ParseFrame>& frames;
+		size_t base;
+		~Release() { frames.resize(base); }     // Also when an error returns early
+	} release {frames, base};
+
+	auto emitBinary = [&](int level) {      // Operators waiting with at least this precedence, latest first
+		while (frames.size() > base && frames.back().kind == ParseFrame::binary && precedence(frames.back().op) >= level) {
+			p.emit(binaryOp(frames.back().op));
+			frames.pop_back();
+		}
+	};
+
+	auto completePrimary = [&]() {      // Unary minus first, then the postfix operators apply to what it gave
+		while (frames.size() > base && frames.back().kind == ParseFrame::negate) {
+			p.emit(Op::neg);
+			frames.pop_back();
+		}
+		while (true) {
+			Token t = ts.get();
+			if (t.kind == '!') p.emit(Op::fact);
+			else if (t.kind == k) {
+				p.emit(Op::number, 1000);
+				p.emit(Op::mul);
+			}
+			else {
+				ts.putBack(t);
+				return;
+			}
+		}
+	};
+
+	bool operand = true;      // Reading an operand, otherwise the operator after one
+	while (true) {
+		if (operand) {
+			Token t = ts.get();
+			switch (t.kind) {
+			case '(': frames.push_back({ParseFrame::paren}); continue;
+			case '{': frames.push_back({ParseFrame::brace}); continue;
+			case '-': frames.push_back({ParseFrame::negate}); continue;      // Add the possibility for negative numbers
+			case '+': continue;      // This will mean that repeated +'s are skiped: eg. 1++++2; works
+			case sq: frames.push_back({ParseFrame::root}); continue;      // Square root function, works with or without brakets
+
+			// Power function, requires brackets as in pow(double base, int i)
+			case pwr:
+				t = ts.get();
+				if (t.kind != '(') return ts.fail("'(' expected for calling function pow(double n, int i).");
+				frames.push_back({ParseFrame::powBase});
+				continue;
+
+			case number:
+			{
+				T value;
+				if (!literalValue(t, value)) return ts.fail("Number ", t.name, " is not an int64.");
+				p.emit(Op::number, value);
+				break;
+			}
+			case let:
+				if (!definition(ts, vt, p)) return false;
+				break;
+			case var:
+			{
+				int assigned;
+				if (!variable(ts, vt, p, t, assigned)) return false;
+				if (assigned >= 0) {
+					frames.push_back({ParseFrame::assign, 0, assigned});
+					continue;
+				}
+				break;
+			}
+			default:
+				ts.putBack(t);
+				return ts.fail("Primary expected.");
+			}
+			completePrimary();
+			operand = false;
+		}
+
+		Token t = ts.get();
+		if (int level = precedence(t.kind)) {
+			emitBinary(level);      // Left associative: operators of the same level before this one go first
+			frames.push_back({ParseFrame::binary, t.kind});
+			operand = true;
+			continue;
+		}
+		ts.putBack(t);
+
+		// End of an expression: finish its operators, then whatever encloses it
+		emitBinary(1);
+		if (frames.size() == base) return true;
+		ParseFrame enclosing = frames.back();
+		frames.pop_back();
+		switch (enclosing.kind) {
+		case ParseFrame::paren:
+			t = ts.get();
+			if (t.kind != ')') return ts.fail("missing ')'");      // Notice that char ')' gets eaten
+			break;
+		case ParseFrame::brace:
+			t = ts.get();
+			if (t.kind != '}') return ts.fail("missing '}'");
+			break;
+		case ParseFrame::root:
+			p.emit(Op::sqrt);
+			break;
+		case ParseFrame::assign:
+			p.emit(Op::store, 0, enclosing.slot);
+			break;
+		case ParseFrame::powBase:
+			t = ts.get();
+			if (t.kind != ',') return ts.fail("Missing ',' when calling pow(double n, int i).");
+			frames.push_back({ParseFrame::powExponent});
+			operand = true;
+			continue;
+		case ParseFrame::powExponent:
+			t = ts.get();
+			if (t.kind != ')') return ts.fail("Missing ')' when calling pow(double n, int i).");
+			p.emit(Op::pow);
+			break;
+		default:
+			break;
+		}
+		completePrimary();      // What the frame enclosed is a primary of the expression around it
+	}
+}
+
+
+// A name read as an operand: parameter, call, reduction or variable
+// For an assignment (var = ...) only the '=' is read and assigned is the slot, the caller compiles the expression
+template<class T> bool variable(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>& p, Token t, int& assigned) {
+	assigned = -1;
+
+	// Parameter of the function being defined, or index of a reduction (the innermost one wins)
+	auto parameter = std::find(p.parameters.rbegin(), p.parameters.rend(), t.name);
+	if (parameter != p.parameters.rend()) {
+		Token next = ts.get();
+		if (next.kind == '=') return ts.fail("Cannot assign to parameter '", t.name, "'.");
+		ts.putBack(next);
+		p.emit(Op::arg, 0, p.parameters.rend() - parameter - 1);
+		return true;
+	}
+
+	// Functions, then the built in reductions: they are only names followed by '(', so variables can still be called sum or max
+	Token next = ts.get();
+	if (next.kind == '(') {
+		int function = vt.findFunction(t.name);
+		if (function >= 0) return call(ts, vt, p, function);
+		if (t.name == "sum") return reduction(ts, vt, p, t.name, Reduction::sum);
+		if (t.name == "prod") return reduction(ts, vt, p, t.name, Reduction::prod);
+		if (t.name == "min") return reduction(ts, vt, p, t.name, Reduction::min);
+		if (t.name == "max") return reduction(ts, vt, p, t.name, Reduction::max);
+	}
+	ts.putBack(next);
+
+	int slot = vt.getSlot(t.name);    // Look the name up once, the program only keeps the slot
+
+	// Assignment of existing variable
+	next = ts.get();
+	if (next.kind == '=') {
+		assigned = slot;
+		return true;
+	}
+	ts.putBack(next);
+	p.emit(Op::load, 0, slot);
+	return true;
+}
+
+
+template<class T> bool definition(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>& p, bool statement){
+	// 'let' was already read, statement tells whether it was the first token of the statement
+
+	Token t = ts.get();
+
+	bool isConst = false;
+	bool isBound = false;
+	if (t.name == "const") {
+		isConst = true;
+		t = ts.get();  // Get var following "const"
+	}
+	else if (t.name == "bind") {     // Bound variable, recomputed whenever a variable it reads changes
+		isBound = true;
+		t = ts.get();
+	}
+	if (t.kind != var) return ts.fail("Variable name expected.");
+	std::string_view varName = t.name;     // Read name of variable, valid until the statement ends
+
+	t = ts.get();
+	if (t.kind == '(' && !isConst && !isBound) {
+		if (!statement) return ts.fail("Function '", varName, "' has to be defined in a statement of its own.");
+		return functionDefinition(ts, vt, varName);
+	}
+	if (t.kind != '=') return ts.fail("Equal sign '=' expected after variable '", varName, "'.");
+
+	if (isBound) {
+		// The expression gets a program of its own, kept by the variable and run again on every change
+		BasicProgram<T> bound;
+		if (!expression(ts, vt, bound)) return false;
+		for (const BasicInstruction<T>& in : bound.code) {
+			if (in.op == Op::store || in.op == Op::define || in.op == Op::bind) return ts.fail("Bound variable '", varName, "' cannot assign other variables.");
+		}
+		p.subprograms.push_back(optimize(bound, vt));
+		p.emit(Op::bind, p.subprograms.size() - 1, vt.getSlot(varName));
+		return true;
+	}
+
+	if (!expression(ts, vt, p)) return false;
+	p.emit(Op::define, 0, vt.getSlot(varName), isConst);     // Variable is stored when the program runs
+	return true;
+}
+
+
+template<class T> bool functionDefinition(TokenStream& ts, BasicVariables<T>& vt, std::string_view name){
+	// '# name(' was already read
+	if (vt.findFunction(name) >= 0) return ts.fail("Function '", name, "' is already defined.");
+
+	BasicProgram<T> body;
+	Token t = ts.get();
+	while (t.kind != ')') {
+		if (t.kind != var) return ts.fail("Parameter name expected in definition of '", name, "'.");
+		if (std::find(body.parameters.begin(), body.parameters.end(), t.name) != body.parameters.end()) return ts.fail("Parameter '", t.name, "' given twice.");
+		body.parameters.push_back(vt.intern(t.name));      // Token names only last until the statement ends
+		t = ts.get();
+		if (t.kind == ',') t = ts.get();
+		else if (t.kind != ')') return ts.fail("Missing ',' between parameters of '", name, "'.");
+	}
+
+	t = ts.get();
+	if (t.kind != '=') return ts.fail("Equal sign '=' expected after '", name, "(...)'.");
+	if (!expression(ts, vt, body) || ts.failed()) return false;      // Not defined if the lexer failed after the body
+	for (const BasicInstruction<T>& in : body.code) {
+		if (in.op == Op::store || in.op == Op::define || in.op == Op::bind) return ts.fail("Function '", name, "' cannot assign variables.");
+	}
+	vt.defineFunction(name, optimize(body, vt));     // Defined once the whole body compiled, so it cannot call itself
+	return true;
+}
+
+
+template<class T> bool call(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>& p, int function){
+	// 'name(' was already read
+	const BasicProgram<T>& body = vt.getFunction(function);
+	int count = body.parameters.size();
+
+	// Each argument is compiled on its own first, to see whether it can go straight into the body
+	std::vector<BasicProgram<T>> args;
+	args.reserve(count);
+	Token t = ts.get();
+	if (t.kind != ')') {
+		ts.putBack(t);
+		while (true) {
+			args.push_back(BasicProgram<T>{});
+			args.back().code.reserve(8);
+			args.back().parameters = p.parameters;      // Calls in a function body can pass its parameters on
+			if (!expression(ts, vt, args.back())) return false;
+			t = ts.get();
+			if (t.kind == ')') break;
+			if (t.kind != ',') return ts.fail("Missing ',' between arguments of function.");
+		}
+	}
+	if (args.size() != count) return ts.fail("Function takes "+std::to_string(count)+" argument(s), "+std::to_string(args.size())+" given.");
+
+	const int inlineLimit = 64;      // Instructions, bigger bodies are called
+	bool sideEffects = false;        // Arguments that assign variables have to run in order, before the body
+	for (const BasicProgram<T>& a : args) {
+		for (const BasicInstruction<T>& in : a.code) sideEffects = sideEffects || in.op == Op::store || in.op == Op::define || in.op == Op::bind;
+	}
+	bool reductions = false;         // Their bodies read the parameters as arguments, so they need the call
+	for (const BasicInstruction<T>& in : body.code) reductions = reductions || in.op == Op::reduce;
+	if (body.code.size() > inlineLimit || sideEffects || reductions) {
+		for (const BasicProgram<T>& a : args) append(p, a);
+		p.emit(Op::call, function, count);
+		return true;
+	}
+
+	std::vector<int> uses(count, 0);
+	for (const BasicInstruction<T>& in : body.code) if (in.op == Op::arg) uses[in.slot]++;
+
+	// A number or a variable the body reads is copied in place of the parameter, other arguments are computed once
+	// (in order, so errors stay the same) and moved to temporary slots
+	// Only defined variables are copied: reading one never fails, while an undefined one has to fail in its turn, as Op::call does
+	std::vector<BasicInstruction<T>> values(count);
+	std::vector<int> computed;
+	for (int i = 0; i < count; i++) {
+		const std::vector<BasicInstruction<T>>& code = args[i].code;
+		bool simple = code.size() == 1 && (code[0].op == Op::number || code[0].op == Op::arg || (code[0].op == Op::load && vt.isDefined(code[0].slot)));
+		if (simple && uses[i] > 0) values[i] = code[0];
+		else {
+			append(p, args[i]);
+			computed.push_back(i);
+		}
+	}
+	for (int i = computed.size() - 1; i >= 0; i--) {     // Last argument is on top of the stack
+		int temp = p.temps;
+		p.emit(Op::pop, 0, temp);
+		values[computed[i]] = BasicInstruction<T>{Op::recall, false, temp, 0};
+	}
+	append(p, body, &values);
+	return true;
+}
+
+
+template<class T> bool reduction(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>& p, std::string_view name, Reduction kind){
+	// 'sum(' was already read: sum(i, first, last, body)
+	Token index = ts.get();
+	if (index.kind != var) return ts.fail("Index name expected after '", name, "('.");
+	Token t = ts.get();
+	if (t.kind != ',') return ts.fail("Missing ',' after the index of '", name, "'.");
+	if (!expression(ts, vt, p)) return false;
+	t = ts.get();
+	if (t.kind != ',') return ts.fail("Missing ',' between the bounds of '", name, "'.");
+	if (!expression(ts, vt, p)) return false;
+	t = ts.get();
+	if (t.kind != ',') return ts.fail("Missing ',' before the body of '", name, "'.");
+
+	// The body is compiled once, and reads the index like a parameter of the function it is in
+	BasicProgram<T> body;
+	body.parameters = p.parameters;
+	body.parameters.push_back(vt.intern(index.name));
+	if (!expression(ts, vt, body)) return false;
+	t = ts.get();
+	if (t.kind != ')') return ts.fail("Missing ')' after the body of '", name, "'.");
+	for (const BasicInstruction<T>& in : body.code) {      // Terms are evaluated on several threads at once
+		if (in.op == Op::store || in.op == Op::define || in.op == Op::bind) return ts.fail("Body of '", name, "' cannot assign variables.");
+	}
+	p.subprograms.push_back(optimize(body, vt));
+	p.emit(Op::reduce, p.subprograms.size() - 1, int(kind));
+	return true;
+}
+
+
+// Appends the code of program from to p, moving its temporary slots and subprograms after the ones p already has
+// With args, every Op::arg i is replaced by args[i], which inlines a function body
+template<class T> void append(BasicProgram<T>& p, const BasicProgram<T>& from, const std::vector<BasicInstruction<T>>* args){
+	int tempBase = p.temps;
+	int subprogramBase = p.subprograms.size();
+	for (const BasicProgram<T>& s : from.subprograms) p.subprograms.push_back(s);
+	for (BasicInstruction<T> in : from.code) {
+		if (in.op == Op::arg && args) in = (*args)[in.slot];
+		else if (in.op == Op::keep || in.op == Op::recall || in.op == Op::pop) in.slot += tempBase;
+		else if (in.op == Op::bind || in.op == Op::reduce) in.value += subprogramBase;
+		p.emit(in.op, in.value, in.slot, in.isConst);
+	}
+}
+
+
+// Value of a number token in the number type of the program: the double the lexer read,
+// or its chars read again, so a float or long double is rounded once and an int64 is exact
+// False for an int64 literal that is not an integer or does not fit
+template<class T> bool literalValue(const Token& t, T& value){
+	const char* first = t.name.data();
+	const char* last = first + t.name.size();
+	if constexpr (std::is_same_v<T, double>) value = t.value;
+	else if constexpr (std::is_integral_v<T>) {
+		std::from_chars_result r = std::from_chars(first, last, value);
+		if (r.ec == std::errc() && r.ptr == last) return true;
+		if (r.ec == std::errc::result_out_of_range) return false;
+		const double exact = 9007199254740992.0;      // 2^53: with a '.' or an exponent (2.0, 1e3) the double is exact up to there
+		if (t.value != std::floor(t.value) || t.value > exact) return false;
+		value = T(t.value);
+	}
+	else if (!parseLiteral(first, last, value)) value = T(t.value);      // A literal the lexer failed on, the statement fails anyway
+	return true;
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,139 @@
+#include "Context.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+
+// The library: everything the calculator does without a console, behind the small API of Context.h
+// This is its only translation unit, the headers it includes hold the definitions
+
+namespace calc {
+
+// What a context holds for one number type (see Number.h), each context has the one its Options::numbers asks for
+// Every call goes to it through a single visit, after that everything runs on the instantiation for that type
+template<class T> struct Session {
+	BasicVariables<T> vt;
+	BasicProgram<T> program;      // Reused by every statement, so compiling one allocates nothing once the code vector is big enough
+	std::string message;          // Error last returned, viewed by its Result
+};
+
+struct Context::State {
+	std::variant<Session<double>, Session<float>, Session<long double>, Session<int64_t>> session;
+};
+
+template<class T> void setUp (Session<T>&, const Options&);
+template<class T> Result evaluate (Session<T>&, std::string_view statements);
+template<class T> Result get (Session<T>&, std::string_view name);
+template<class T> Result set (Session<T>&, std::string_view name, double value);
+
+
+// Context Functions
+
+Context::Context(const Options& options): state {std::make_unique<State>()} {
+	NumberType numbers;
+	if (!parseNumberType(options.numbers, numbers)) error("Unknown numbers " + options.numbers + ", use double, float, long double or int64.");
+	switch (numbers) {
+	case NumberType::real: break;      // The session the variant starts with
+	case NumberType::single: state->session.emplace<Session<float>>(); break;
+	case NumberType::extended: state->session.emplace<Session<long double>>(); break;
+	case NumberType::integer: state->session.emplace<Session<int64_t>>(); break;
+	}
+	std::visit([&options](auto& s) { setUp(s, options); }, state->session);
+}
+
+Context::~Context() = default;
+Context::Context(Context&&) noexcept = default;
+Context& Context::operator=(Context&&) noexcept = default;
+
+Result Context::evaluate(std::string_view statements){
+	return std::visit([statements](auto& s) { return calc::evaluate(s, statements); }, state->session);
+}
+
+Result Context::get(std::string_view name){
+	return std::visit([name](auto& s) { return calc::get(s, name); }, state->session);
+}
+
+Result Context::set(std::string_view name, double value){
+	return std::visit([name, value](auto& s) { return calc::set(s, name, value); }, state->session);
+}
+
+
+// Session Functions
+
+template<class T> void setUp(Session<T>& s, const Options& options){
+	BasicVariables<T>& vt = s.vt;
+	vt.getMemo().setCapacity(options.memo);
+	if (!options.snapshot.empty()) vt.loadSnapshot(options.snapshot);
+	if (options.constants) {      // Same constants as the calculator, unless the snapshot had them
+		if constexpr (!std::is_integral_v<T>) {
+			if (!vt.checkVarExists("pi")) vt.setVar("pi", T(3.1415926535), true);
+			if (!vt.checkVarExists("e")) vt.setVar("e", T(2.7182818284), true);
+		}
+		if (!vt.checkVarExists("k")) vt.setVar("k", 1000, true);
+	}
+}
+
+template<class T> void setValue(Result& r, T value){
+	r.value = double(value);
+	if constexpr (std::is_integral_v<T>) r.exact = value;
+}
+
+template<class T> Result fail(Session<T>& s, Result r, std::string message){
+	s.message = std::move(message);
+	r.ok = false;
+	r.message = s.message;
+	return r;
+}
+
+template<class T> Result evaluate(Session<T>& s, std::string_view statements){
+	Result r;
+	TokenStream ts (statements.data(), statements.data() + statements.size());
+	while (true) {
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof || t.kind == quit) return r;
+		if (isCommand(t.kind)) return fail(s, r, "Command not available in a Context.");
+
+		ts.putBack(t);
+		BasicProgram<T>& p = s.program;
+		p.clear();
+		if (!compileStatement(ts, s.vt, p)) return fail(s, r, ts.diagnostic().message);
+		if (p.code.empty()) continue;      // Function definition
+		// No optimize() (Optimizer.h) here: it builds a new Program, and a statement of a context runs once without allocating
+		T value;
+		Status status = tryEvaluateMemo(p, s.vt, value);
+		if (!status) return fail(s, r, faultMessage(status, s.vt));
+		setValue(r, value);
+	}
+}
+
+template<class T> Result get(Session<T>& s, std::string_view name){
+	Result r;
+	int slot = s.vt.findSlot(name);
+	if (slot < 0 || !s.vt.isDefined(slot)) return fail(s, r, "Variable with name " + std::string(name) + " not found.");
+	setValue(r, s.vt.getValue(slot));
+	return r;
+}
+
+template<class T> Result set(Session<T>& s, std::string_view name, double d){
+	Result r;
+	if constexpr (std::is_integral_v<T>) {
+		const double limit = 9223372036854775808.0;      // 2^63
+		if (d != std::floor(d) || !(d >= -limit && d < limit)) return fail(s, r, faultMessage(Status{Fault::infoLoss}, s.vt));
+	}
+	T value = T(d);
+	setValue(r, value);
+	int slot = s.vt.getSlot(name);
+	Status status;
+	if (!s.vt.isDefined(slot)) s.vt.defineValue(slot, value, false);
+	else if (s.vt.isConstant(slot)) status = Status{Fault::constantAssigned, slot};
+	else if (s.vt.getBinding(slot)) status = Status{Fault::boundAssigned, slot};
+	else {
+		s.vt.assignValue(slot, value);
+		if (s.vt.hasDependents(slot)) status = propagate(s.vt, slot);      // Bound variables reading it follow
+	}
+	if (!status) return fail(s, r, faultMessage(status, s.vt));
+	return r;
+}
+
+}	// namespace calc
@@ -0,0 +1,52 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+// Embedding the calculator: link build/libcalc.a (make lib) and include only this header
+// A Context holds everything a session needs, its variables and constants and the options below
+// Contexts share nothing, so threads can each evaluate in a context of their own without any lock
+// evaluate() lexes the text where it is: no stream is made, and nothing outside the context is written
+//
+//	calc::Context c;
+//	calc::Result r = c.evaluate("# r = 2; pi * r * r");
+//	if (r) cout << r.value; else cout << r.message;
+
+namespace calc {
+
+struct Options {
+	bool constants = true;      // Define pi, e and k
+	int memo = 1024;            // Results of statements kept for when they come again, 0 for none
+	std::string snapshot;       // File written by the save command to start from, empty for none
+	std::string numbers = "double";      // What the context calculates with: double, float, long double or int64
+};
+
+struct Result {
+	double value = 0;           // Value of the last statement that gave one
+	std::int64_t exact = 0;     // The same value without rounding, when the numbers are int64
+	std::string_view message;   // Error of the statement that failed, valid until the context is used again
+	bool ok = true;
+	explicit operator bool() const { return ok; }
+};
+
+class Context {
+public:
+	Result evaluate(std::string_view statements);      // Runs the statements in order, up to the first error
+	Result get(std::string_view name);                  // Value of a variable
+	Result set(std::string_view name, double value);   // Defines the variable, or assigns it if it exists
+
+	explicit Context (const Options& options = Options{});      // Throws if the snapshot cannot be read or numbers is unknown
+	~Context ();
+	Context (Context&&) noexcept;
+	Context& operator= (Context&&) noexcept;
+private:
+	struct State;      // Defined in Context.cpp, so this header needs none of the others
+	std::unique_ptr<State> state;
+};
+
+}	// namespace calc
+
+#endif
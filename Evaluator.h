@@ -0,0 +1,508 @@
+#ifndef EVALUATOR_H
+#define EVALUATOR_H
+
+#include "Common.h"
+#include "Variable.h"
+#include "Program.h"
+#include "ThreadPool.h"
+#include <limits>
+#include <unordered_set>
+
+namespace calc {
+
+// Runs a Program compiled by Compiler.h and returns the value of the statement
+// The same checks as the original parse-and-evaluate calculator are made here, at run time
+//
+// tryEvaluate() reports a failed check with a Status instead of an exception, so scripts with many bad statements
+// cost no more than good ones; evaluate() throws the error message the calculator always gave
+//
+// Everything here is a template on the number type (see Number.h). Floating point types share the same code,
+// int64 has exact integer arithmetic instead: division truncates, sqrt gives the integer part of the root,
+// and a result that does not fit is an overflow error instead of a rounded value
+
+enum class Fault : char { none, divideByZero, moduloByZero, factorialOverflow, negativeRoot, infoLoss,
+	undefinedVariable, constantAssigned, boundAssigned, alreadyDefined, emptyRange, overflow };
+
+struct Status {
+	Fault fault = Fault::none;
+	int slot = 0;          // Variable the fault is about
+	explicit operator bool() const { return fault == Fault::none; };
+};
+
+template<class T> Status tryEvaluate (const BasicProgram<T>&, BasicVariables<T>&, T& value, const T* args = nullptr);
+template<class T> Status tryEvaluateMemo (const BasicProgram<T>&, BasicVariables<T>&, T& value);
+template<class T> T evaluate (const BasicProgram<T>&, BasicVariables<T>&, const T* args = nullptr);
+template<class T> T evaluateMemo (const BasicProgram<T>&, BasicVariables<T>&);
+template<class T> Status propagate (BasicVariables<T>&, int slot);
+template<class T> std::string faultMessage (Status, const BasicVariables<T>&);
+template<class T> Status reduce (const BasicProgram<T>& body, Reduction, T first, T last, const T* args, BasicVariables<T>&, T& value);
+
+
+template<class T> T evaluate(const BasicProgram<T>& p, BasicVariables<T>& vt, const T* args){
+	T value;
+	Status s = tryEvaluate(p, vt, value, args);
+	if (!s) error(faultMessage(s, vt));
+	return value;
+}
+
+template<class T> T evaluateMemo(const BasicProgram<T>& p, BasicVariables<T>& vt){
+	T value;
+	Status s = tryEvaluateMemo(p, vt, value);
+	if (!s) error(faultMessage(s, vt));
+	return value;
+}
+
+template<class T> std::string faultMessage(Status s, const BasicVariables<T>& vt){
+	switch (s.fault) {
+	case Fault::divideByZero: return "Cannot divide by zero!";
+	case Fault::moduloByZero: return "Cannot perform modulo by zero!";
+	case Fault::factorialOverflow: return "Overflow of factorial!";
+	case Fault::negativeRoot: return "Square root of negative number not allowed.";
+	case Fault::infoLoss: return "info loss";      // What narrow_cast says
+	case Fault::undefinedVariable: return "Variable with name "+std::string(vt.getName(s.slot))+" not found.";
+	case Fault::constantAssigned: return "Tried to assign value to constant variable!";
+	case Fault::boundAssigned: return "Tried to assign value to bound variable!";
+	case Fault::alreadyDefined: return "Variable is already defined. Usage: v = 5;";
+	case Fault::emptyRange: return "Empty range for min or max.";
+	case Fault::overflow: return "Integer overflow.";
+	default: return "";
+	}
+}
+
+
+// int64 arithmetic, each one false when the result does not fit
+inline bool addExact(int64_t& a, int64_t b) { return !__builtin_add_overflow(a, b, &a); }
+inline bool subtractExact(int64_t& a, int64_t b) { return !__builtin_sub_overflow(a, b, &a); }
+inline bool multiplyExact(int64_t& a, int64_t b) { return !__builtin_mul_overflow(a, b, &a); }
+
+inline int64_t rootExact(int64_t x){      // Integer part of the square root of x >= 0
+	int64_t r = int64_t(std::sqrt(double(x)));      // Close, but rounded when x has more than 53 bits
+	while (r > 0 && r > x / r) r--;
+	while (r + 1 <= x / (r + 1)) r++;
+	return r;
+}
+
+inline Status powerExact(int64_t& base, int exponent){      // Negative exponents truncate, as 1 / base^-exponent would
+	if (exponent < 0) {
+		if (base == 0) return Status{Fault::divideByZero};
+		if (base == -1) base = exponent % 2 == 0 ? 1 : -1;
+		else if (base != 1) base = 0;
+		return Status{};
+	}
+	int64_t result = 1;
+	while (exponent > 0) {       // Squaring, the square only overflows if the result would
+		if ((exponent & 1) && !multiplyExact(result, base)) return Status{Fault::overflow};
+		exponent >>= 1;
+		if (exponent > 0 && !multiplyExact(base, base)) return Status{Fault::overflow};
+	}
+	base = result;
+	return Status{};
+}
+
+
+template<class T> Status tryEvaluate(const BasicProgram<T>& p, BasicVariables<T>& vt, T& value, const T* args){    // args: arguments of a function body
+	using Instruction = BasicInstruction<T>;
+	constexpr bool exact = std::is_integral_v<T>;      // int64: checked integer arithmetic
+
+	// Small programs run with a stack on the C++ stack, only very deep ones need the heap
+	// Temporary slots are kept after the stack, in the same memory
+	const int localSize = 64;
+	T local[localSize];
+	std::vector<T> heap;
+	T* stack = local;
+	if (p.maxDepth + p.temps > localSize) {
+		heap.resize(p.maxDepth + p.temps);
+		stack = heap.data();
+	}
+	T* temps = stack + p.maxDepth;
+
+	int top = -1;      // Index of the value on top of the stack
+	const Instruction* code = p.code.data();    // Plain pointers, skip the range checks of vector in the hot loop
+	const Instruction* end = code + p.code.size();
+
+	for (const Instruction* in = code; in != end; in++) {
+		switch (in->op) {
+		case Op::number:
+			stack[++top] = in->value;
+			break;
+		case Op::load:
+			if (!vt.isDefined(in->slot)) return Status{Fault::undefinedVariable, in->slot};
+			stack[++top] = vt.getValue(in->slot);
+			break;
+		case Op::store:
+		{
+			if (!vt.isDefined(in->slot)) return Status{Fault::undefinedVariable, in->slot};
+			if (vt.isConstant(in->slot)) return Status{Fault::constantAssigned, in->slot};
+			if (vt.getBinding(in->slot)) return Status{Fault::boundAssigned, in->slot};
+			vt.assignValue(in->slot, stack[top]);
+			if (!vt.hasDependents(in->slot)) break;
+			Status s = propagate(vt, in->slot);      // Bring bound variables up to date
+			if (!s) return s;
+			break;
+		}
+		case Op::define:
+			if (vt.isDefined(in->slot)) return Status{Fault::alreadyDefined, in->slot};
+			vt.defineValue(in->slot, stack[top], in->isConst);
+			break;
+		case Op::add:
+			top--;
+			if constexpr (exact) {
+				if (!addExact(stack[top], stack[top+1])) return Status{Fault::overflow};
+			}
+			else stack[top] += stack[top+1];
+			break;
+		case Op::sub:
+			top--;
+			if constexpr (exact) {
+				if (!subtractExact(stack[top], stack[top+1])) return Status{Fault::overflow};
+			}
+			else stack[top] -= stack[top+1];
+			break;
+		case Op::mul:
+			top--;
+			if constexpr (exact) {
+				if (!multiplyExact(stack[top], stack[top+1])) return Status{Fault::overflow};
+			}
+			else stack[top] *= stack[top+1];
+			break;
+		case Op::div:
+		{
+			T d = stack[top--];
+			if (d == 0) return Status{Fault::divideByZero};
+			if constexpr (exact) {
+				if (d == -1 && stack[top] == std::numeric_limits<T>::min()) return Status{Fault::overflow};
+			}
+			stack[top] /= d;      // Truncates for int64
+			break;
+		}
+		case Op::mod:
+		{
+			T d = stack[top--];
+			if (d == 0) return Status{Fault::moduloByZero};
+			if constexpr (exact) stack[top] = d == -1 ? 0 : stack[top] % d;
+			else stack[top] = std::fmod(stack[top], d);
+			break;
+		}
+		case Op::neg:
+			if constexpr (exact) {
+				if (stack[top] == std::numeric_limits<T>::min()) return Status{Fault::overflow};
+			}
+			stack[top] = -stack[top];
+			break;
+		case Op::fact:
+		{
+			int x = int(stack[top]);
+			if (T(x) != stack[top]) return Status{Fault::infoLoss};      // Same check as narrow_cast<int>
+			if constexpr (exact) {
+				T fact = 1;
+				for (int i = 2; i <= x; i++) {
+					if (!multiplyExact(fact, i)) return Status{Fault::factorialOverflow};     // Exact up to 20!
+				}
+				stack[top] = fact;
+			}
+			else {
+				int fact = 1;
+				for (int i = 1; i <= x; i++) {
+					fact *= i;      // Should see over flow over 12! but seeing it at 17!
+					if (fact < 0) return Status{Fault::factorialOverflow};   // Using double means this doesn't catch alll wrong factorials
+				}
+				stack[top] = fact;
+			}
+			break;
+		}
+		case Op::sqrt:
+			if (stack[top] < 0) return Status{Fault::negativeRoot};
+			if constexpr (exact) stack[top] = rootExact(stack[top]);
+			else stack[top] = std::sqrt(stack[top]);
+			break;
+		case Op::pow:
+		{
+			int i = int(stack[top]);
+			if (T(i) != stack[top]) return Status{Fault::infoLoss};
+			top--;
+			if constexpr (exact) {
+				Status s = powerExact(stack[top], i);
+				if (!s) return s;
+			}
+			else stack[top] = std::pow(stack[top], i);
+			break;
+		}
+		case Op::keep:
+			temps[in->slot] = stack[top];
+			break;
+		case Op::recall:
+			stack[++top] = temps[in->slot];
+			break;
+		case Op::bind:
+		{
+			const BasicProgram<T>& expression = p.subprograms[int(in->value)];
+			T d;
+			Status s = tryEvaluate(expression, vt, d);
+			if (!s) return s;
+			if (vt.isDefined(in->slot)) return Status{Fault::alreadyDefined, in->slot};
+			vt.bindValue(in->slot, d, expression);
+			stack[++top] = d;
+			break;
+		}
+		case Op::pop:
+			temps[in->slot] = stack[top--];
+			break;
+		case Op::arg:
+			stack[++top] = args[in->slot];
+			break;
+		case Op::call:
+		{
+			top -= in->slot;      // The arguments are read in place by the body, its result then takes the place of the first one
+			Status s = tryEvaluate(vt.getFunction(int(in->value)), vt, stack[top+1], stack + top + 1);
+			if (!s) return s;
+			top++;
+			break;
+		}
+		case Op::reduce:
+		{
+			T last = stack[top--];
+			Status s = reduce(p.subprograms[int(in->value)], Reduction(in->slot), stack[top], last, args, vt, stack[top]);
+			if (!s) return s;
+			break;
+		}
+		}
+	}
+	value = top >= 0 ? stack[top] : 0;      // Compiled programs always leave a value, an empty one would give 0 rather than read before the stack
+	return Status{};
+}
+
+
+// Same as evaluate(), but a statement evaluated before on the same variables gives the result kept in the MemoCache of vt
+// Only programs without side effects are kept: their result depends on nothing but their code and the variables they read,
+// so the key is the code plus the version of every variable loaded
+// Statements that raise an error are not kept, running them again raises it again
+template<class T> void keyValue(std::vector<uint64_t>& key, T value){      // Bits of value, in two words for a long double
+	static_assert(sizeof(T) <= 16);
+	const size_t bytes = std::is_same_v<T, long double> && std::numeric_limits<T>::digits == 64 ? 10 : sizeof(T);     // x87: the rest is padding
+	uint64_t words[2] = {0, 0};
+	std::memcpy(words, &value, bytes);
+	key.push_back(words[0]);
+	if (sizeof(T) > 8) key.push_back(words[1]);
+}
+
+template<class T> bool memoKey(const BasicProgram<T>& p, const BasicVariables<T>& vt, std::vector<uint64_t>& key){     // False for programs with side effects
+	for (const BasicInstruction<T>& in : p.code) {
+		if (in.op == Op::store || in.op == Op::define || in.op == Op::bind) return false;
+		key.push_back(uint64_t(uint8_t(in.op)) | uint64_t(uint32_t(in.slot)) << 8);
+		if (in.op == Op::number || in.op == Op::call) keyValue(key, in.value);
+		if (in.op == Op::load) key.push_back(vt.getVersion(in.slot));
+		if (in.op == Op::call) {     // Function bodies never change, but the variables they read do
+			for (int read : vt.readSlots(vt.getFunction(int(in.value)))) key.push_back(vt.getVersion(read));
+		}
+		if (in.op == Op::reduce && !memoKey(p.subprograms[int(in.value)], vt, key)) return false;      // The body is part of the statement
+	}
+	return true;
+}
+
+template<class T> Status tryEvaluateMemo(const BasicProgram<T>& p, BasicVariables<T>& vt, T& value){
+	BasicMemoCache<T>& cache = vt.getMemo();
+	if (!cache.enabled()) return tryEvaluate(p, vt, value);
+
+	std::vector<uint64_t>& key = cache.scratch();
+	key.clear();
+	if (!memoKey(p, vt, key)) return tryEvaluate(p, vt, value);
+
+	if (cache.find(key, value)) {
+		STATS_COUNT(memoHits);
+		return Status{};
+	}
+	STATS_COUNT(memoMisses);
+	Status s = tryEvaluate(p, vt, value);
+	if (s) cache.store(cache.scratch(), value);
+	return s;
+}
+
+
+// Reductions: sum(i, first, last, body) and the like, the body reads i as its last argument
+// The range is cut into chunks of a fixed size, so the terms are grouped the same way whatever the number of threads:
+// each chunk is reduced on its own (sums with Neumaier's compensated summation), then the chunks are combined in order,
+// which makes the result the same on every run and every machine
+// Ranges of more than one chunk share their chunks out over a ThreadPool, the calling thread takes chunks as well
+// Reductions inside the body of another one run on the thread that needs them
+// int64 sums and products are exact instead, and overflow when a chunk or the combined total does not fit
+
+template<class T> struct ReductionChunk {
+	Status status;           // First fault of the chunk, later terms are not evaluated
+	T value = 0;
+	T compensation = 0;      // Low order bits lost by the sum so far
+};
+
+template<class T> void addCompensated(T& sum, T& compensation, T x){      // Neumaier's variant of Kahan summation
+	T t = sum + x;
+	if (std::fabs(sum) >= std::fabs(x)) compensation += (sum - t) + x;
+	else compensation += (x - t) + sum;
+	sum = t;
+}
+
+inline ThreadPool& reductionPool(){
+	static ThreadPool pool;      // Started on first use, one thread per core
+	return pool;
+}
+
+inline thread_local bool inReduction = false;
+
+template<class T> ReductionChunk<T> reduceChunk(const BasicProgram<T>& body, Reduction kind, int64_t first, int64_t last, const T* args, BasicVariables<T>& vt){
+	// Never empty, first <= last
+	// Arguments of the enclosing function body (if any), then the index
+	int count = body.parameters.size();
+	T local[8];
+	std::vector<T> heap;
+	T* a = local;
+	if (count > 8) {
+		heap.resize(count);
+		a = heap.data();
+	}
+	for (int i = 0; i < count - 1; i++) a[i] = args[i];
+
+	ReductionChunk<T> c;
+	if (kind == Reduction::prod) c.value = 1;
+	for (int64_t i = first; ; i++) {      // Stops on last itself, i++ past INT64_MAX would overflow
+		a[count - 1] = T(i);
+		T term;
+		c.status = tryEvaluate(body, vt, term, a);
+		if (!c.status) return c;
+		switch (kind) {
+		case Reduction::sum:
+			if constexpr (std::is_integral_v<T>) {
+				if (!addExact(c.value, term)) c.status = Status{Fault::overflow};
+			}
+			else addCompensated(c.value, c.compensation, term);
+			break;
+		case Reduction::prod:
+			if constexpr (std::is_integral_v<T>) {
+				if (!multiplyExact(c.value, term)) c.status = Status{Fault::overflow};
+			}
+			else c.value *= term;
+			break;
+		case Reduction::min: if (i == first || term < c.value) c.value = term; break;
+		case Reduction::max: if (i == first || term > c.value) c.value = term; break;
+		}
+		if (!c.status || i == last) return c;
+	}
+}
+
+template<class T> Status reduce(const BasicProgram<T>& body, Reduction kind, T first, T last, const T* args, BasicVariables<T>& vt, T& value){
+	if constexpr (!std::is_integral_v<T>) {
+		const T exact = 9007199254740992.0;      // 2^53, every integer up to it is a double
+		if (!(std::fabs(first) <= exact && fabs(last) <= exact) || first != std::floor(first) || last != std::floor(last)) return Status{Fault::infoLoss};
+	}
+	int64_t from = int64_t(first), to = int64_t(last);
+	if (to < from) {
+		if (kind == Reduction::sum) value = 0;
+		else if (kind == Reduction::prod) value = 1;
+		else return Status{Fault::emptyRange};
+		return Status{};
+	}
+	if (from < 0 && to > std::numeric_limits<int64_t>::max() + from) return Status{Fault::overflow};     // More terms than an int64 counts, to - from would not fit
+
+	const int64_t chunkSize = 1 << 13;         // Terms, fixed so the grouping never changes
+	const int64_t blockChunks = 1 << 12;       // Chunks handed out at a time, bounds the memory for their results
+	int64_t chunks = (to - from) / chunkSize + 1;
+	ThreadPool* pool = chunks > 1 && !inReduction ? &reductionPool() : nullptr;
+	bool was = inReduction;
+	inReduction = true;
+
+	T total = kind == Reduction::prod ? 1 : 0;
+	T compensation = 0;
+	Status status;
+	for (int64_t block = 0; block < chunks && status; block += blockChunks) {
+		int64_t count = std::min(blockChunks, chunks - block);
+		auto chunk = [=, &body, &vt](int64_t c) {
+			int64_t start = from + (block + c) * chunkSize;
+			return reduceChunk(body, kind, start, to - start < chunkSize ? to : start + chunkSize - 1, args, vt);      // start + chunkSize may pass INT64_MAX
+		};
+
+		// Chunks are taken in turn by whichever thread is free, their results are kept in place for the ordered combine
+		struct Shared {
+			std::vector<ReductionChunk<T>> results;
+			std::atomic<int64_t> next {0};
+			std::atomic<int64_t> done {0};
+		};
+		auto shared = std::make_shared<Shared>();
+		shared->results.resize(count);
+		auto work = [shared, count, chunk] {
+			bool was = inReduction;
+			inReduction = true;
+			for (int64_t c; (c = shared->next.fetch_add(1)) < count; ) {      // Late tasks find nothing left and never touch the body
+				shared->results[c] = chunk(c);
+				shared->done.fetch_add(1, std::memory_order_release);
+			}
+			inReduction = was;
+		};
+		if (pool) for (int t = 1; t < std::min<int64_t>(pool->size(), count); t++) pool->submit(work);
+		work();
+		while (shared->done.load(std::memory_order_acquire) < count) std::this_thread::yield();
+
+		for (int64_t i = 0; i < count; i++) {
+			const ReductionChunk<T>& c = shared->results[i];
+			if (!c.status) {
+				status = c.status;      // Fault of the lowest index, as a sequential loop would give
+				break;
+			}
+			bool firstChunk = block == 0 && i == 0;
+			switch (kind) {
+			case Reduction::sum:
+				if constexpr (std::is_integral_v<T>) {
+					if (!addExact(total, c.value)) status = Status{Fault::overflow};
+				}
+				else {
+					addCompensated(total, compensation, c.value);
+					compensation += c.compensation;
+				}
+				break;
+			case Reduction::prod:
+				if constexpr (std::is_integral_v<T>) {
+					if (!multiplyExact(total, c.value)) status = Status{Fault::overflow};
+				}
+				else total *= c.value;
+				break;
+			case Reduction::min: if (firstChunk || c.value < total) total = c.value; break;
+			case Reduction::max: if (firstChunk || c.value > total) total = c.value; break;
+			}
+			if (!status) break;
+		}
+	}
+	inReduction = was;
+	if (!status) return status;
+	if constexpr (std::is_integral_v<T>) value = total;
+	else value = std::isfinite(total) ? total + compensation : total;      // The compensation of an infinite sum is not a number
+	return Status{};
+}
+
+
+// Recomputes the bound variables that depend, directly or not, on the variable in slot
+// Only those are dirty: they are collected first, then recomputed once each in the order they were bound,
+// which is a topological order since a bound expression can only read variables that existed before it
+template<class T> Status propagate(BasicVariables<T>& vt, int slot){
+	std::vector<int> dirty;
+	std::unordered_set<int> seen;
+	std::vector<int> work {slot};
+	while (!work.empty()) {
+		int s = work.back();
+		work.pop_back();
+		if (!vt.hasDependents(s)) continue;
+		for (int d : vt.getDependents(s)) {
+			if (!seen.insert(d).second) continue;
+			dirty.push_back(d);
+			work.push_back(d);
+		}
+	}
+
+	std::sort(dirty.begin(), dirty.end(), [&vt](int a, int b) { return vt.getBindingOrder(a) < vt.getBindingOrder(b); });
+	for (int d : dirty) {
+		T value;
+		Status s = tryEvaluate(*vt.getBinding(d), vt, value);
+		if (!s) return s;
+		vt.updateBound(d, value);
+	}
+	return Status{};
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "Common.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Evaluator.h"
+#include <mutex>
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define CALCULATOR_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#endif
+
+namespace calc {
+
+// Optional native backend for programs that are evaluated a very large number of times
+// A NativeProgram turns the stack code of a Program into x86-64 machine code (SSE2 scalar doubles) in an executable page,
+// with the values of the stack kept in a small array and variables read straight from the AvailableVariables
+//
+// The generated code makes the same checks as evaluate() (division and modulo by zero, square root of a negative number,
+// factorial and pow arguments, undefined variables), but only reports that one failed
+// In that case the program is run once more by evaluate(), which raises the usual error: the programs compiled to native code
+// have no side effects, so running them again changes nothing
+//
+// Programs that assign or define variables, and systems other than x86-64 with the System V calling convention,
+// simply keep using evaluate()
+//
+// Code is kept in chunks of executable memory, mapped a few pages at a time rather than a mapping per program
+// Each program starts on a page of its own, and only its pages are writable while its code is written: pages holding
+// code already handed out never change protection, so programs can be compiled while others run on other threads
+
+class NativeProgram {
+public:
+	double run(AvailableVariables& vt);
+	bool isNative() const { return function != nullptr; };
+	const Program& getProgram() const { return program; };
+
+	NativeProgram (const Program& p);
+	~NativeProgram ();
+	NativeProgram (const NativeProgram&) = delete;
+	NativeProgram& operator= (const NativeProgram&) = delete;
+private:
+	Program program;      // Kept for the fallback and to report errors
+	typedef int (*Function)(const Variable* variables, double* stack);
+	Function function = nullptr;
+	int chunk = -1;       // Chunk of the CodeArena holding the code
+
+	void compile();
+};
+
+
+#ifdef CALCULATOR_JIT
+
+// Called from the generated code for the operations with no single instruction
+// Operands are at x[0] and x[1], the result goes to x[0], non zero means the operation failed
+namespace jit {
+	extern "C" inline int powHelper(double* x){
+		int i = int(x[1]);
+		if (double(i) != x[1]) return 1;      // Same test as narrow_cast<int>
+		x[0] = std::pow(x[0], i);
+		return 0;
+	}
+
+	extern "C" inline int modHelper(double* x){
+		if (x[1] == 0) return 1;
+		x[0] = std::fmod(x[0], x[1]);
+		return 0;
+	}
+
+	extern "C" inline int factHelper(double* x){
+		int n = int(x[0]);
+		if (double(n) != x[0]) return 1;
+		int fact = 1;
+		for (int i = 1; i <= n; i++) {
+			fact *= i;
+			if (fact < 0) return 1;
+		}
+		x[0] = fact;
+		return 0;
+	}
+
+	// Small x86-64 assembler, only the few instruction forms the backend needs
+	// rbx holds the variables, r12 the value stack, xmm0-xmm2 are scratch
+	class Assembler {
+	public:
+		std::vector<unsigned char> code;
+		std::vector<int> failJumps;      // Positions of rel32 fields to patch with the failure exit
+
+		void bytes(std::initializer_list<int> b) { for (int x : b) code.push_back(x); };
+		void int32(int32_t v) { for (int i = 0; i < 4; i++) code.push_back((v >> (8*i)) & 0xff); };
+		void int64(int64_t v) { for (int i = 0; i < 8; i++) code.push_back((v >> (8*i)) & 0xff); };
+
+		// movsd xmm, [r12 + 8*i] and back
+		void loadStack(int xmm, int i) { bytes({0xF2, 0x41, 0x0F, 0x10, 0x84 | (xmm << 3), 0x24}); int32(8*i); };
+		void storeStack(int i, int xmm) { bytes({0xF2, 0x41, 0x0F, 0x11, 0x84 | (xmm << 3), 0x24}); int32(8*i); };
+		// addsd/subsd/mulsd/divsd/sqrtsd xmm0, [r12 + 8*i]
+		void arithmetic(int opcode, int i) { bytes({0xF2, 0x41, 0x0F, opcode, 0x84, 0x24}); int32(8*i); };
+		// movsd xmm0, [rbx + offset]
+		void loadVariable(int offset) { bytes({0xF2, 0x0F, 0x10, 0x83}); int32(offset); };
+		// cmp byte [rbx + offset], 0
+		void testVariable(int offset) { bytes({0x80, 0xBB}); int32(offset); bytes({0x00}); };
+		// mov rax, imm64 ; mov [r12 + 8*i], rax
+		void storeConstant(int i, double d) { int64_t bits; std::memcpy(&bits, &d, 8); bytes({0x48, 0xB8}); int64(bits); bytes({0x49, 0x89, 0x84, 0x24}); int32(8*i); };
+		// mov rax, [r12 + 8*i] ; btc rax, 63 ; mov [r12 + 8*i], rax
+		void negate(int i) { bytes({0x49, 0x8B, 0x84, 0x24}); int32(8*i); bytes({0x48, 0x0F, 0xBA, 0xF8, 0x3F, 0x49, 0x89, 0x84, 0x24}); int32(8*i); };
+		// xorpd xmm2, xmm2 ; ucomisd xmm, xmm2
+		void compareZero(int xmm) { bytes({0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xC2 | (xmm << 3)}); };
+		// lea rdi, [r12 + 8*i] ; mov rax, helper ; call rax ; test eax, eax ; jne fail
+		void callHelper(int i, int (*helper)(double*)) {
+			bytes({0x49, 0x8D, 0xBC, 0x24}); int32(8*i);
+			bytes({0x48, 0xB8}); int64(reinterpret_cast<int64_t>(helper));
+			bytes({0xFF, 0xD0, 0x85, 0xC0});
+			jumpToFail(0x85);
+		};
+		// Conditional jump (0F xx rel32) to the failure exit, patched once the exit is placed
+		void jumpToFail(int condition) { bytes({0x0F, condition}); failJumps.push_back(code.size()); int32(0); };
+		// jp over the next 6 byte jump, so NaN comparisons (unordered) never count as failures
+		void skipIfNaN() { bytes({0x7A, 0x06}); };
+	};
+
+	// Executable memory shared by all NativePrograms, handed out in chunks of 64 KB
+	// A chunk is unmapped once every program in it is gone and a newer chunk is being filled
+	class CodeArena {
+	public:
+		void* store(const std::vector<unsigned char>& code, int& chunk);     // nullptr if no memory could be mapped or protected
+		void release(int chunk);
+	private:
+		struct Chunk {
+			unsigned char* memory = nullptr;
+			size_t size = 0;
+			size_t used = 0;
+			int live = 0;       // Programs still using the chunk
+		};
+		std::vector<Chunk> chunks;
+		std::mutex lock;
+	};
+
+	inline CodeArena& codeArena(){
+		static CodeArena arena;
+		return arena;
+	}
+}
+
+
+// CodeArena Functions
+
+inline void* jit::CodeArena::store(const std::vector<unsigned char>& code, int& chunk){
+	std::lock_guard<std::mutex> guard (lock);
+	static const size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (code.size() + page - 1) & ~(page - 1);     // Whole pages, which no other program shares
+
+	if (chunks.empty() || chunks.back().used + size > chunks.back().size) {
+		if (!chunks.empty() && chunks.back().live == 0 && chunks.back().memory) {
+			munmap(chunks.back().memory, chunks.back().size);
+			chunks.back().memory = nullptr;
+		}
+		Chunk c;
+		c.size = std::max<size_t>(16 * page, size);
+		void* m = mmap(nullptr, c.size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (m == MAP_FAILED) return nullptr;
+		c.memory = static_cast<unsigned char*>(m);
+		chunks.push_back(c);
+	}
+
+	Chunk& c = chunks.back();
+	unsigned char* at = c.memory + c.used;
+	c.used += size;      // Never given to another program, even if protecting them fails below
+	if (mprotect(at, size, PROT_READ | PROT_WRITE) != 0) return nullptr;     // Never writable and executable at the same time
+	std::memcpy(at, code.data(), code.size());
+	if (mprotect(at, size, PROT_READ | PROT_EXEC) != 0) return nullptr;
+	c.live++;
+	chunk = chunks.size() - 1;
+	return at;
+}
+
+inline void jit::CodeArena::release(int chunk){
+	std::lock_guard<std::mutex> guard (lock);
+	Chunk& c = chunks[chunk];
+	if (--c.live == 0 && chunk != chunks.size() - 1) {     // The last chunk is kept for the next programs
+		munmap(c.memory, c.size);
+		c.memory = nullptr;
+	}
+}
+
+
+inline void NativeProgram::compile(){
+	jit::Assembler a;
+	const int valueOffset = offsetof(Variable, value);
+	const int definedOffset = offsetof(Variable, isDefined);
+	const int tempBase = program.maxDepth;      // Temporary slots follow the stack, as in evaluate()
+
+	// push rbx ; push r12 ; push rax (keeps rsp 16 byte aligned for the helper calls) ; mov rbx, rdi ; mov r12, rsi
+	a.bytes({0x53, 0x41, 0x54, 0x50, 0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4});
+
+	int top = -1;
+	for (const Instruction& in : program.code) {
+		switch (in.op) {
+		case Op::number:
+			a.storeConstant(++top, in.value);
+			break;
+		case Op::load:
+		{
+			int base = in.slot * sizeof(Variable);
+			a.testVariable(base + definedOffset);
+			a.jumpToFail(0x84);                 // je: undefined variable
+			a.loadVariable(base + valueOffset);
+			a.storeStack(++top, 0);
+			break;
+		}
+		case Op::add: case Op::sub: case Op::mul:
+		{
+			int opcode = in.op == Op::add ? 0x58 : in.op == Op::sub ? 0x5C : 0x59;
+			a.loadStack(0, top-1);
+			a.arithmetic(opcode, top);
+			a.storeStack(--top, 0);
+			break;
+		}
+		case Op::div:
+			a.loadStack(1, top);
+			a.compareZero(1);
+			a.skipIfNaN();
+			a.jumpToFail(0x84);                 // je: division by zero
+			a.loadStack(0, top-1);
+			a.arithmetic(0x5E, top);
+			a.storeStack(--top, 0);
+			break;
+		case Op::mod:
+			a.callHelper(--top, jit::modHelper);
+			break;
+		case Op::pow:
+			a.callHelper(--top, jit::powHelper);
+			break;
+		case Op::fact:
+			a.callHelper(top, jit::factHelper);
+			break;
+		case Op::neg:
+			a.negate(top);
+			break;
+		case Op::sqrt:
+			a.loadStack(0, top);
+			a.compareZero(0);
+			a.skipIfNaN();
+			a.jumpToFail(0x82);                 // jb: square root of a negative number
+			a.arithmetic(0x51, top);
+			a.storeStack(top, 0);
+			break;
+		case Op::keep:
+			a.loadStack(0, top);
+			a.storeStack(tempBase + in.slot, 0);
+			break;
+		case Op::recall:
+			a.loadStack(0, tempBase + in.slot);
+			a.storeStack(++top, 0);
+			break;
+		case Op::pop:
+			a.loadStack(0, top--);
+			a.storeStack(tempBase + in.slot, 0);
+			break;
+		default:
+			return;                             // Side effects and function calls: stay with evaluate()
+		}
+	}
+	if (top != 0) return;
+
+	// Result is in stack[0]: xor eax, eax ; pop rcx ; pop r12 ; pop rbx ; ret
+	a.bytes({0x31, 0xC0, 0x59, 0x41, 0x5C, 0x5B, 0xC3});
+	int fail = a.code.size();
+	// mov eax, 1 ; pop rcx ; pop r12 ; pop rbx ; ret
+	a.bytes({0xB8, 0x01, 0x00, 0x00, 0x00, 0x59, 0x41, 0x5C, 0x5B, 0xC3});
+	for (int at : a.failJumps) {
+		int32_t rel = fail - (at + 4);
+		std::memcpy(&a.code[at], &rel, 4);
+	}
+
+	function = reinterpret_cast<Function>(jit::codeArena().store(a.code, chunk));
+}
+
+inline NativeProgram::~NativeProgram(){
+	if (function) jit::codeArena().release(chunk);
+}
+
+#else
+
+inline void NativeProgram::compile() {}      // No native backend on this system
+inline NativeProgram::~NativeProgram() {}
+
+#endif
+
+
+inline NativeProgram::NativeProgram(const Program& p): program {p} {
+	compile();
+}
+
+inline double NativeProgram::run(AvailableVariables& vt){
+	if (!function) return evaluate(program, vt);
+
+	const int localSize = 64;
+	double local[localSize];
+	std::vector<double> heap;
+	double* stack = local;
+	if (program.maxDepth + program.temps > localSize) {
+		heap.resize(program.maxDepth + program.temps);
+		stack = heap.data();
+	}
+
+	if (function(vt.variables(), stack) != 0) return evaluate(program, vt);     // Raises the error a check found
+	return stack[0];
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "Common.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace calc {
+
+// Whole contents of a file as one contiguous read only buffer, so the TokenStream can lex it straight from memory
+// The file is memory mapped where the system allows it, otherwise it is read in large blocks
+class MappedFile {
+public:
+	const char* begin() const { return data; };
+	const char* end() const { return data + size; };
+	explicit operator bool() const { return opened; };
+
+	MappedFile (const std::string& fileName);
+	~MappedFile ();
+	MappedFile (const MappedFile&) = delete;
+	MappedFile& operator= (const MappedFile&) = delete;
+private:
+	const char* data = nullptr;
+	size_t size = 0;
+	bool opened = false;
+	bool mapped = false;
+	std::string contents;      // Used when the file could not be mapped
+
+	void readBlocks(const std::string& fileName);
+};
+
+
+// MappedFile Functions
+
+inline MappedFile::MappedFile(const std::string& fileName){
+#if defined(__unix__) || defined(__APPLE__)
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat info;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		void* p = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			madvise(p, info.st_size, MADV_SEQUENTIAL);    // Scripts are lexed front to back
+			data = static_cast<const char*>(p);
+			size = info.st_size;
+			mapped = opened = true;
+		}
+	}
+	close(fd);
+	if (mapped) return;
+#endif
+	readBlocks(fileName);     // Empty files, pipes and systems without mmap
+}
+
+inline MappedFile::~MappedFile(){
+#if defined(__unix__) || defined(__APPLE__)
+	if (mapped) munmap(const_cast<char*>(data), size);
+#endif
+}
+
+inline void MappedFile::readBlocks(const std::string& fileName){
+	std::ifstream ifile {fileName, std::ios::binary};
+	if (!ifile) return;
+
+	const size_t blockSize = 1 << 20;
+	size_t total = 0;
+	while (ifile) {
+		contents.resize(total + blockSize);
+		ifile.read(&contents[total], blockSize);
+		total += ifile.gcount();
+	}
+	contents.resize(total);
+	data = contents.data();
+	size = total;
+	opened = true;
+}
+
+}	// namespace calc
+
+#endif
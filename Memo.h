@@ -0,0 +1,128 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "Common.h"
+
+namespace calc {
+
+// Results of statements already evaluated, for clients sending the same statements over and over
+// A key is a list of words: the code of a program together with the versions of the variables it reads
+// (built by evaluateMemo() in Evaluator.h), so a result is only found again while none of those variables changed
+//
+// At most capacity results are kept, the least recently used one makes room for a new one
+// Entries live in one vector linked into a list by index, and their keys keep their memory when they are reused
+
+template<class T> class BasicMemoCache {
+public:
+	bool find(const std::vector<uint64_t>& key, T& value);
+	void store(const std::vector<uint64_t>& key, T value);
+	void setCapacity(int n);      // Zero turns the cache off
+	int getCapacity() const { return capacity; };
+	bool enabled() const { return capacity > 0; };
+	uint64_t getHits() const { return hits; };
+	uint64_t getMisses() const { return misses; };
+	std::vector<uint64_t>& scratch() { return key; };      // To build keys in without allocating
+
+	BasicMemoCache (int n = 1024): capacity {n} {};
+private:
+	struct Entry {
+		std::vector<uint64_t> key;
+		uint64_t hash;
+		T value;
+		int newer = -1;        // Neighbours in the list from most to least recently used
+		int older = -1;
+	};
+	std::vector<Entry> entries;
+	std::unordered_map<uint64_t, int> index;      // Hash of a key to its entry
+	int newest = -1;
+	int oldest = -1;
+	int capacity;
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	std::vector<uint64_t> key;
+
+	static uint64_t hashKey(const std::vector<uint64_t>& key);
+	void unlink(int e);
+	void pushNewest(int e);
+};
+
+using MemoCache = BasicMemoCache<double>;      // Caches of the other number types (see Number.h) are only used by their own tables
+
+
+// MemoCache Functions
+
+template<class T> uint64_t BasicMemoCache<T>::hashKey(const std::vector<uint64_t>& key){
+	uint64_t h = 14695981039346656037ull;
+	for (uint64_t w : key) h = (h ^ w) * 1099511628211ull;
+	return h ^ (h >> 32);
+}
+
+template<class T> void BasicMemoCache<T>::unlink(int e){
+	Entry& x = entries[e];
+	if (x.newer >= 0) entries[x.newer].older = x.older;
+	else newest = x.older;
+	if (x.older >= 0) entries[x.older].newer = x.newer;
+	else oldest = x.newer;
+	x.newer = x.older = -1;
+}
+
+template<class T> void BasicMemoCache<T>::pushNewest(int e){
+	entries[e].older = newest;
+	entries[e].newer = -1;
+	if (newest >= 0) entries[newest].newer = e;
+	newest = e;
+	if (oldest < 0) oldest = e;
+}
+
+template<class T> bool BasicMemoCache<T>::find(const std::vector<uint64_t>& k, T& value){
+	auto found = index.find(hashKey(k));
+	if (found == index.end() || entries[found->second].key != k) {     // Keys are compared in full, hashes may collide
+		misses++;
+		return false;
+	}
+	int e = found->second;
+	if (e != newest) {
+		unlink(e);
+		pushNewest(e);
+	}
+	value = entries[e].value;
+	hits++;
+	return true;
+}
+
+template<class T> void BasicMemoCache<T>::store(const std::vector<uint64_t>& k, T value){
+	if (capacity <= 0) return;
+	uint64_t h = hashKey(k);
+	int e;
+	auto found = index.find(h);
+	if (found != index.end()) {         // Same hash (a colliding key), take over its entry
+		e = found->second;
+		unlink(e);
+	}
+	else if (entries.size() < capacity) {
+		entries.push_back(Entry{});
+		e = entries.size() - 1;
+	}
+	else {                              // Full: reuse the least recently used entry
+		e = oldest;
+		unlink(e);
+		index.erase(entries[e].hash);
+	}
+	Entry& x = entries[e];
+	x.key.assign(k.begin(), k.end());
+	x.hash = h;
+	x.value = value;
+	index[h] = e;
+	pushNewest(e);
+}
+
+template<class T> void BasicMemoCache<T>::setCapacity(int n){
+	capacity = std::max(n, 0);
+	entries.clear();
+	index.clear();
+	newest = oldest = -1;
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include "Common.h"
+
+namespace calc {
+
+// The numbers a session calculates with, chosen once when it starts (calculator --numbers, Options::numbers in Context.h)
+// Programs, the compiler, the evaluator and the variable table are templates on the type (BasicProgram<T>,
+// BasicVariables<T>, ...), so each type is an instantiation of its own and nothing looks at the type while a program runs
+// Program, AvailableVariables and the rest are the double versions, the only ones the parallel, streaming,
+// batch, native code and server paths use
+//	double       what the calculator always used, the default
+//	float        half the memory for every value
+//	long double  more digits, where the machine has them
+//	int64        exact integers: division truncates, and overflow is an error instead of a rounded value
+
+enum class NumberType : char { real, single, extended, integer };     // real is 0, what snapshots written before had
+
+template<class T> struct Number;
+template<> struct Number<double> {
+	static constexpr NumberType type = NumberType::real;
+	static constexpr const char* name = "double";
+};
+template<> struct Number<float> {
+	static constexpr NumberType type = NumberType::single;
+	static constexpr const char* name = "float";
+};
+template<> struct Number<long double> {
+	static constexpr NumberType type = NumberType::extended;
+	static constexpr const char* name = "long double";
+};
+template<> struct Number<int64_t> {
+	static constexpr NumberType type = NumberType::integer;
+	static constexpr const char* name = "int64";
+};
+
+bool parseNumberType(std::string_view name, NumberType& type);
+const char* numberTypeName(NumberType);
+
+
+inline bool parseNumberType(std::string_view name, NumberType& type){      // "long" will do for long double
+	if (name == Number<double>::name) type = NumberType::real;
+	else if (name == Number<float>::name) type = NumberType::single;
+	else if (name == Number<long double>::name || name == "long") type = NumberType::extended;
+	else if (name == Number<int64_t>::name) type = NumberType::integer;
+	else return false;
+	return true;
+}
+
+inline const char* numberTypeName(NumberType type){
+	switch (type) {
+	case NumberType::single: return Number<float>::name;
+	case NumberType::extended: return Number<long double>::name;
+	case NumberType::integer: return Number<int64_t>::name;
+	default: return Number<double>::name;
+	}
+}
+
+}	// namespace calc
+
+#endif
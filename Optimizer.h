@@ -0,0 +1,232 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "Common.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Evaluator.h"
+#include <unordered_set>
+
+namespace calc {
+
+// Optimization pass for programs that are evaluated many times
+// The stack code is turned back into an expression graph, where:
+//	- subtrees made only of numbers and const variables are folded into a single number
+//	- identical subtrees are merged (hash consing), so each one is computed once per evaluation
+// and the graph is then written out again as stack code, keeping shared values in temporary slots (Op::keep / Op::recall)
+//
+// Operations that would fail (eg. 1/0) are never folded, so the error is still raised when the program runs
+// Loads of a variable are only merged while nothing in the program assigns to it in between, counting as assignments
+// the updates of bound variables (# bind y = x*4) that an assignment to a variable they read brings
+
+template<class T> BasicProgram<T> optimize (const BasicProgram<T>&, BasicVariables<T>&);
+
+
+template<class T> class ExpressionGraph {
+public:
+	struct Node {
+		Op op;
+		bool isConst = false;
+		int slot = 0;
+		T value = 0;
+		int a = -1;            // Operands, -1 if not used
+		int b = -1;
+		int generation = 0;    // For loads: number of writes to the slot before this load
+		int uses = 0;
+		int temp = -1;         // Temporary slot holding the value once computed, if used more than once
+	};
+	std::vector<Node> nodes;
+
+	int add(Node n);       // Returns an existing identical node when there is one
+	int number(T value);
+
+private:
+	struct Key {
+		Op op;
+		bool isConst;
+		int slot, a, b, generation;
+		T value;
+		bool negative;         // Sign bit, so 0 and -0 stay apart
+		bool operator==(const Key& k) const {
+			return op == k.op && isConst == k.isConst && slot == k.slot && a == k.a && b == k.b && generation == k.generation && value == k.value && negative == k.negative;
+		}
+	};
+	struct KeyHash {
+		size_t operator()(const Key& k) const {
+			uint64_t h = std::hash<T>{}(k.value) ^ (uint64_t(k.op) << 56);
+			for (int x : {k.slot, k.a, k.b, k.generation}) h = (h ^ uint32_t(x)) * 1099511628211ull;
+			return h;
+		}
+	};
+	std::unordered_map<Key, int, KeyHash> seen;
+};
+
+
+// ExpressionGraph Functions
+
+template<class T> int ExpressionGraph<T>::add(Node n){
+	bool sideEffect = n.op == Op::store || n.op == Op::define || n.op == Op::bind;
+	Key key {n.op, n.isConst, n.slot, n.a, n.b, n.generation, n.value, std::signbit(n.value)};
+
+	if (!sideEffect) {
+		auto found = seen.find(key);
+		if (found != seen.end()) return found->second;
+	}
+	nodes.push_back(n);
+	int id = nodes.size() - 1;
+	if (!sideEffect) seen[key] = id;
+	return id;
+}
+
+template<class T> int ExpressionGraph<T>::number(T value){
+	Node n;
+	n.op = Op::number;
+	n.value = value;
+	return add(n);
+}
+
+
+// Try an operation on constants with the evaluator itself, so folding gives exactly the same result (or the same error)
+template<class T> bool foldConstant(Op op, const std::vector<T>& operands, T& result, BasicVariables<T>& vt){
+	BasicProgram<T> p;
+	for (T d : operands) p.emit(Op::number, d);
+	p.emit(op);
+	return bool(tryEvaluate(p, vt, result));      // A failed check is left to raise the error at run time
+}
+
+
+template<class T> BasicProgram<T> optimize(const BasicProgram<T>& p, BasicVariables<T>& vt){
+	using Node = typename ExpressionGraph<T>::Node;
+	ExpressionGraph<T> g;
+	std::vector<int> stack;
+	std::vector<int> writes;        // Writes to each slot seen so far
+
+	// Bound variables of this program, by the variables their expressions read (the table knows the ones bound before)
+	std::unordered_map<int, std::vector<int>> bound;
+	auto write = [&](int slot, bool propagates) {      // propagates: an assignment, which also rewrites the variables bound to slot
+		std::vector<int> work {slot};
+		std::unordered_set<int> seen {slot};
+		while (!work.empty()) {
+			int s = work.back();
+			work.pop_back();
+			if (s >= writes.size()) writes.resize(s+1, 0);
+			writes[s]++;
+			if (!propagates) continue;
+			auto follow = [&](int d) { if (seen.insert(d).second) work.push_back(d); };
+			if (vt.hasDependents(s)) for (int d : vt.getDependents(s)) follow(d);
+			auto found = bound.find(s);
+			if (found != bound.end()) for (int d : found->second) follow(d);
+		}
+	};
+
+	// Replay the program on a stack of graph nodes instead of values
+	for (const BasicInstruction<T>& in : p.code) {
+		Node n;
+		n.op = in.op;
+		n.slot = in.slot;
+		n.isConst = in.isConst;
+		n.value = in.value;
+
+		switch (in.op) {
+		case Op::number:
+			stack.push_back(g.number(in.value));
+			break;
+		case Op::load:
+		{
+			if (vt.isConstant(in.slot)) {     // Const variables never change, use the value
+				stack.push_back(g.number(vt.getValue(in.slot)));
+				break;
+			}
+			if (in.slot < writes.size()) n.generation = writes[in.slot];
+			stack.push_back(g.add(n));
+			break;
+		}
+		case Op::store: case Op::define:
+			write(in.slot, in.op == Op::store);
+			n.a = stack.back();
+			stack.back() = g.add(n);
+			break;
+		case Op::bind:
+			write(in.slot, false);
+			for (int read : vt.readSlots(p.subprograms[int(in.value)])) bound[read].push_back(in.slot);
+			stack.push_back(g.add(n));
+			break;
+		case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::mod: case Op::pow:
+		{
+			n.b = stack.back();
+			stack.pop_back();
+			n.a = stack.back();
+			const Node& x = g.nodes[n.a];
+			const Node& y = g.nodes[n.b];
+			T folded;
+			if (x.op == Op::number && y.op == Op::number && foldConstant(in.op, {x.value, y.value}, folded, vt)) stack.back() = g.number(folded);
+			else stack.back() = g.add(n);
+			break;
+		}
+		case Op::neg: case Op::fact: case Op::sqrt:
+		{
+			n.a = stack.back();
+			const Node& x = g.nodes[n.a];
+			T folded;
+			if (x.op == Op::number && foldConstant(in.op, {x.value}, folded, vt)) stack.back() = g.number(folded);
+			else stack.back() = g.add(n);
+			break;
+		}
+		case Op::arg:
+			stack.push_back(g.add(n));
+			break;
+		case Op::keep: case Op::recall: case Op::pop: case Op::call: case Op::reduce:
+			return p;          // Already optimized, or holds function calls or reductions (see Compiler.h) that are left as they are
+		}
+	}
+	if (stack.size() != 1) return p;
+	int root = stack.back();
+
+	// Count how often each node is needed, walking the graph from the root once per use
+	std::vector<int> work {root};
+	while (!work.empty()) {
+		int id = work.back();
+		work.pop_back();
+		Node& n = g.nodes[id];
+		if (n.uses++ > 0) continue;     // Operands are only counted the first time
+		if (n.a >= 0) work.push_back(n.a);
+		if (n.b >= 0) work.push_back(n.b);
+	}
+
+	// Write the graph out again in the original (post) order, shared values are computed once and then recalled
+	BasicProgram<T> out;
+	out.subprograms = p.subprograms;
+	out.parameters = p.parameters;
+	int temps = 0;
+	std::vector<std::pair<int, bool>> todo {{root, false}};     // Node, operands already written
+	std::vector<char> written(g.nodes.size(), false);
+	while (!todo.empty()) {
+		auto [id, ready] = todo.back();
+		todo.pop_back();
+		Node& n = g.nodes[id];
+
+		if (written[id]) {
+			out.emit(Op::recall, 0, n.temp);
+			continue;
+		}
+		if (!ready) {
+			todo.push_back({id, true});
+			if (n.b >= 0) todo.push_back({n.b, false});
+			if (n.a >= 0) todo.push_back({n.a, false});
+			continue;
+		}
+
+		out.emit(n.op, n.value, n.slot, n.isConst);
+		bool cheap = n.op == Op::number || n.op == Op::load || n.op == Op::arg;     // Cheaper to repeat than to keep
+		if (n.uses > 1 && !cheap) {
+			n.temp = temps++;
+			out.emit(Op::keep, 0, n.temp);
+			written[id] = true;
+		}
+	}
+	return out;
+}
+
+}	// namespace calc
+
+#endif
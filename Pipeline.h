@@ -0,0 +1,233 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "Common.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+#include "Stats.h"
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+namespace calc {
+
+// Streaming mode for big scripts (from stream file): reading, evaluating and writing run on three threads
+//	- the reader reads the file in large blocks and cuts them after their last newline, so a batch only holds whole statements
+//	- the evaluator (the calling thread) compiles and evaluates the statements of each batch, and keeps their results
+//	- the writer hands the results to the ResultWriter, the same way calculate() would have written them
+// The stages are joined by bounded single producer, single consumer rings, so the disk is read and the output
+// written while statements are being evaluated, and a slow stage makes the others wait instead of filling memory
+//
+// Commands (help, stats, from, to, save, load) are not available inside a stream, exit stops it
+
+void calculateStream (const std::string& fileName, AvailableVariables& vt, ResultWriter& out);
+
+
+// Fixed size ring of items passed from one thread to another, without locks
+// Only one thread may push and only one may pop; either of them can close the ring
+template<class T> class SpscRing {
+public:
+	bool push(T&& item);      // Waits for room, false if the ring was closed
+	bool pop(T& item);        // Waits for an item, false once the ring is closed and empty
+	void close();
+
+	SpscRing (int capacity);       // Rounded up to a power of two
+	SpscRing (const SpscRing&) = delete;
+	SpscRing& operator= (const SpscRing&) = delete;
+private:
+	std::vector<T> slots;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head {0};       // Next item to pop, only written by the consumer
+	alignas(64) std::atomic<size_t> tail {0};       // Next free slot, only written by the producer
+	alignas(64) std::atomic<bool> closed {false};
+
+	static void backOff(int& spins);
+};
+
+struct StreamBatch {        // Whole statements read from the file
+	std::string text;
+	int firstLine = 1;        // Line of the file the text starts on, for the positions in error messages
+};
+
+struct StreamResult {       // Outcome of one statement
+	double value = 0;
+	int message = -1;         // Error message in the batch, -1 if the statement gave a value
+	bool result = false;      // '=' written before the value or error, as calculate() does once a statement is parsed
+	bool defined = false;     // Function definition, nothing written after the prompt
+};
+
+struct StreamResults {
+	std::vector<StreamResult> results;
+	std::vector<std::string> messages;
+};
+
+
+// SpscRing Functions
+
+template<class T> SpscRing<T>::SpscRing(int capacity){
+	size_t size = 1;
+	while (size < capacity) size *= 2;
+	slots.resize(size);
+	mask = size - 1;
+}
+
+template<class T> void SpscRing<T>::backOff(int& spins){     // Short waits spin, long ones (eg. on the disk) sleep
+	if (++spins < 64) std::this_thread::yield();
+	else std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+template<class T> bool SpscRing<T>::push(T&& item){
+	size_t t = tail.load(std::memory_order_relaxed);
+	int spins = 0;
+	while (t - head.load(std::memory_order_acquire) > mask) {        // Full
+		if (closed.load(std::memory_order_acquire)) return false;
+		backOff(spins);
+	}
+	if (closed.load(std::memory_order_acquire)) return false;
+	slots[t & mask] = std::move(item);
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+template<class T> bool SpscRing<T>::pop(T& item){
+	size_t h = head.load(std::memory_order_relaxed);
+	int spins = 0;
+	while (h == tail.load(std::memory_order_acquire)) {         // Empty
+		if (closed.load(std::memory_order_acquire) && h == tail.load(std::memory_order_acquire)) return false;
+		backOff(spins);
+	}
+	item = std::move(slots[h & mask]);
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+template<class T> void SpscRing<T>::close(){
+	closed.store(true, std::memory_order_release);
+}
+
+
+// Pipeline Functions
+
+inline void calculateStream(const std::string& fileName, AvailableVariables& vt, ResultWriter& out){
+	std::ifstream file {fileName, std::ios_base::binary};
+	if (!file) error ("Error ocurred for opening of file.");
+
+	const size_t blockSize = 1 << 18;
+	const int ringSize = 8;          // Batches in flight between two stages
+	SpscRing<StreamBatch> batches {ringSize};
+	SpscRing<StreamResults> results {ringSize};
+	bool lastPrompt = true;          // calculate() prompts once more when it reads the end of the input (not when it runs out first)
+
+	std::thread reader {[&] {
+		std::string carry;          // Statement cut by the end of the last block
+		int line = 1;
+		while (true) {
+			std::string batch = std::move(carry);
+			size_t size = batch.size();
+			batch.resize(size + blockSize);
+			file.read(&batch[size], blockSize);
+			batch.resize(size + file.gcount());
+			if (batch.empty()) break;
+
+			size_t cut = batch.rfind('\n');
+			if (file && cut == std::string::npos) {      // No whole statement yet, keep reading
+				carry = std::move(batch);
+				continue;
+			}
+			if (file) {
+				carry.assign(batch, cut + 1, std::string::npos);
+				batch.resize(cut + 1);
+			}
+			int first = line;
+			line += std::count(batch.begin(), batch.end(), '\n');
+			if (!batches.push(StreamBatch{std::move(batch), first})) break;      // The evaluator stopped early (exit)
+			if (!file) break;
+		}
+		batches.close();
+	}};
+
+	std::thread writer {[&] {
+		StreamResults r;
+		while (results.pop(r)) {
+			for (const StreamResult& s : r.results) {
+				out.prompt();
+				if (s.defined) continue;
+				if (s.result) out.result();
+				if (s.message >= 0) out.error(r.messages[s.message]);
+				else out.value(s.value);
+			}
+		}
+		if (lastPrompt) out.prompt();       // Set before results was closed
+	}};
+
+	StreamBatch batch;
+	bool stopped = false;
+	while (!stopped && batches.pop(batch)) {
+		StreamResults r;
+		TokenStream ts (batch.text.data(), batch.text.data() + batch.text.size(), out);     // Only used for its tokens, results go to the writer
+		ts.in.setName(fileName, batch.firstLine);
+		lastPrompt = false;
+		while (ts.in) {
+			StreamResult s;
+			try {
+				Token t = ts.get();
+				while (t.kind==print) t = ts.get();
+				if (t.kind==eof || t.kind==quit) {
+					lastPrompt = true;
+					stopped = t.kind==quit;
+					break;
+				}
+				if (isCommand(t.kind)) error("Command not available in streaming mode.");
+
+				ts.putBack(t);
+				STATS_TIME(statement);
+				Program p;
+				s.result = true;
+				if (!compileStatement(ts, vt, p)) {
+					STATS_COUNT(errors);
+					s.message = r.messages.size();
+					r.messages.push_back(ts.diagnostic().message);
+					ts.clean();
+					r.results.push_back(s);
+					continue;
+				}
+				if (p.code.empty()) s.defined = true;      // Function definition
+				else {
+					p = optimize(p, vt);
+					Status status;
+					{
+						STATS_TIME(evaluate);
+						status = tryEvaluateMemo(p, vt, s.value);
+					}
+					if (status) STATS_COUNT(statements);
+					else {
+						STATS_COUNT(errors);
+						ts.failStatement(faultMessage(status, vt));
+						s.message = r.messages.size();
+						r.messages.push_back(ts.diagnostic().message);
+						ts.clean();
+					}
+				}
+			}
+			catch (std::exception& e){
+				STATS_COUNT(errors);
+				s.message = r.messages.size();
+				r.messages.push_back(e.what());
+				ts.clean();
+			}
+			r.results.push_back(s);
+		}
+		results.push(std::move(r));
+	}
+
+	batches.close();                // Lets the reader stop if exit came before the end of the file
+	results.close();
+	reader.join();
+	writer.join();
+}
+
+}	// namespace calc
+
+#endif
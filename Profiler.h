@@ -0,0 +1,187 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "Common.h"
+#include "Token.h"
+#include "Stats.h"
+
+namespace calc {
+
+// Per line profile of a script run with 'from profile file.txt'
+// Every statement read from a file is timed from its first token to its result, together with the variable lookups
+// it made (the lookups counter of Stats.h, so none without statistics), and added to the line it starts on
+// A nested 'from' is a statement of its line too: its time and lookups count as total for that line,
+// and as self time for the lines of the nested file, so the report can be sorted on self time
+//
+// At the end the calculator writes the hot lines (report), and a trace of every statement in the Chrome trace event
+// format (writeTrace), which trace viewers such as Perfetto or chrome://tracing show as nested spans on a time line
+
+class Profiler {
+public:
+	// Times one statement for the profiler, if any, from the token that starts it until the scope ends
+	class Scope {
+	public:
+		Scope (Profiler* p, TokenStream& ts);
+		Scope (Profiler* p, const std::string& fileName, int line);      // Statement replayed from a cached script
+		~Scope ();
+		Scope (const Scope&) = delete;
+		Scope& operator= (const Scope&) = delete;
+	private:
+		Profiler* profiler;
+		int file = 0;
+		int line = 0;
+		uint64_t start = 0;
+		uint64_t lookups = 0;
+	};
+
+	void report(std::ostream& os, size_t top = 20) const;      // Lines with the most self time first
+	void writeTrace(std::ostream& os) const;
+
+	Profiler (): origin {std::chrono::steady_clock::now()} {};
+private:
+	struct Line {
+		int file;
+		int line;
+		uint64_t calls = 0;
+		uint64_t nanoseconds = 0;       // Total, nested files included
+		uint64_t selfNanoseconds = 0;
+		uint64_t lookups = 0;           // Self
+	};
+	struct Event {                      // One statement on the trace
+		int file, line, depth;
+		uint64_t start, duration;       // Nanoseconds since the profiler started
+		uint64_t lookups;
+	};
+	struct Open {                       // Statement still running, what the statements nested in it used
+		uint64_t nanoseconds = 0;
+		uint64_t lookups = 0;
+	};
+	static const size_t maxEvents = 1 << 20;      // The trace keeps the first ones, the lines count them all
+
+	std::chrono::steady_clock::time_point origin;
+	std::vector<std::string> files;
+	std::unordered_map<std::string, int> fileIndex;
+	std::unordered_map<uint64_t, Line> lines;     // By file << 32 | line
+	std::vector<Event> events;
+	uint64_t dropped = 0;                         // Events past maxEvents
+	std::vector<Open> open;
+
+	uint64_t now() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count(); };
+	int fileNumber(const std::string& name);
+	static uint64_t lookupCount() { return stats::threadCount(stats::Counter::lookups); };
+	static void writeString(std::ostream& os, const std::string& s);
+};
+
+
+// Profiler Functions
+
+inline Profiler::Scope::Scope(Profiler* p, TokenStream& ts): profiler {p} {
+	if (!profiler) return;
+	if (ts.in.getName().empty()) {      // Only lines of files are profiled
+		profiler = nullptr;
+		return;
+	}
+	file = profiler->fileNumber(ts.in.getName());
+	line = ts.statementLine();
+	profiler->open.push_back(Open{});
+	lookups = lookupCount();
+	start = profiler->now();
+}
+
+inline Profiler::Scope::Scope(Profiler* p, const std::string& fileName, int at): profiler {p} {
+	if (!profiler) return;
+	file = profiler->fileNumber(fileName);
+	line = at;
+	profiler->open.push_back(Open{});
+	lookups = lookupCount();
+	start = profiler->now();
+}
+
+inline Profiler::Scope::~Scope(){
+	if (!profiler) return;
+	uint64_t end = profiler->now();
+	uint64_t duration = end - start;
+	uint64_t used = lookupCount() - lookups;
+	Open nested = profiler->open.back();
+	profiler->open.pop_back();
+	if (!profiler->open.empty()) {      // Part of a 'from' line of the file around this one
+		profiler->open.back().nanoseconds += duration;
+		profiler->open.back().lookups += used;
+	}
+
+	Line& l = profiler->lines.try_emplace(uint64_t(file) << 32 | uint32_t(line), Line{file, line}).first->second;
+	l.calls++;
+	l.nanoseconds += duration;
+	l.selfNanoseconds += duration - nested.nanoseconds;
+	l.lookups += used - nested.lookups;
+
+	if (profiler->events.size() < maxEvents) {
+		profiler->events.push_back(Event{file, line, int(profiler->open.size()), start, duration, used - nested.lookups});
+	}
+	else profiler->dropped++;
+}
+
+inline int Profiler::fileNumber(const std::string& name){
+	auto found = fileIndex.find(name);
+	if (found != fileIndex.end()) return found->second;
+	files.push_back(name);
+	fileIndex[name] = files.size() - 1;
+	return files.size() - 1;
+}
+
+inline void Profiler::report(std::ostream& os, size_t top) const {
+	std::vector<const Line*> sorted;
+	uint64_t statements = 0, self = 0;
+	for (const auto& entry : lines) {
+		sorted.push_back(&entry.second);
+		statements += entry.second.calls;
+		self += entry.second.selfNanoseconds;
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const Line* a, const Line* b) {
+		if (a->selfNanoseconds != b->selfNanoseconds) return a->selfNanoseconds > b->selfNanoseconds;
+		return a->file != b->file ? a->file < b->file : a->line < b->line;
+	});
+
+	os << "Profile: " << statements << " statements on " << lines.size() << " lines, "
+		<< std::fixed << std::setprecision(3) << self * 1e-6 << " ms";
+	os << '\n' << std::right << std::setw(12) << "self ms" << std::setw(12) << "total ms" << std::setw(8) << "self %"
+		<< std::setw(10) << "calls" << std::setw(10) << "lookups" << "  line";
+	for (size_t i = 0; i < sorted.size() && i < top; i++) {
+		const Line& l = *sorted[i];
+		os << '\n' << std::setw(12) << std::setprecision(3) << l.selfNanoseconds * 1e-6 << std::setw(12) << l.nanoseconds * 1e-6
+			<< std::setw(8) << std::setprecision(1) << (self ? 100.0 * l.selfNanoseconds / self : 0)
+			<< std::setw(10) << l.calls << std::setw(10) << l.lookups << "  " << files[l.file] << ':' << l.line;
+	}
+	if (sorted.size() > top) os << "\n(" << sorted.size() - top << " more lines)";
+	os << std::defaultfloat << std::setprecision(6);
+}
+
+inline void Profiler::writeString(std::ostream& os, const std::string& s){      // As a JSON string
+	os << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\') os << '\\' << c;
+		else if ((unsigned char)c < 0x20) os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+		else os << c;
+	}
+	os << '"';
+}
+
+inline void Profiler::writeTrace(std::ostream& os) const {
+	// Complete events ("ph":"X") in microseconds, nested by time on a single thread
+	os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	os << std::fixed << std::setprecision(3);
+	for (size_t i = 0; i < events.size(); i++) {
+		const Event& e = events[i];
+		os << (i ? ",\n" : "\n") << "{\"name\":";
+		writeString(os, files[e.file] + ":" + std::to_string(e.line));
+		os << ",\"cat\":\"statement\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+			<< ",\"ts\":" << e.start * 1e-3 << ",\"dur\":" << e.duration * 1e-3
+			<< ",\"args\":{\"lookups\":" << e.lookups << ",\"depth\":" << e.depth << "}}";
+	}
+	os << "\n],\"otherData\":{\"dropped_events\":" << dropped << "}}\n";
+	os << std::defaultfloat << std::setprecision(6);
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+#include "Common.h"
+
+namespace calc {
+
+// A Program is the compiled form of one statement: a flat array of instructions for a small stack machine
+// It is built once by the functions in Compiler.h and can then be run any number of times by evaluate() in Evaluator.h,
+// without going through the TokenStream again
+
+enum class Op : char {
+	number,        // Push value
+	load,          // Push value of variable in slot
+	store,         // Assign top of stack to variable in slot (value stays on the stack)
+	define,        // Define variable in slot with top of stack (value stays on the stack)
+	add, sub, mul, div, mod,     // Pop two values, push result
+	neg, fact, sqrt,             // Replace top of stack
+	pow,           // Pop base and exponent, push base^exponent
+	keep,          // Copy top of stack into temporary slot (value stays on the stack)
+	recall,        // Push value of temporary slot
+	bind,          // Define variable in slot bound to a subprogram, and push its value
+	pop,           // Move top of stack into temporary slot (arguments of inlined function calls)
+	arg,           // Push argument number slot, in function bodies
+	call,          // Pop slot arguments, push the result of function number value (see AvailableVariables::getFunction)
+	reduce         // Pop the bounds of an index range, push the Reduction slot of subprogram value over it (sum(i, 1, n, ...))
+};
+
+// Reductions over an index range, the body reads the index as its last parameter
+enum class Reduction : char { sum, prod, min, max };
+
+template<class T> struct BasicInstruction {
+	Op op;
+	bool isConst;     // Only used by define
+	int slot;         // Variable slot for load, store and define, temporary slot for keep and recall
+	T value;          // Literal for number, index of the subprogram for bind and reduce
+};
+
+// Programs are templates on the type of their numbers (see Number.h), Program is the double one
+template<class T> class BasicProgram {
+public:
+	using Instruction = BasicInstruction<T>;
+
+	std::vector<Instruction> code;
+	int maxDepth = 0;      // Size of the stack needed to run the program
+	int temps = 0;         // Number of temporary slots, used by programs that went through optimize() in Optimizer.h
+	std::vector<BasicProgram> subprograms;     // Expressions kept by bound variables (# bind y = ...) and bodies of reductions
+	std::vector<std::string_view> parameters;  // For function bodies (# f(x, y) = ...), names of the parameters read with Op::arg
+
+	void emit(Op op, T value = 0, int slot = 0, bool isConst = false);
+	void clear();          // Empty again, keeping the memory for the next statement
+private:
+	int depth = 0;         // Stack depth at the end of the code emitted so far
+};
+
+using Instruction = BasicInstruction<double>;
+using Program = BasicProgram<double>;
+
+// Program function definitions
+
+template<class T> void BasicProgram<T>::emit(Op op, T value, int slot, bool isConst){
+	code.push_back(Instruction{op, isConst, slot, value});
+
+	// Keep track of how deep the stack gets, so evaluate() can size it before running
+	switch (op) {
+	case Op::number: case Op::load: case Op::recall: case Op::bind: case Op::arg:
+		depth++;
+		break;
+	case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::mod: case Op::pow: case Op::pop: case Op::reduce:
+		depth--;
+		break;
+	case Op::call:
+		depth -= slot - 1;
+		break;
+	default:
+		break;
+	}
+	if (depth > maxDepth) maxDepth = depth;
+	if ((op == Op::keep || op == Op::recall || op == Op::pop) && slot >= temps) temps = slot + 1;
+}
+
+template<class T> void BasicProgram<T>::clear(){
+	code.clear();
+	subprograms.clear();
+	parameters.clear();
+	maxDepth = temps = depth = 0;
+}
+
+}	// namespace calc
+
+#endif
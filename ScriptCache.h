@@ -0,0 +1,472 @@
+#ifndef SCRIPTCACHE_H
+#define SCRIPTCACHE_H
+
+#include "Common.h"
+#include "Number.h"
+#include "Token.h"
+#include "Program.h"
+#include "Variable.h"
+#include "Optimizer.h"
+#include <cstddef>
+
+namespace calc {
+
+// Compiled scripts, for files run again and again with 'from' (eg. shared definitions included by many scripts)
+// The first run records each statement as calculate() goes through the file: where its chars are, and the program
+// of each statement that compiled. Running the file again replays the programs without lexing or parsing,
+// and compiles again from their chars only the statements that depend on more than the file: commands,
+// statements with errors, and definitions of functions and bound variables
+// Scripts are found by path, and hit while the file keeps its size and write time, or else its contents
+// (a file written again with the same chars still hits)
+//
+// A program depends on the table it was compiled for through the slots of its variables, which never move once given,
+// the functions it inlined, and sum, prod, min and max, which are reductions only until a function takes the name
+// In that table a program runs as it is. Read back from the cache directory (calculator --script-cache dir), where
+// every script recorded is also written so new processes skip parsing too, its variables are looked up again by name;
+// programs that call functions are not written there, they are compiled again
+// Files of the directory that do not read back whole, or whose checksum does not match, are ignored
+//
+// Programs are recorded as compiled, and go through optimize() (Optimizer.h) the first time they are replayed in their table,
+// whose values the folded constants hold for: a script run again and again pays for folding and sharing once
+
+struct ScriptFile {      // What a script file held when it was recorded
+	uint64_t size = 0;
+	int64_t modified = 0;     // Last write time, in ticks of the file system clock
+	uint64_t hash = 0;        // Of the contents, 0 until they were read
+};
+
+template<class T> struct CachedStatement {
+	BasicProgram<T> program;          // Empty for statements that run from their chars
+	uint32_t begin = 0;               // Chars of the statement in the source of the script
+	uint32_t end = 0;
+	int line = 1;
+	int column = 1;
+	uint8_t reductions = 0;           // Bit for each Reduction the program uses
+	bool optimized = false;           // program went through optimize(), only done once it runs in its table
+	const void* table = nullptr;      // Table the slots of the program are for, nullptr when read from the cache directory
+	std::vector<std::pair<std::string_view, int>> slots;      // Names of those slots, only kept for programs read from the directory
+};
+
+template<class T> struct CachedScript {
+	std::string path;
+	ScriptFile file;
+	std::string source;           // The file as it was
+	bool replayable = true;       // False when statements shared chars (eg. '1 2' on a line), the file then runs as usual
+	bool promptAtEnd = false;     // The run reached the end of the file, where calculate() prompts once more, not exit
+	std::vector<CachedStatement<T>> statements;
+	std::deque<std::string> names;          // Slot and parameter names of programs read from the cache directory
+
+	std::string text(const CachedStatement<T>& s) const;        // The statement, after blanks for what came before it on its line
+	std::string location(const CachedStatement<T>& s) const;    // "file:line:column: ", as TokenStream::statementLocation
+};
+
+// Builds the CachedScript of a file while calculate() runs it
+template<class T> class ScriptRecorder {
+public:
+	CachedScript<T> script;
+
+	void begin(TokenStream& ts);      // First token of a statement read
+	void add(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>* compiled = nullptr);    // Statement done, takes the program
+	void ended() { script.promptAtEnd = true; };
+
+	ScriptRecorder (const std::string& path, const ScriptFile& file, const char* begin, const char* end);
+private:
+	const char* base;                 // Chars of the file being run
+	const char* last;                 // End of the statement before
+	SourcePosition start;
+};
+
+template<class T> class BasicScriptCache {
+public:
+	CachedScript<T>* find(const std::string& path, ScriptFile& file);      // Same size and write time, file gets them
+	CachedScript<T>* find(const std::string& path, ScriptFile& file, const char* begin, const char* end);     // Same contents
+	void store(CachedScript<T> script, const BasicVariables<T>& vt);
+
+	explicit BasicScriptCache (const std::string& dir = ""): directory {dir} {};
+private:
+	std::unordered_map<std::string, CachedScript<T>> scripts;
+	std::string directory;
+
+	std::string filePath(const std::string& path) const;      // In the cache directory
+	bool read(const std::string& path, CachedScript<T>& script) const;
+	void write(const CachedScript<T>& script, const BasicVariables<T>& vt) const;
+};
+
+uint64_t contentHash(const char* begin, const char* end);
+template<class T> bool prepare(CachedStatement<T>& s, BasicVariables<T>& vt);     // False if it has to be compiled again
+
+const char* const reductionNames[] = {"sum", "prod", "min", "max"};      // By Reduction
+
+
+// Layout of a file in the cache directory, in the byte order of the machine that wrote it:
+//	header, path, source, then per statement: begin, end, line, column, reductions, slots (slot, name) and the program
+//	Programs: code (op, isConst, slot, value), parameters, then the subprograms the same way
+// Strings and lists are written as a uint32_t count followed by their items
+struct ScriptCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t statements;
+	uint64_t size;           // ScriptFile of the script
+	int64_t modified;
+	uint64_t hash;
+	uint8_t numbers;         // NumberType of the programs
+	uint8_t replayable;
+	uint8_t promptAtEnd;
+	uint8_t reserved[5];
+	uint64_t checksum;       // contentHash of the file with this field 0
+};
+
+const char scriptCacheMagic[8] = {'C', 'A', 'L', 'C', 'S', 'C', 'R', 'P'};
+const uint32_t scriptCacheVersion = 2;
+
+
+inline uint64_t contentHash(const char* begin, const char* end){      // FNV-1a, a word at a time
+	uint64_t h = 14695981039346656037ull;
+	uint64_t w;
+	for (; end - begin >= 8; begin += 8) {
+		std::memcpy(&w, begin, 8);
+		h = (h ^ w) * 1099511628211ull;
+	}
+	for (; begin < end; begin++) h = (h ^ (unsigned char)*begin) * 1099511628211ull;
+	return h ^ (h >> 32);
+}
+
+template<class P, class F> void visitPrograms(P& p, const F& f){      // p and all its subprograms
+	f(p);
+	for (auto& sub : p.subprograms) visitPrograms(sub, f);
+}
+
+inline bool isVariableOp(Op op){      // Ops whose slot is a variable
+	return op == Op::load || op == Op::store || op == Op::define || op == Op::bind;
+}
+
+
+// CachedScript Functions
+
+template<class T> std::string CachedScript<T>::text(const CachedStatement<T>& s) const {
+	std::string t (s.column - 1, ' ');      // Same columns in errors
+	t.append(source, s.begin, s.end - s.begin);
+	return t;
+}
+
+template<class T> std::string CachedScript<T>::location(const CachedStatement<T>& s) const {
+	return path + ':' + std::to_string(s.line) + ':' + std::to_string(s.column) + ": ";
+}
+
+
+// ScriptRecorder Functions
+
+template<class T> ScriptRecorder<T>::ScriptRecorder(const std::string& path, const ScriptFile& file, const char* begin, const char* end)
+	: script {path, file, std::string(begin, end)}, base {begin}, last {begin} {
+	if (end - begin > UINT32_MAX) script.replayable = false;
+	else script.statements.reserve(std::count(begin, end, '\n') + 1);      // About a statement per line, moved once at most
+}
+
+template<class T> void ScriptRecorder<T>::begin(TokenStream& ts){
+	start = ts.statementPosition();      // Before the statement reads on, so lines are counted once
+}
+
+template<class T> void ScriptRecorder<T>::add(TokenStream& ts, BasicVariables<T>& vt, BasicProgram<T>* compiled){
+	if (!script.replayable) return;
+	const char* end = ts.in.position();
+	if (!start.at || start.at < last || end < start.at) {      // Started on a token the statement before read
+		script.replayable = false;
+		script.statements.clear();
+		script.source.clear();
+		return;
+	}
+	last = end;
+
+	CachedStatement<T> s;
+	s.begin = start.at - base;
+	s.end = end - base;
+	s.line = start.line;
+	s.column = start.column;
+	if (compiled) {
+		bool binds = false;
+		visitPrograms(*compiled, [&](const BasicProgram<T>& p) {
+			for (const BasicInstruction<T>& in : p.code) {
+				if (in.op == Op::bind) binds = true;
+				if (in.op == Op::reduce) s.reductions |= 1 << in.slot;
+			}
+		});
+		if (!binds) {      // Bound programs fold the constants of the time, they are compiled again each run
+			s.program = std::move(*compiled);
+			s.table = &vt;
+		}
+	}
+	script.statements.push_back(std::move(s));
+}
+
+
+// BasicScriptCache Functions
+
+template<class T> CachedScript<T>* BasicScriptCache<T>::find(const std::string& path, ScriptFile& file){
+	std::error_code failed;
+	file.size = std::filesystem::file_size(path, failed);
+	if (failed) return nullptr;
+	file.modified = std::filesystem::last_write_time(path, failed).time_since_epoch().count();
+	if (failed) return nullptr;
+	file.hash = 0;
+
+	auto found = scripts.find(path);
+	if (found == scripts.end() && !directory.empty()) {
+		CachedScript<T> script;
+		if (read(path, script)) found = scripts.emplace(path, std::move(script)).first;
+	}
+	if (found == scripts.end() || found->second.file.size != file.size || found->second.file.modified != file.modified) return nullptr;
+	return &found->second;
+}
+
+template<class T> CachedScript<T>* BasicScriptCache<T>::find(const std::string& path, ScriptFile& file, const char* begin, const char* end){
+	file.hash = contentHash(begin, end);
+	auto found = scripts.find(path);
+	if (found == scripts.end() || found->second.file.size != file.size || found->second.file.hash != file.hash) return nullptr;
+	found->second.file.modified = file.modified;      // Written again with the same chars, the next run hits on the time
+	return &found->second;
+}
+
+template<class T> void BasicScriptCache<T>::store(CachedScript<T> script, const BasicVariables<T>& vt){
+	if (!directory.empty()) write(script, vt);
+	std::string path = script.path;
+	scripts.insert_or_assign(path, std::move(script));
+}
+
+template<class T> std::string BasicScriptCache<T>::filePath(const std::string& path) const {
+	char name[17];
+	uint64_t h = contentHash(path.data(), path.data() + path.size());
+	for (int i = 0; i < 16; i++) name[i] = "0123456789abcdef"[(h >> (60 - 4 * i)) & 15];
+	name[16] = 0;
+	return directory + '/' + name + '.' + Number<T>::name[0] + ".calc-script";      // Eg. 0123456789abcdef.d.calc-script
+}
+
+template<class T> void BasicScriptCache<T>::write(const CachedScript<T>& script, const BasicVariables<T>& vt) const {
+	std::string out;
+	auto put = [&](const void* p, size_t n) { out.append(static_cast<const char*>(p), n); };
+	auto putCount = [&](size_t n) { uint32_t c = n; put(&c, sizeof(c)); };
+	auto putString = [&](std::string_view s) { putCount(s.size()); put(s.data(), s.size()); };
+	std::function<void(const BasicProgram<T>&)> putProgram = [&](const BasicProgram<T>& p) {
+		putCount(p.code.size());
+		for (const BasicInstruction<T>& in : p.code) {
+			uint8_t op = uint8_t(in.op), isConst = in.isConst;
+			int32_t slot = in.slot;
+			put(&op, 1);
+			put(&isConst, 1);
+			put(&slot, sizeof(slot));
+			put(&in.value, sizeof(T));
+		}
+		putCount(p.parameters.size());
+		for (std::string_view name : p.parameters) putString(name);
+		putCount(p.subprograms.size());
+		for (const BasicProgram<T>& sub : p.subprograms) putProgram(sub);
+	};
+
+	// Any name followed by '(' that is a function now: the call may have been inlined, which only holds for this table
+	auto callsFunctions = [&](const CachedStatement<T>& s) {
+		const char* end = script.source.data() + s.end;
+		for (const char* c = script.source.data() + s.begin; c < end; ) {
+			if (!std::isalpha((unsigned char)*c) && *c != '_') {
+				c++;
+				continue;
+			}
+			const char* name = c;
+			while (c < end && (std::isalnum((unsigned char)*c) || *c == '_')) c++;
+			const char* next = c;
+			while (next < end && *next == ' ') next++;
+			if (next < end && *next == '(' && vt.findFunction(std::string_view(name, c - name)) >= 0) return true;
+		}
+		return false;
+	};
+
+	ScriptCacheHeader header {};
+	std::memcpy(header.magic, scriptCacheMagic, sizeof(header.magic));
+	header.version = scriptCacheVersion;
+	header.statements = script.statements.size();
+	header.size = script.file.size;
+	header.modified = script.file.modified;
+	header.hash = script.file.hash;
+	header.numbers = uint8_t(Number<T>::type);
+	header.replayable = script.replayable;
+	header.promptAtEnd = script.promptAtEnd;
+	put(&header, sizeof(header));
+	putString(script.path);
+	putString(script.source);
+
+	const BasicProgram<T> none;
+	std::vector<int> slots;
+	for (const CachedStatement<T>& s : script.statements) {
+		bool portable = s.table == &vt && !callsFunctions(s);
+		int32_t position[4] = {int32_t(s.begin), int32_t(s.end), s.line, s.column};
+		put(position, sizeof(position));
+		put(&s.reductions, 1);
+		slots.clear();
+		if (portable) {
+			visitPrograms(s.program, [&](const BasicProgram<T>& p) {
+				for (const BasicInstruction<T>& in : p.code) {
+					if (isVariableOp(in.op) && std::find(slots.begin(), slots.end(), in.slot) == slots.end()) slots.push_back(in.slot);
+				}
+			});
+		}
+		putCount(slots.size());
+		for (int32_t slot : slots) {
+			put(&slot, sizeof(slot));
+			putString(vt.getName(slot));
+		}
+		putProgram(portable ? s.program : none);
+	}
+
+	header.checksum = contentHash(out.data(), out.data() + out.size());
+	std::memcpy(out.data(), &header, sizeof(header));
+
+	// Written aside then renamed, so other processes never read half a file
+	std::string fileName = filePath(script.path);
+	std::string partial = fileName + ".part" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+	std::ofstream os {partial, std::ios_base::binary};
+	os.write(out.data(), out.size());
+	os.close();
+	std::error_code failed;
+	if (os) std::filesystem::rename(partial, fileName, failed);
+	else std::filesystem::remove(partial, failed);      // A cache that cannot be written is only slower
+}
+
+template<class T> bool BasicScriptCache<T>::read(const std::string& path, CachedScript<T>& script) const {
+	std::ifstream is {filePath(path), std::ios_base::binary};
+	if (!is) return false;
+	std::string in {std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>()};
+	size_t at = 0;
+	auto get = [&](void* p, size_t n) {
+		if (in.size() - at < n) return false;
+		std::memcpy(p, in.data() + at, n);
+		at += n;
+		return true;
+	};
+	auto getCount = [&](uint32_t& n) { return get(&n, sizeof(n)) && n <= in.size() - at; };     // Every item takes a byte at least
+	auto getString = [&](std::string& s) {
+		uint32_t n;
+		if (!getCount(n)) return false;
+		s.assign(in.data() + at, n);
+		at += n;
+		return true;
+	};
+
+	// Programs are emitted again rather than copied, so the depth and temporaries the evaluator sizes are worked out again
+	// Slots have to be variables of the statement and subprograms have to exist, so a damaged file cannot run wild:
+	// arguments are only read where there are some (none at the top and in bound expressions, one more in the body
+	// of a reduction than around it), and temporaries are fewer than the instructions that use them
+	std::function<bool(BasicProgram<T>&, const CachedStatement<T>&)> getProgram = [&](BasicProgram<T>& p, const CachedStatement<T>& s) {
+		uint32_t count;
+		if (!getCount(count)) return false;
+		std::vector<BasicInstruction<T>> code (count);
+		for (BasicInstruction<T>& instruction : code) {
+			uint8_t op, isConst;
+			int32_t slot;
+			T value;
+			if (!get(&op, 1) || !get(&isConst, 1) || !get(&slot, sizeof(slot)) || !get(&value, sizeof(T))) return false;
+			if (op > uint8_t(Op::reduce) || Op(op) == Op::call || slot < 0) return false;
+			instruction = BasicInstruction<T>{Op(op), bool(isConst), slot, value};
+		}
+		if (!getCount(count)) return false;
+		for (uint32_t i = 0; i < count; i++) {
+			script.names.emplace_back();
+			if (!getString(script.names.back())) return false;
+			p.parameters.push_back(script.names.back());
+		}
+		if (!getCount(count)) return false;
+		p.subprograms.resize(count);
+		for (BasicProgram<T>& sub : p.subprograms) {
+			if (!getProgram(sub, s)) return false;
+		}
+
+		int depth = 0;
+		for (const BasicInstruction<T>& in : code) {
+			int operands = 0, results = 1;
+			switch (in.op) {
+			case Op::add: case Op::sub: case Op::mul: case Op::div: case Op::mod: case Op::pow: case Op::reduce: operands = 2; break;
+			case Op::neg: case Op::fact: case Op::sqrt: case Op::store: case Op::define: case Op::keep: operands = 1; break;
+			case Op::pop: operands = 1; results = 0; break;
+			default: break;
+			}
+			if (depth < operands) return false;
+			depth += results - operands;
+			if (isVariableOp(in.op) && std::none_of(s.slots.begin(), s.slots.end(), [&](const auto& v) { return v.second == in.slot; })) return false;
+			if ((in.op == Op::bind || in.op == Op::reduce) && !(in.value >= 0 && in.value < T(p.subprograms.size()))) return false;
+			if (in.op == Op::reduce && in.slot > int(Reduction::max)) return false;
+			if (in.op == Op::arg && in.slot >= p.parameters.size()) return false;
+			if ((in.op == Op::keep || in.op == Op::recall || in.op == Op::pop) && in.slot >= code.size()) return false;
+			if (in.op == Op::bind && !p.subprograms[int(in.value)].parameters.empty()) return false;
+			if (in.op == Op::reduce && p.subprograms[int(in.value)].parameters.size() != p.parameters.size() + 1) return false;
+			p.emit(in.op, in.value, in.slot, in.isConst);
+		}
+		return code.empty() || depth == 1;
+	};
+
+	ScriptCacheHeader header;
+	if (!get(&header, sizeof(header))) return false;
+	if (std::memcmp(header.magic, scriptCacheMagic, sizeof(header.magic)) != 0 || header.version != scriptCacheVersion) return false;
+	uint64_t checksum = header.checksum;
+	std::memset(in.data() + offsetof(ScriptCacheHeader, checksum), 0, sizeof(checksum));
+	if (contentHash(in.data(), in.data() + in.size()) != checksum) return false;
+	if (header.numbers != uint8_t(Number<T>::type)) return false;
+	if (!getString(script.path) || script.path != path) return false;      // Another path with the same hash
+	if (!getString(script.source)) return false;
+	script.file = ScriptFile{header.size, header.modified, header.hash};
+	script.replayable = header.replayable;
+	script.promptAtEnd = header.promptAtEnd;
+	if (header.statements > in.size() - at) return false;
+	script.statements.resize(header.statements);
+	for (CachedStatement<T>& s : script.statements) {
+		int32_t position[4];
+		uint32_t count;
+		if (!get(position, sizeof(position)) || !get(&s.reductions, 1)) return false;
+		if (position[0] < 0 || position[0] > position[1] || size_t(position[1]) > script.source.size() || position[2] < 1 || position[3] < 1) return false;
+		s.begin = position[0];
+		s.end = position[1];
+		s.line = position[2];
+		s.column = position[3];
+		if (!getCount(count)) return false;
+		s.slots.resize(count);
+		for (auto& [name, slot] : s.slots) {
+			int32_t at;
+			script.names.emplace_back();
+			if (!get(&at, sizeof(at)) || !getString(script.names.back())) return false;
+			name = script.names.back();
+			slot = at;
+		}
+		if (!getProgram(s.program, s) || !s.program.parameters.empty()) return false;
+	}
+	return at == in.size();
+}
+
+
+// Ready to run the program of s in vt, moving its variables to their slots in vt the first time it runs there
+template<class T> bool prepare(CachedStatement<T>& s, BasicVariables<T>& vt){
+	if (s.program.code.empty()) return false;
+	for (int r = 0; r <= int(Reduction::max); r++) {
+		if ((s.reductions >> r & 1) && vt.findFunction(reductionNames[r]) >= 0) return false;      // Now a call
+	}
+	if (s.table != &vt) {
+		if (s.table) return false;      // Recorded for another table, whose names are not kept
+
+		std::unordered_map<int, int> moved;
+		for (auto& [name, slot] : s.slots) {
+			int now = vt.getSlot(name);
+			moved[slot] = now;
+			slot = now;
+		}
+		visitPrograms(s.program, [&](BasicProgram<T>& p) {
+			for (BasicInstruction<T>& in : p.code) {
+				if (isVariableOp(in.op)) in.slot = moved[in.slot];
+			}
+		});
+		s.table = &vt;
+	}
+	if (!s.optimized) {      // After the cache directory got it: constants are folded with the values of this table
+		s.program = optimize(s.program, vt);
+		s.optimized = true;
+	}
+	return true;
+}
+
+}	// namespace calc
+
+#endif
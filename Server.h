@@ -0,0 +1,384 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "Common.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+#include "Optimizer.h"
+#include "ThreadPool.h"
+
+#if defined(__linux__)
+#define CALCULATOR_SERVER 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace calc {
+
+// Resident calculator serving many clients at once (calculator --serve address)
+// The address is a port number for TCP on localhost, anything else is the path of a Unix domain socket
+//
+// Every connection is a session with its own variables, which fall back to the constants table given to the server
+// The constants are shared by all sessions and only ever read, so sessions copy a constant on first use without any lock
+//
+// One thread waits on all the sockets with epoll (non blocking I/O), and complete lines received are run by a fixed ThreadPool
+// A session runs on one worker at a time, in the order its lines came in; when the worker is done the event thread is woken
+// through an eventfd to send the results back
+//
+// The client sends statements as it would type them and gets one line per statement back: the value, the error message,
+// or "Function defined." for a function definition, so a client sending many lines at once can match every reply
+// The commands that read or write files (from, to), help and stats are not available, exit closes the connection
+
+class Server {
+public:
+	void run();      // Serves until the process is stopped
+
+	Server (const std::string& address, const AvailableVariables& constants, int threads = 0);
+	~Server ();
+	Server (const Server&) = delete;
+	Server& operator= (const Server&) = delete;
+private:
+	struct Session {
+		int fd;
+		AvailableVariables vt;
+		std::string input;      // Received but not run yet, the last line may be incomplete
+		std::string output;     // Results waiting to be sent
+		size_t sent = 0;        // Part of output already sent
+		bool busy = false;      // A worker is running statements of this session
+		bool closing = false;   // Close once the output is sent (exit, or the client closed its side)
+		bool writing = false;   // Waiting for the socket to accept more output
+
+		Session (int socket, const AvailableVariables* constants): fd {socket}, vt {constants} {};
+	};
+	struct Done {              // Statements run by a worker, handed back to the event thread
+		uint64_t session;
+		std::string output;
+		bool closeSession;
+	};
+
+	const AvailableVariables& constants;
+	ThreadPool pool;
+	int listener = -1;
+	int epoll = -1;
+	int wakeup = -1;           // eventfd written by workers when they finish
+	std::string socketPath;    // Unix socket to remove when the server stops
+	std::unordered_map<uint64_t, std::unique_ptr<Session>> sessions;
+	uint64_t nextSession = 2;  // 0 and 1 are the ids of the listening socket and of the eventfd in epoll
+
+	std::mutex doneMutex;
+	std::vector<Done> done;
+
+	static const size_t maxLine = 1 << 20;        // Longest line a client may send
+	static const size_t maxOutput = 1 << 20;      // Output waiting for a slow client before its lines are put on hold
+
+	void accept();
+	void receive(uint64_t id, Session& s);
+	void send(uint64_t id, Session& s);
+	void dispatch(uint64_t id, Session& s);
+	void finished();
+	void close(uint64_t id);
+	void hangUp(uint64_t id, Session& s);
+	void watch(uint64_t id, Session& s);
+	static std::string runLines(const std::string& lines, AvailableVariables& vt, bool& closeSession);
+};
+
+
+#ifdef CALCULATOR_SERVER
+
+// Server Functions
+
+inline Server::Server(const std::string& address, const AvailableVariables& constantTable, int threads): constants {constantTable}, pool {threads} {
+	bool tcp = !address.empty() && std::all_of(address.begin(), address.end(), [](char c) { return std::isdigit(c); });
+
+	if (tcp) {
+		listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listener < 0) error("Unable to create socket.");
+		int on = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		sockaddr_in a {};
+		a.sin_family = AF_INET;
+		a.sin_port = htons(atoi(address.c_str()));
+		a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);      // Local clients only
+		if (bind(listener, reinterpret_cast<sockaddr*>(&a), sizeof(a)) != 0) error("Unable to listen on port " + address + ".");
+	}
+	else {
+		sockaddr_un a {};
+		if (address.empty() || address.size() >= sizeof(a.sun_path)) error("Socket path '" + address + "' is empty or too long.");
+		listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listener < 0) error("Unable to create socket.");
+		a.sun_family = AF_UNIX;
+		std::memcpy(a.sun_path, address.c_str(), address.size());
+		unlink(address.c_str());       // Left over by a server that did not stop cleanly
+		if (bind(listener, reinterpret_cast<sockaddr*>(&a), sizeof(a)) != 0) error("Unable to listen on socket " + address + ".");
+		socketPath = address;
+	}
+	if (listen(listener, SOMAXCONN) != 0) error("Unable to listen on " + address + ".");
+
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll < 0 || wakeup < 0) error("Unable to set up the server.");
+	epoll_event e {};
+	e.events = EPOLLIN;
+	e.data.u64 = 0;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &e);
+	e.data.u64 = 1;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, wakeup, &e);
+}
+
+inline Server::~Server(){
+	pool.wait();       // Workers may still hold sessions
+	for (auto& s : sessions) ::close(s.second->fd);
+	if (listener >= 0) ::close(listener);
+	if (epoll >= 0) ::close(epoll);
+	if (wakeup >= 0) ::close(wakeup);
+	if (!socketPath.empty()) unlink(socketPath.c_str());
+}
+
+inline void Server::run(){
+	const int batch = 256;
+	epoll_event events[batch];
+	while (true) {
+		int n = epoll_wait(epoll, events, batch, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			error("Server stopped, epoll_wait failed.");
+		}
+		for (int i = 0; i < n; i++) {
+			uint64_t id = events[i].data.u64;
+			if (id == 0) {
+				accept();
+				continue;
+			}
+			if (id == 1) {
+				finished();
+				continue;
+			}
+			auto found = sessions.find(id);
+			if (found == sessions.end()) continue;      // Closed earlier in this batch of events
+			Session& s = *found->second;
+			if (s.closing && (events[i].events & (EPOLLHUP | EPOLLERR))) {     // Gone for good, stop reporting it
+				hangUp(id, s);
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) receive(id, s);
+			if (sessions.count(id) && (events[i].events & EPOLLOUT)) send(id, s);
+		}
+	}
+}
+
+inline void Server::accept(){
+	while (true) {
+		int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) return;      // EAGAIN: nobody else waiting (or out of descriptors, retried on the next event)
+		uint64_t id = nextSession++;
+		sessions[id] = std::make_unique<Session>(fd, &constants);
+		epoll_event e {};
+		e.events = EPOLLIN;
+		e.data.u64 = id;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &e);
+	}
+}
+
+inline void Server::receive(uint64_t id, Session& s){
+	char buffer[65536];
+	while (true) {
+		ssize_t n = read(s.fd, buffer, sizeof(buffer));
+		if (n > 0) {
+			if (!s.closing) s.input.append(buffer, n);
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (n < 0 && errno == EINTR) continue;
+		// Client closed its side (or the connection failed): run what is left, then close
+		if (!s.input.empty() && s.input.back() != '\n') s.input += '\n';
+		s.closing = true;
+		epoll_event e {};
+		e.data.u64 = id;
+		epoll_ctl(epoll, EPOLL_CTL_MOD, s.fd, &e);      // No more reading
+		s.writing = false;
+		break;
+	}
+	if (s.input.size() > maxLine && s.input.find('\n') == std::string::npos) {
+		s.input.clear();
+		s.output += "Line too long.\n";
+		s.closing = true;
+	}
+	dispatch(id, s);
+	send(id, s);
+}
+
+// Hands the complete lines received so far to a worker, unless one is already running this session
+inline void Server::dispatch(uint64_t id, Session& s){
+	if (s.busy || s.output.size() - s.sent > maxOutput) return;
+	size_t end = s.input.rfind('\n');
+	if (end == std::string::npos) return;
+
+	s.busy = true;
+	std::string lines = s.input.substr(0, end + 1);
+	s.input.erase(0, end + 1);
+	Session* session = &s;
+	pool.submit([this, id, session, lines = std::move(lines)] {
+		bool closeSession = false;
+		std::string output = runLines(lines, session->vt, closeSession);
+		{
+			std::lock_guard<std::mutex> lock {doneMutex};
+			done.push_back(Done{id, std::move(output), closeSession});
+		}
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) < 0) {}     // Only fails when the counter is already set, which wakes up just as well
+	});
+}
+
+inline void Server::finished(){
+	uint64_t count;
+	if (read(wakeup, &count, sizeof(count)) < 0) {}
+	std::vector<Done> results;
+	{
+		std::lock_guard<std::mutex> lock {doneMutex};
+		results.swap(done);
+	}
+	for (Done& d : results) {
+		Session& s = *sessions.at(d.session);      // Sessions are never closed while busy
+		s.busy = false;
+		s.output += d.output;
+		if (d.closeSession) {
+			s.closing = true;
+			s.input.clear();
+		}
+		dispatch(d.session, s);
+		send(d.session, s);
+	}
+}
+
+inline void Server::send(uint64_t id, Session& s){
+	while (s.sent < s.output.size()) {
+		ssize_t n = ::send(s.fd, s.output.data() + s.sent, s.output.size() - s.sent, MSG_NOSIGNAL);
+		if (n > 0) {
+			s.sent += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		s.output.clear();      // Client is gone, nothing more to send
+		s.sent = 0;
+		s.input.clear();
+		s.closing = true;
+		break;
+	}
+	if (s.sent == s.output.size()) {
+		s.output.clear();
+		s.sent = 0;
+		dispatch(id, s);       // Lines held back while the output was too big
+	}
+	if (s.closing && !s.busy && s.output.empty() && s.input.find('\n') == std::string::npos) {
+		close(id);
+		return;
+	}
+	watch(id, s);
+}
+
+inline void Server::hangUp(uint64_t id, Session& s){
+	s.input.clear();
+	s.output.clear();
+	s.sent = 0;
+	if (!s.busy) {
+		close(id);
+		return;
+	}
+	epoll_ctl(epoll, EPOLL_CTL_DEL, s.fd, nullptr);     // Closed when the worker is done
+	s.writing = false;
+}
+
+inline void Server::watch(uint64_t id, Session& s){     // Ask for EPOLLOUT only while output is waiting
+	bool waiting = !s.output.empty();
+	if (waiting == s.writing) return;
+	s.writing = waiting;
+	epoll_event e {};
+	e.events = (s.closing ? 0 : EPOLLIN) | (waiting ? EPOLLOUT : 0);
+	e.data.u64 = id;
+	epoll_ctl(epoll, EPOLL_CTL_MOD, s.fd, &e);
+}
+
+inline void Server::close(uint64_t id){
+	Session& s = *sessions.at(id);
+	epoll_ctl(epoll, EPOLL_CTL_DEL, s.fd, nullptr);
+	::close(s.fd);
+	sessions.erase(id);
+}
+
+// Runs complete lines of a session, as calculate() would but with plain results and the errors in the same output
+inline std::string Server::runLines(const std::string& lines, AvailableVariables& vt, bool& closeSession){
+	std::ostringstream os;
+	{
+		ResultWriter out {os, ResultWriter::Format::plain, os};
+		TokenStream ts {lines.data(), lines.data() + lines.size(), out};
+		while (ts.in)
+		try {
+			Token t = ts.get();
+			while (t.kind==print) t = ts.get();
+			if (t.kind==eof) break;
+			if (t.kind==quit) {
+				closeSession = true;
+				break;
+			}
+			if (isCommand(t.kind)) error("Command not available in server sessions.");
+
+			ts.putBack(t);
+			STATS_TIME(statement);
+			Program p;
+			Status s;
+			double value;
+			if (!compileStatement(ts, vt, p)) {
+				STATS_COUNT(errors);
+				out.error(ts.diagnostic().message);
+				ts.clean();
+				continue;
+			}
+			if (p.code.empty()) {      // Function definition, acknowledged so every statement gets its line
+				out.note("Function defined.");
+				continue;
+			}
+			p = optimize(p, vt);
+			{
+				STATS_TIME(evaluate);
+				s = tryEvaluateMemo(p, vt, value);
+			}
+			if (!s) {
+				STATS_COUNT(errors);
+				out.error(faultMessage(s, vt));
+				ts.clean();
+				continue;
+			}
+			out.value(value);
+			STATS_COUNT(statements);
+		}
+		catch (std::exception& e){
+			STATS_COUNT(errors);
+			out.error(e.what());
+			ts.clean();
+		}
+	}
+	return os.str();
+}
+
+#else
+
+inline Server::Server(const std::string&, const AvailableVariables& constantTable, int): constants {constantTable}, pool {1} {
+	error("Server mode needs epoll, it is only available on Linux.");
+}
+inline Server::~Server() {}
+inline void Server::run() {}
+
+#endif
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef STATEMENTGRAPH_H
+#define STATEMENTGRAPH_H
+
+#include "Common.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Evaluator.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <memory>
+#include <unordered_set>
+
+namespace calc {
+
+// Statements of a script, already compiled, together with the read/write dependencies between them
+// Statement j has to wait for an earlier statement i when i writes a variable j reads or writes, or reads a variable j writes
+// Everything else is independent and can be evaluated at the same time on a ThreadPool
+// Results are kept per statement and printed in script order afterwards, so the output matches a sequential run
+//
+// Assigning a variable read by bound variables (# bind y = ...) also rewrites them when the statement runs
+// Those hidden writes are tracked as writes to one extra pseudo variable, read by every statement reading a bound variable
+// Binding a variable writes the pseudo variable too, since it adds to the lists of bound expressions every bind extends
+class StatementGraph {
+public:
+	void add(Program p, const AvailableVariables& vt, std::string location = {});      // location: prefix for its run time errors
+	void addError(std::string message);      // Statement that already failed to compile
+	void run(ThreadPool& pool, AvailableVariables& vt);
+	void print(ResultWriter& out);
+	void clear();
+	bool empty() const { return statements.empty(); };
+private:
+	struct Statement {
+		Program program;
+		bool compiled = true;
+		bool failed = false;
+		double value = 0;
+		std::string message;         // Error raised while compiling or evaluating
+		std::string location;        // Where the statement is in its file, see TokenStream::statementLocation
+		std::vector<int> dependents;      // Statements waiting for this one
+		int dependencies = 0;
+		std::unique_ptr<std::atomic<int>> waiting;     // Dependencies not finished yet, counted down while running
+	};
+	std::vector<Statement> statements;
+
+	// Last statement writing each slot, and the statements reading it since then
+	// Index 0 is the pseudo variable for the bound variables, slots start at 1
+	std::vector<int> lastWriter;
+	std::vector<std::vector<int>> readers;
+
+	// Bound variables defined by the statements so far, and the variables their expressions read
+	std::unordered_set<int> boundSlots;
+	std::unordered_set<int> boundReads;
+	int binds = 0;
+
+	void dependOn(int before, int after);
+	void access(int index, bool write, int self);
+	void read(int slot, int self, const AvailableVariables& vt);
+	void runStatement(int i, ThreadPool& pool, AvailableVariables& vt);
+};
+
+
+// StatementGraph Functions
+
+inline void StatementGraph::dependOn(int before, int after){
+	if (before < 0 || before == after) return;
+	std::vector<int>& d = statements[before].dependents;
+	if (!d.empty() && d.back() == after) return;     // Already added for another slot of the same statement
+	d.push_back(after);
+	statements[after].dependencies++;
+}
+
+inline void StatementGraph::access(int index, bool write, int self){
+	if (index >= lastWriter.size()) {
+		lastWriter.resize(index+1, -1);
+		readers.resize(index+1);
+	}
+	if (!write) {                  // Read after write
+		dependOn(lastWriter[index], self);
+		readers[index].push_back(self);
+	}
+	else {                         // Write after write and write after read
+		dependOn(lastWriter[index], self);
+		for (int r : readers[index]) dependOn(r, self);
+		readers[index].clear();
+		lastWriter[index] = self;
+	}
+}
+
+inline void StatementGraph::read(int slot, int self, const AvailableVariables& vt){
+	access(slot+1, false, self);
+	if (vt.getBinding(slot) || boundSlots.count(slot)) access(0, false, self);     // Bound variables may be rewritten by any assignment
+}
+
+inline void StatementGraph::add(Program p, const AvailableVariables& vt, std::string location){
+	int self = statements.size();
+	statements.push_back(Statement{});
+	statements.back().program = std::move(p);
+	statements.back().location = std::move(location);
+	const Program& program = statements.back().program;
+
+	for (const Instruction& in : program.code) {
+		switch (in.op) {
+		case Op::load:
+			read(in.slot, self, vt);
+			break;
+		case Op::store:
+			access(in.slot+1, true, self);
+			if (vt.hasDependents(in.slot) || boundReads.count(in.slot)) access(0, true, self);
+			break;
+		case Op::define:
+			access(in.slot+1, true, self);
+			break;
+		case Op::call:
+			for (int slot : vt.readSlots(vt.getFunction(int(in.value)))) read(slot, self, vt);
+			break;
+		case Op::reduce:
+			for (int slot : vt.readSlots(program.subprograms[int(in.value)])) read(slot, self, vt);
+			break;
+		case Op::bind:
+			for (int slot : vt.readSlots(program.subprograms[int(in.value)])) {
+				read(slot, self, vt);
+				boundReads.insert(slot);
+			}
+			access(in.slot+1, true, self);
+			access(0, true, self);      // One bind at a time
+			boundSlots.insert(in.slot);
+			binds++;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+inline void StatementGraph::addError(std::string message){
+	Statement s;
+	s.compiled = false;
+	s.failed = true;
+	s.message = message;
+	statements.push_back(std::move(s));
+}
+
+inline void StatementGraph::runStatement(int i, ThreadPool& pool, AvailableVariables& vt){
+	Statement& s = statements[i];
+	if (s.compiled && !s.program.code.empty()) {     // Function definitions are done at compile time
+		Status status;
+		{
+			STATS_TIME(evaluate);
+			status = tryEvaluate(s.program, vt, s.value);
+		}
+		if (status) STATS_COUNT(statements);
+		else {
+			STATS_COUNT(errors);
+			s.failed = true;
+			s.message = s.location + faultMessage(status, vt);
+		}
+	}
+	for (int d : s.dependents) {
+		if (--*statements[d].waiting == 0) pool.submit([this, d, &pool, &vt] { runStatement(d, pool, vt); });
+	}
+}
+
+inline void StatementGraph::run(ThreadPool& pool, AvailableVariables& vt){
+	// Every variable a statement touches already has its slot, so the table does not grow while statements run,
+	// and binds find room made for them, so they move nothing that other statements read at the same time
+	vt.reserveBindings(binds);
+	for (Statement& s : statements) s.waiting = std::make_unique<std::atomic<int>>(s.dependencies);
+	for (int i = 0; i < statements.size(); i++) {
+		if (statements[i].dependencies == 0) pool.submit([this, i, &pool, &vt] { runStatement(i, pool, vt); });
+	}
+	pool.wait();
+}
+
+inline void StatementGraph::print(ResultWriter& out){    // Same output as calculate() would give statement by statement
+	for (const Statement& s : statements) {
+		out.prompt();
+		if (s.compiled && s.program.code.empty()) continue;     // Function definition, nothing to print
+		out.result();      // Before compile errors too, as calculate() writes them
+		if (s.failed) out.error(s.message);
+		else out.value(s.value);
+	}
+}
+
+inline void StatementGraph::clear(){
+	statements.clear();
+	lastWriter.clear();
+	readers.clear();
+	boundSlots.clear();
+	boundReads.clear();
+	binds = 0;
+}
+
+}	// namespace calc
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "Common.h"
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+namespace calc {
+
+// Counters, phase timers and latency histograms for what calculate() spends its time on
+// Shown by the 'stats' command, and written as JSON at exit with calculator --stats file.json
+//
+// Each thread counts in a block of its own, so counting is a plain add with no lock and no shared cache line;
+// the blocks are only summed up when the statistics are read
+// Build with CALC_STATS=0 (make STATS=0) and the STATS_ macros compile to nothing
+
+#ifndef CALC_STATS
+#define CALC_STATS 1
+#endif
+
+namespace stats {
+	enum class Counter { tokens, statements, lookups, lookupMisses, errors, memoHits, memoMisses, count };
+	enum class Phase { compile, evaluate, statement, count };
+	const int counters = int(Counter::count);
+	const int phases = int(Phase::count);
+	const int buckets = 40;      // Latency histogram, bucket i counts times in [2^i, 2^(i+1)) nanoseconds
+
+	struct Totals {
+		uint64_t counters[stats::counters] {};
+		uint64_t calls[stats::phases] {};
+		uint64_t nanoseconds[stats::phases] {};
+		uint64_t histogram[stats::phases][stats::buckets] {};
+	};
+
+	Totals totals();
+	void print(std::ostream& os);
+	void printJson(std::ostream& os);
+
+#if CALC_STATS
+	struct Block {       // Written only by its own thread, read by totals() from any thread
+		std::atomic<uint64_t> counters[stats::counters] {};
+		std::atomic<uint64_t> calls[stats::phases] {};
+		std::atomic<uint64_t> nanoseconds[stats::phases] {};
+		std::atomic<uint64_t> histogram[stats::phases][stats::buckets] {};
+	};
+
+	inline void add(std::atomic<uint64_t>& a, uint64_t n) {      // Single writer, no need for an atomic read-modify-write
+		a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	struct Registry {
+		std::mutex m;
+		std::vector<std::unique_ptr<Block>> blocks;      // Kept after their thread ends, their counts still matter
+	};
+	inline Registry& registry(){
+		static Registry r;
+		return r;
+	}
+
+	inline Block& local(){
+		thread_local Block* block = nullptr;
+		if (!block) {
+			Registry& r = registry();
+			std::lock_guard<std::mutex> lock {r.m};
+			r.blocks.push_back(std::make_unique<Block>());
+			block = r.blocks.back().get();
+		}
+		return *block;
+	}
+
+	inline void count(Counter c, uint64_t n = 1) { add(local().counters[int(c)], n); }
+	inline uint64_t threadCount(Counter c) { return local().counters[int(c)].load(std::memory_order_relaxed); }     // This thread only
+
+	class Timer {      // Times the scope it lives in
+	public:
+		Timer (Phase p): phase {p}, start {std::chrono::steady_clock::now()} {};
+		~Timer (){
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+			Block& b = local();
+			int bucket = 0;
+			while (bucket < buckets - 1 && (ns >> (bucket + 1))) bucket++;
+			add(b.calls[int(phase)], 1);
+			add(b.nanoseconds[int(phase)], ns);
+			add(b.histogram[int(phase)][bucket], 1);
+		};
+	private:
+		Phase phase;
+		std::chrono::steady_clock::time_point start;
+	};
+#endif
+}
+
+#if !CALC_STATS
+namespace stats {
+	inline uint64_t threadCount(Counter) { return 0; }
+}
+#endif
+
+#if CALC_STATS
+#define STATS_COUNT(counter) stats::count(stats::Counter::counter)
+#define STATS_TIME(phase) stats::Timer statsTimer_##phase {stats::Phase::phase}
+#else
+#define STATS_COUNT(counter) ((void)0)
+#define STATS_TIME(phase) ((void)0)
+#endif
+
+
+// Functions reading the statistics
+
+namespace stats {
+	inline const char* counterNames[counters] = {"tokens", "statements", "lookups", "lookup_misses", "errors", "memo_hits", "memo_misses"};
+	inline const char* phaseNames[phases] = {"compile", "evaluate", "statement"};
+
+	inline Totals totals(){
+		Totals t;
+#if CALC_STATS
+		Registry& r = registry();
+		std::lock_guard<std::mutex> lock {r.m};
+		for (const std::unique_ptr<Block>& b : r.blocks) {
+			for (int i = 0; i < counters; i++) t.counters[i] += b->counters[i].load(std::memory_order_relaxed);
+			for (int p = 0; p < phases; p++) {
+				t.calls[p] += b->calls[p].load(std::memory_order_relaxed);
+				t.nanoseconds[p] += b->nanoseconds[p].load(std::memory_order_relaxed);
+				for (int i = 0; i < buckets; i++) t.histogram[p][i] += b->histogram[p][i].load(std::memory_order_relaxed);
+			}
+		}
+#endif
+		return t;
+	}
+
+	inline uint64_t percentile(const Totals& t, int phase, double fraction){     // Upper bound of the bucket holding the percentile
+		uint64_t seen = 0;
+		for (int i = 0; i < buckets; i++) {
+			seen += t.histogram[phase][i];
+			if (seen > 0 && seen >= fraction * t.calls[phase]) return uint64_t(1) << (i + 1);
+		}
+		return 0;
+	}
+
+	inline void print(std::ostream& os){
+#if CALC_STATS
+		Totals t = totals();
+		os << "Statistics since start:";
+		for (int i = 0; i < counters; i++) os << '\n' << std::left << std::setw(16) << counterNames[i] << std::right << std::setw(14) << t.counters[i];
+		os << "\n\n" << std::left << std::setw(16) << "phase" << std::right << std::setw(14) << "calls" << std::setw(14) << "total ms"
+			<< std::setw(12) << "mean ns" << std::setw(12) << "p50 ns <" << std::setw(12) << "p99 ns <";
+		for (int p = 0; p < phases; p++) {
+			os << '\n' << std::left << std::setw(16) << phaseNames[p] << std::right << std::setw(14) << t.calls[p]
+				<< std::setw(14) << std::fixed << std::setprecision(3) << t.nanoseconds[p] * 1e-6 << std::defaultfloat << std::setprecision(6)
+				<< std::setw(12) << (t.calls[p] ? t.nanoseconds[p] / t.calls[p] : 0)
+				<< std::setw(12) << percentile(t, p, 0.5) << std::setw(12) << percentile(t, p, 0.99);
+		}
+#else
+		os << "Statistics are not compiled in, build with CALC_STATS=1 (make STATS=1).";
+#endif
+	}
+
+	inline void printJson(std::ostream& os){
+		Totals t = totals();
+		os << "{\"enabled\":" << (CALC_STATS ? "true" : "false") << ",\"counters\":{";
+		for (int i = 0; i < counters; i++) os << (i ? "," : "") << '"' << counterNames[i] << "\":" << t.counters[i];
+		os << "},\"phases\":{";
+		for (int p = 0; p < phases; p++) {
+			os << (p ? "," : "") << '"' << phaseNames[p] << "\":{\"calls\":" << t.calls[p] << ",\"total_ns\":" << t.nanoseconds[p]
+				<< ",\"p50_ns\":" << percentile(t, p, 0.5) << ",\"p99_ns\":" << percentile(t, p, 0.99) << ",\"histogram_log2_ns\":[";
+			for (int i = 0; i < buckets; i++) os << (i ? "," : "") << t.histogram[p][i];
+			os << "]}";
+		}
+		os << "}}\n";
+	}
+}
+
+}	// namespace calc
+
+#endif
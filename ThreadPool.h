@@ -0,0 +1,129 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "Common.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <functional>
+
+namespace calc {
+
+// Fixed set of worker threads with one task queue each
+// A task submitted from a worker goes to the back of that worker's own queue, and is taken from there first (most recent, still in cache)
+// Idle workers steal from the front of the other queues, so work spreads out without a single shared queue to fight over
+class ThreadPool {
+public:
+	void submit(std::function<void()> task);
+	void wait();      // Returns once every submitted task, including those submitted by tasks, has finished
+	int size() const { return workers.size(); };
+
+	ThreadPool (int count = 0);      // Zero for one thread per core
+	~ThreadPool ();
+	ThreadPool (const ThreadPool&) = delete;
+	ThreadPool& operator= (const ThreadPool&) = delete;
+private:
+	struct Worker {
+		std::mutex m;
+		std::deque<std::function<void()>> tasks;
+	};
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	std::atomic<int> pending {0};       // Submitted tasks that have not finished yet
+	std::atomic<int> queued {0};        // Tasks sitting in a queue, not yet picked up by a worker
+	std::atomic<int> nextQueue {0};     // Round robin for tasks submitted from outside the pool
+	std::mutex sleepMutex;
+	std::condition_variable wake;       // Workers wait here when every queue is empty
+	std::condition_variable done;       // wait() waits here for pending to reach zero
+	bool stopping = false;
+
+	inline static thread_local ThreadPool* currentPool = nullptr;
+	inline static thread_local int currentWorker = -1;
+
+	bool runOne(int self);
+	void workerLoop(int self);
+};
+
+
+// ThreadPool Functions
+
+inline ThreadPool::ThreadPool(int count){
+	if (count <= 0) count = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 0; i < count; i++) workers.push_back(std::make_unique<Worker>());
+	for (int i = 0; i < count; i++) threads.emplace_back([this, i] { workerLoop(i); });
+}
+
+inline ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> lock {sleepMutex};
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : threads) t.join();
+}
+
+inline void ThreadPool::submit(std::function<void()> task){
+	int queue = (currentPool == this) ? currentWorker : nextQueue++ % int(workers.size());
+	pending++;
+	{
+		std::lock_guard<std::mutex> lock {workers[queue]->m};
+		workers[queue]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock {sleepMutex};     // Taken so a worker about to sleep cannot miss the new task
+		queued++;
+	}
+	wake.notify_one();
+}
+
+inline bool ThreadPool::runOne(int self){     // Runs one task from our own queue or stolen from another, false if there was none
+	std::function<void()> task;
+	int n = workers.size();
+	for (int i = 0; i < n && !task; i++) {
+		int victim = (self + i) % n;
+		Worker& w = *workers[victim];
+		std::lock_guard<std::mutex> lock {w.m};
+		if (w.tasks.empty()) continue;
+		if (victim == self) {
+			task = std::move(w.tasks.back());
+			w.tasks.pop_back();
+		}
+		else {
+			task = std::move(w.tasks.front());
+			w.tasks.pop_front();
+		}
+	}
+	if (!task) return false;
+
+	queued--;
+	task();
+	if (--pending == 0) {
+		std::lock_guard<std::mutex> lock {sleepMutex};
+		done.notify_all();
+	}
+	return true;
+}
+
+inline void ThreadPool::workerLoop(int self){
+	currentPool = this;
+	currentWorker = self;
+	while (true) {
+		if (runOne(self)) continue;
+		std::unique_lock<std::mutex> lock {sleepMutex};
+		wake.wait(lock, [this] { return stopping || queued > 0; });
+		if (stopping) return;
+	}
+}
+
+inline void ThreadPool::wait(){
+	std::unique_lock<std::mutex> lock {sleepMutex};
+	done.wait(lock, [this] { return pending == 0; });
+}
+
+}	// namespace calc
+
+#endif
@@ -1,4 +1,13 @@
-#include "std_lib_facilities.h"
+#ifndef TOKEN_H
+#define TOKEN_H
+
+#include "Common.h"
+#include "Stats.h"
+#include <string_view>
+#include <cstring>
+#include <charconv>
+
+namespace calc {
 
 const char help = 'h';
 const char quit = 'q';
@@ -9,29 +18,158 @@ const char result = '=';
 const char var = 'a';
 const char let = '#';
 const char k = 'k';
-const string quitString = "exit";
+const std::string quitString = "exit";
 const char sq = 's';
-const string sqrtString = "sqrt";
+const std::string sqrtString = "sqrt";
 const char pwr = 'p';
-const string powString = "pow";
+const std::string powString = "pow";
 const char from = 'f';
-const string fromString = "from";
+const std::string fromString = "from";
 const char to = 't';
-const string toString = "to";
+const std::string toString = "to";
+const char statistics = 'i';
+const std::string statString = "stats";
+const char save = 'v';
+const std::string saveString = "save";
+const char load = 'l';
+const std::string loadString = "load";
 const char path = '/';
 const char err = 'e';
 const char eof = '.';
 
+inline bool isCommand(char kind){      // Commands run outside of statements
+	return kind==help || kind==statistics || kind==from || kind==to || kind==save || kind==load;
+}
+
+// Tokens are small and trivially copyable: a name is only a view of characters kept elsewhere,
+// either in the buffer the stream reads from or in the TokenNames of the stream
+// It stays valid until the stream starts reading the statement after the one the token belongs to
 class Token {
 public:
 	char kind;
 	double value;
-	string name;     // Allow for tokens to store strings as well
+	std::string_view name;     // Allow for tokens to store strings as well, and the chars of a number (see literalValue() in Compiler.h)
 
 	// Generator options
 	Token(char ch): kind{ch} {};   // Input only a character and leave the remaining attributes unitialized
 	Token(char ch, double v): kind{ch}, value{v} {};
-	Token(char ch, string n): kind{ch}, name{n} {};   
+	Token(char ch, double v, std::string_view n): kind{ch}, value{v}, name{n} {};
+	Token(char ch, std::string_view n): kind{ch}, name{n} {};
+};
+
+// Where a token starts: in a buffer only the pointer is kept, lines are counted when a diagnostic needs them
+struct SourcePosition {
+	const char* at = nullptr;
+	int line = 1;
+	int column = 1;
+};
+
+// Error found in a statement, where it was found, and the message written for it
+// Messages of statements read from a file start with file:line:column:
+struct Diagnostic {
+	std::string message;
+	int line = 0;
+	int column = 0;
+};
+
+// Names read from an istream, written one char at a time into chunks that are reused for every statement
+// Once a chunk big enough for the longest statement exists, reading names never allocates again
+class TokenNames {
+public:
+	void begin() { start = used; };      // Start a new name
+	void add(char ch);
+	std::string_view name() const { return std::string_view{current.get() + start, used - start}; };
+	void reset();                         // Names of the previous statement are no longer needed
+private:
+	std::unique_ptr<char[]> current;
+	size_t capacity = 0;
+	size_t used = 0;
+	size_t start = 0;
+	std::vector<std::unique_ptr<char[]>> previous;      // Chunks filled earlier in this statement, still viewed by its tokens
+};
+
+// Where a TokenStream reads its characters from: either an istream, read one char at a time (interactive use),
+// or a contiguous buffer such as a memory mapped file, which is lexed straight from memory
+class CharSource {
+public:
+	bool get(char& ch);
+	void putback(char ch);
+	bool readNumber(double& value, std::string_view& text);      // text: the chars of the literal, valid until the next number
+	std::string_view readName(char first, TokenNames& names, bool& isPath);
+	bool skipPast(char a, char b);
+	char peekPastBlanks();      // Next char other than ' ', left to be read (0 at the end of the input)
+	bool eof() const;
+	explicit operator bool() const;
+
+	// Positions for diagnostics: a file name (empty for the keyboard), and the line and column of the last char read
+	SourcePosition lastRead() const;
+	void resolve(SourcePosition& p);      // Counts the lines up to p, for positions in a buffer
+	void setName(const std::string& n, int firstLine = 1);
+	const std::string& getName() const { return name; };
+	const char* position() const { return cur; };       // Next char of the buffer, nullptr when reading a stream
+
+	CharSource () {};
+	CharSource (std::istream& is): ist {&is} {};
+	CharSource (const char* begin, const char* end): cur {begin}, end {end}, start {begin}, counted {begin}, countedLineStart {begin} {};
+private:
+	std::istream* ist = nullptr;      // nullptr when reading from the buffer
+	const char* cur = nullptr;
+	const char* end = nullptr;
+	bool failed = false;         // Set once a read runs past the end of the buffer, like the failbit of a stream
+	std::string literal;         // Number being read from the istream, kept to reuse its memory
+
+	std::string name;
+	int firstLine = 1;
+	// Buffer: lines are only counted when a position is resolved, from where the last count stopped
+	const char* start = nullptr;
+	const char* counted = nullptr;
+	const char* countedLineStart = nullptr;
+	int countedLines = 0;
+	// Stream: line and column of the next char, kept up to date as chars are read
+	int line = 1;
+	int column = 1;
+	int previousColumn = 1;      // Column before the last newline, in case it is put back
+
+	bool readStreamNumber(double& value, std::string_view& text);
+};
+
+// Where results, prompts and error messages go
+//	interactive: prompt and '=' before every result, written through the ostream as they come (default)
+//	plain:       one result per line and nothing else, for results piped to a file with 'to plain file'
+//	binary:      fixed size records of 16 bytes (uint64 statement index, double value, in the byte order of the machine)
+//	             the value is an int64 instead when the session calculates with int64 (see Number.h)
+// Plain and binary results are formatted into one large buffer (with to_chars, same text as the ostream would write)
+// and written out a block at a time; statements that fail still count for the index of the binary records
+// Error messages go to their own stream when one is given (eg. cerr), otherwise in order with the results
+// A ResultWriter made without a stream writes nothing, for callers that take the values from the TokenStream themselves
+class ResultWriter {
+public:
+	enum class Format { interactive, plain, binary };
+
+	void prompt();
+	void result();      // Result of a statement follows, written before evaluating so it also comes before the error
+	template<class T> void value(T d);      // Of the number type of the session
+	void error(const std::string& message);      // Statement gave an error instead of a value
+	void note(const std::string& message);       // In place of a value, for a statement that gives none (eg. a function definition)
+	void flush();
+
+	ResultWriter (): ost {nullptr}, est {nullptr}, format {Format::interactive} {};
+	ResultWriter (std::ostream& os, Format f = Format::interactive): ost {&os}, est {&os}, format {f} {};
+	ResultWriter (std::ostream& os, Format f, std::ostream& es): ost {&os}, est {&es}, format {f} {};
+	~ResultWriter ();
+	ResultWriter (const ResultWriter&) = delete;
+	ResultWriter& operator= (const ResultWriter&) = delete;
+private:
+	std::ostream* ost;      // nullptr: nothing is written
+	std::ostream* est;
+	Format format;
+	static const size_t blockSize = 1 << 16;
+	std::unique_ptr<char[]> buffer;      // Allocated on first use, interactive output never needs it
+	size_t used = 0;
+	uint64_t index = 0;             // Statements so far, for the binary records
+
+	char* reserve(size_t n);
+	void line(const std::string& message, std::ostream& os);
 };
 
 class TokenStream {    // Class declarations appear first, and only then comes the definitions
@@ -39,62 +177,484 @@ public:
 	void putBack(Token t);
 	Token get();
 	void clean();
-    istream& ist;    
-	ostream& ost;
+
+	// Errors without exceptions: the compiler records the first error of a statement with fail() and returns false,
+	// the caller reports diagnostic() and calls clean(), which skips to the next statement and clears it
+	// A char the lexer does not know gives an err token, and is recorded the same way
+	bool fail(std::string_view message, std::string_view name = {}, std::string_view rest = {});      // At the last token read
+	bool failStatement(std::string_view message);       // At the start of the statement, for errors found while running it
+	bool failed() const { return statementFailed; };
+	const Diagnostic& diagnostic() const { return diag; };
+	std::string statementLocation();      // "file:line:column: " of the statement, for errors reported later (empty without a file name)
+	int statementLine();             // Line the statement starts on, for the profiler (see Profiler.h)
+	SourcePosition statementPosition();      // Where the statement starts, line and column resolved
+	bool endsStatement() const { return full && (tokenAvailable.kind == print || tokenAvailable.kind == eof); };    // Token put back, clean() skips nothing more
+private:
+	CharSource own;     // Source owned by this stream, unused when sharing the source of another stream
+	ResultWriter ownOutput;
+public:
+	CharSource& in;
+	ResultWriter& out;
 
 	// Define input stream for Tokens
-    TokenStream (istream& is, ostream& os): ist {is}, ost {os} {};   
-	TokenStream (): ist {cin}, ost {cout} {};
-	TokenStream (Token t, istream& is, ostream& os): full {true}, tokenAvailable {t}, ist {is}, ost {os} {};
+	TokenStream (std::istream& is, std::ostream& os): own {is}, ownOutput {os}, in {own}, out {ownOutput} {};
+	TokenStream (std::istream& is, ResultWriter& output): own {is}, in {own}, out {output} {};
+	TokenStream (Token t, std::istream& is, std::ostream& os): own {is}, ownOutput {os}, in {own}, out {ownOutput}, full {true}, tokenAvailable {t} {};
+	TokenStream (const char* begin, const char* end, std::ostream& os): own {begin, end}, ownOutput {os}, in {own}, out {ownOutput} {};
+	TokenStream (CharSource& source, std::ostream& os): ownOutput {os}, in {source}, out {ownOutput} {};   // Keep reading from the source of another stream
+	TokenStream (const char* begin, const char* end): own {begin, end}, in {own}, out {ownOutput} {};     // Tokens only, nothing is written
+	// Write results somewhere shared with other streams, eg. a file run with from while results go to a file with to
+	TokenStream (const char* begin, const char* end, ResultWriter& output): own {begin, end}, in {own}, out {output} {};
+	TokenStream (CharSource& source, ResultWriter& output): in {source}, out {output} {};
 private:
 	bool full{ false };
-	Token tokenAvailable {var, "None"} ;    // Need to initialize Token using one of the geenrator definitions
+	Token tokenAvailable {var} ;    // Need to initialize Token using one of the geenrator definitions
+	TokenNames names;
+	bool statementEnded {false};    // Last token read ended a statement, its names can be dropped before reading on
+
+	Diagnostic diag;
+	bool statementFailed {false};
+	SourcePosition tokenStart;      // First char of the last token read
+	SourcePosition statementStart;
+	bool newStatement {true};       // The next token (other than ';' or newline) starts a statement
 
+	void record(SourcePosition at, std::string_view message, std::string_view name, std::string_view rest);
+	void location(SourcePosition& at, std::string& s);
 };
 
 
 
+// TokenNames Functions
+
+inline void TokenNames::add(char ch){
+	if (used == capacity) {       // Move the name read so far to a bigger chunk, the old one may still be viewed
+		size_t length = used - start;
+		size_t size = std::max<size_t>(256, 2 * capacity);
+		std::unique_ptr<char[]> chunk (new char[size]);
+		if (length) std::memcpy(chunk.get(), current.get() + start, length);
+		if (current) previous.push_back(std::move(current));
+		current = std::move(chunk);
+		capacity = size;
+		start = 0;
+		used = length;
+	}
+	current[used++] = ch;
+}
+
+inline void TokenNames::reset(){
+	previous.clear();      // Keep only the newest (biggest) chunk
+	used = start = 0;
+}
+
+
+// CharSource Functions
+
+inline bool CharSource::get(char& ch){
+	if (ist) {
+		if (!ist->get(ch)) return false;
+		if (ch == '\n') {
+			previousColumn = column;
+			line++;
+			column = 1;
+		}
+		else column++;
+		return true;
+	}
+	if (cur == end) {
+		failed = true;
+		return false;
+	}
+	ch = *cur++;
+	return true;
+}
+
+inline void CharSource::putback(char ch){
+	if (ist) {
+		ist->putback(ch);
+		if (ch == '\n') {
+			line--;
+			column = previousColumn;
+		}
+		else column--;
+	}
+	else if (!failed) cur--;      // Nothing to put back if the last read failed
+}
+
+// Converts a whole literal with from_chars, which needs no locale and no copy of the chars
+// Out of range literals (eg. 1e999, 1e-999) are rare, strtod gives them the value they always had
+// Also used for the other floating point types of Number.h, with strtof and strtold
+template<class T> bool parseLiteral(const char* first, const char* last, T& value){
+	if (first == last) return false;
+	std::from_chars_result r = std::from_chars(first, last, value, std::chars_format::general);
+	if (r.ec == std::errc::result_out_of_range) {
+		std::string literal {first, last};
+		char* parsedEnd;
+		if constexpr (std::is_same_v<T, float>) value = strtof(literal.c_str(), &parsedEnd);
+		else if constexpr (std::is_same_v<T, long double>) value = strtold(literal.c_str(), &parsedEnd);
+		else value = std::strtod(literal.c_str(), &parsedEnd);
+		return parsedEnd == literal.c_str() + literal.size();
+	}
+	return r.ec == std::errc() && r.ptr == last;
+}
+
+inline bool CharSource::readNumber(double& value, std::string_view& text){
+	if (ist) return readStreamNumber(value, text);
+
+	// Scan the literal the same way the stream would: digits, one '.', more digits and an optional exponent
+	const char* start = cur;
+	const char* p = cur;
+	while (p != end && isdigit(*p)) p++;
+	if (p != end && *p == '.') {
+		p++;
+		while (p != end && isdigit(*p)) p++;
+	}
+	if (p != end && (*p == 'e' || *p == 'E')) {      // Only part of the number if digits follow
+		const char* q = p + 1;
+		if (q != end && (*q == '+' || *q == '-')) q++;
+		if (q != end && isdigit(*q)) {
+			p = q;
+			while (p != end && isdigit(*p)) p++;
+		}
+	}
+
+	text = std::string_view{start, size_t(p - start)};
+	if (!parseLiteral(start, p, value)) {    // eg. a lone '.'
+		value = 0;
+		failed = true;
+		return false;
+	}
+	cur = p;
+	return true;
+}
+
+// Same chars, value and stream state as ist >> value, without the locale machinery of num_get:
+// digits with at most one '.', then 'e' or 'E' (only after a digit) with an optional sign and more digits
+// The 'e' and its sign are taken even when no digits follow, and such a literal fails as it would with >>
+// A literal too big for a double fails too, with the largest double as value
+inline bool CharSource::readStreamNumber(double& value, std::string_view& text){
+	std::streambuf* sb = ist->rdbuf();
+	literal.clear();
+	bool dot = false, exponent = false, digits = false;
+	const int end = std::char_traits<char>::eof();
+	int c = sb->sgetc();
+	while (c != end) {
+		if (std::isdigit(c)) digits = true;
+		else if (c == '.' && !dot && !exponent) dot = true;
+		else if ((c == 'e' || c == 'E') && !exponent && digits) {
+			exponent = true;
+			literal += 'e';
+			c = sb->snextc();
+			if (c == '+' || c == '-') {
+				literal += char(c);
+				c = sb->snextc();
+			}
+			continue;
+		}
+		else break;
+		literal += char(c);
+		c = sb->snextc();
+	}
+	if (c == end) ist->setstate(std::ios_base::eofbit);
+	column += literal.size();      // One char of input for each char of the literal
+	text = literal;
+
+	if (!parseLiteral(literal.data(), literal.data() + literal.size(), value)) {
+		value = 0;
+		ist->setstate(std::ios_base::failbit);
+		return false;
+	}
+	if (std::isinf(value)) {
+		value = value > 0 ? std::numeric_limits<double>::max() : -std::numeric_limits<double>::max();
+		ist->setstate(std::ios_base::failbit);
+		return false;
+	}
+	return true;
+}
+
+// Reads the rest of a name starting with first, which was already read
+// Accepts names that start with letter, and include numbers or underscores, and paths with '/' and '.'
+// Names read from a buffer are views of the buffer itself, names read from an istream are copied to names
+inline std::string_view CharSource::readName(char first, TokenNames& names, bool& isPath){
+	auto isNameChar = [](char ch) { return std::isalpha(ch) || std::isdigit(ch) || ch=='_' || ch=='/' || ch=='.'; };
+	isPath = false;
+
+	if (ist) {
+		names.begin();
+		names.add(first);
+		char ch;
+		while (ist->get(ch) && isNameChar(ch)) {
+			names.add(ch);
+			column++;
+			if (ch=='/' || ch=='.') isPath = true;     // Flag to indicate that we have read a path instead of variable
+		}
+		ist->putback(ch);  // Last character not part of variable name, put it back
+		return names.name();
+	}
+
+	const char* start = cur - 1;     // first is the char just read
+	while (cur != end && isNameChar(*cur)) {
+		if (*cur=='/' || *cur=='.') isPath = true;
+		cur++;
+	}
+	if (cur == end) failed = true;   // Ran into the end of the buffer, as reading one more char would
+	return std::string_view{start, size_t(cur - start)};
+}
+
+inline bool CharSource::skipPast(char a, char b){    // Drop characters up to and including the first a or b
+	char ch;
+	if (ist) {
+		while (get(ch)) if (ch == a || ch == b) return true;
+		return false;
+	}
+	// Whole statements are skipped at once: memchr looks at many chars per step
+	const char* found = static_cast<const char*>(memchr(cur, b, end - cur));
+	const char* other = static_cast<const char*>(memchr(cur, a, (found ? found : end) - cur));
+	if (other) found = other;
+	if (found) {
+		cur = found + 1;
+		return true;
+	}
+	cur = end;
+	failed = true;
+	return false;
+}
+
+inline char CharSource::peekPastBlanks(){      // Blanks are skipped by the next token anyway
+	if (ist) {
+		char ch;
+		while (ist->peek() == ' ') get(ch);
+		int next = ist->peek();
+		return next == std::char_traits<char>::eof() ? 0 : char(next);
+	}
+	const char* p = cur;
+	while (p != end && *p == ' ') p++;
+	return p == end ? 0 : *p;
+}
+
+inline SourcePosition CharSource::lastRead() const {
+	if (ist) return SourcePosition{nullptr, line, column - 1};
+	return SourcePosition{cur - 1};
+}
+
+inline void CharSource::resolve(SourcePosition& p){
+	if (!p.at) return;
+	if (p.at < counted) {        // Before the last count (eg. a token put back), count again from the start
+		counted = countedLineStart = start;
+		countedLines = 0;
+	}
+	while (const char* nl = static_cast<const char*>(memchr(counted, '\n', p.at - counted))) {
+		countedLines++;
+		countedLineStart = counted = nl + 1;
+	}
+	counted = p.at;
+	p.line = firstLine + countedLines;
+	p.column = p.at - countedLineStart + 1;
+}
+
+inline void CharSource::setName(const std::string& n, int first){
+	name = n;
+	firstLine = first;
+	line = first;
+}
+
+inline bool CharSource::eof() const {
+	if (ist) return ist->eof();
+	return failed;
+}
+
+inline CharSource::operator bool() const {
+	if (ist) return bool(*ist);
+	return !failed;
+}
+
+
+// ResultWriter Functions
+
+inline char* ResultWriter::reserve(size_t n){     // Room for n more chars, writing the buffer out first if it is full
+	if (!buffer) buffer.reset(new char[blockSize]);
+	if (used + n > blockSize) flush();
+	return buffer.get() + used;
+}
+
+inline void ResultWriter::prompt(){
+	if (ost && format == Format::interactive) *ost << calc::prompt;
+}
+
+inline void ResultWriter::result(){
+	if (ost && format == Format::interactive) *ost << calc::result;
+}
+
+template<class T> void ResultWriter::value(T d){
+	if (!ost) return;
+	switch (format) {
+	case Format::interactive:
+		*ost << d << "\n";
+		break;
+	case Format::plain:
+	{
+		const size_t longest = 32;       // Longest double written with 6 significant digits, eg. -1.23457e-308, or int64
+		char* p = reserve(longest);
+		if constexpr (std::is_integral_v<T>) p = std::to_chars(p, p + longest, d).ptr;
+		else p = std::to_chars(p, p + longest, d, std::chars_format::general, 6).ptr;     // What ostream writes by default
+		*p++ = '\n';
+		used = p - buffer.get();
+		break;
+	}
+	case Format::binary:
+	{
+		std::conditional_t<std::is_integral_v<T>, int64_t, double> record = d;      // float and long double are written as double
+		char* p = reserve(16);
+		std::memcpy(p, &index, 8);
+		std::memcpy(p + 8, &record, 8);
+		used += 16;
+		break;
+	}
+	}
+	index++;
+}
+
+inline void ResultWriter::error(const std::string& message){
+	if (!ost) return;
+	index++;
+	line(message, *est);
+}
+
+inline void ResultWriter::note(const std::string& message){
+	if (!ost) return;
+	index++;
+	if (format != Format::binary) line(message, *ost);      // Binary records are only for values
+}
+
+inline void ResultWriter::line(const std::string& message, std::ostream& os){
+	if (format == Format::plain && &os == ost) {      // Keep it in order with the buffered results
+		if (message.size() < blockSize) {
+			char* p = reserve(message.size() + 1);
+			std::memcpy(p, message.data(), message.size());
+			p[message.size()] = '\n';
+			used += message.size() + 1;
+			return;
+		}
+		flush();
+	}
+	os << message << '\n';
+}
+
+inline void ResultWriter::flush(){
+	if (!ost) return;
+	if (used) ost->write(buffer.get(), used);
+	used = 0;
+	ost->flush();
+}
+
+inline ResultWriter::~ResultWriter(){
+	if (used) flush();
+}
+
+
 // TokenStream Functions
 
-void TokenStream::clean(){
+inline void TokenStream::clean(){
 	// Cleans stream until ending characters are found (inclusive)
-	vector<char> endCh = {print, '\n'};
+	statementFailed = false;
+	newStatement = true;
 
 	// Deal with characters in TokenStream
 	if (full){          
 		full = false;          // Refresh Token stream
-		for (char c : endCh) if (tokenAvailable.kind==c) return;	
+		if (tokenAvailable.kind==print) return;      // Both ';' and '\n' give a print token
 	}
 	
 	// Deal with characters in input stream
-	char ch;
-	while (ist.get(ch)){     // Flush remaining chars of cin stream until end of statement
-		for (char c : endCh) if (ch == c) return;
-	}
+	in.skipPast(print, '\n');     // Flush remaining chars of the input until end of statement
+	statementEnded = true;
+}
+
+inline bool TokenStream::fail(std::string_view message, std::string_view name, std::string_view rest){
+	if (!statementFailed) record(tokenStart, message, name, rest);     // Only the first error of a statement counts
+	return false;
+}
+
+inline bool TokenStream::failStatement(std::string_view message){
+	if (!statementFailed) record(statementStart, message, {}, {});
+	return false;
+}
+
+inline void TokenStream::record(SourcePosition at, std::string_view message, std::string_view name, std::string_view rest){
+	statementFailed = true;
+	diag.message.clear();
+	location(at, diag.message);
+	diag.line = at.line;
+	diag.column = at.column;
+	diag.message += message;
+	diag.message += name;
+	diag.message += rest;
+}
+
+inline void TokenStream::location(SourcePosition& at, std::string& s){
+	in.resolve(at);
+	if (in.getName().empty()) return;
+	s += in.getName();
+	s += ':';
+	s += std::to_string(at.line);
+	s += ':';
+	s += std::to_string(at.column);
+	s += ": ";
 }
 
+inline std::string TokenStream::statementLocation(){
+	std::string s;
+	if (!in.getName().empty()) location(statementStart, s);
+	return s;
+}
 
-void TokenStream::putBack(Token t) {
+inline int TokenStream::statementLine(){
+	in.resolve(statementStart);
+	return statementStart.line;
+}
+
+inline SourcePosition TokenStream::statementPosition(){
+	in.resolve(statementStart);
+	return statementStart;
+}
+
+
+inline void TokenStream::putBack(Token t) {
 	full = true;
 	tokenAvailable = t;
 }
 
 
-Token TokenStream::get() {
+inline Token TokenStream::get() {
 
 	if (full) {             // If token already available, do not read from cin
 		full = false;
 		return tokenAvailable;
 	}
 
+	STATS_COUNT(tokens);
+	if (statementEnded) {       // Names of the last statement are not needed anymore
+		names.reset();
+		statementEnded = false;
+	}
+
 	char ch;
-	while ((ist.get(ch)) && (ch==' '));   // Skip all whitespace characters, '/n' included
-	if (ist.eof()) return Token {eof};
+	while ((in.get(ch)) && (ch==' '));   // Skip all whitespace characters, '/n' included
+	if (in.eof()) return Token {eof};
+	tokenStart = in.lastRead();
+	bool first = newStatement && ch!=print && ch!='\n';     // First token of a statement
+	if (first) {
+		statementStart = tokenStart;
+		newStatement = false;
+	}
 
 	// Reading of character was effective, read into Token
 	switch (ch) {
 	
 	case print:
+		statementEnded = true;
+		newStatement = true;
+		return Token{ print };
+
 	case let:
 	case k:
 	case '+': case '-': 
@@ -107,41 +667,47 @@ Token TokenStream::get() {
 	case '0': case '1': case '2': case '3': case '4':      // Number readings
 	case '5': case '6': case '7': case '8': case '9': 
 	case '.':
-		ist.putback(ch);
+	{
+		in.putback(ch);
 		double value;
-		ist >> value;
-		return Token{ number , value};
+		std::string_view text;
+		in.readNumber(value, text);
+		return Token{ number , value, text};
+	}
 
 	case '\n': 
+		statementEnded = true;
+		newStatement = true;
 		return Token{ print };
 
 	case 'h': case 'H':
 		return Token{ help };
 
 	default:
-		if (isalpha(ch)){			// If letter, start reading string
-			string name;
-			name += ch;
-
-			// Accept names that start with letter, and include numbers or underscores
-			// Allow to read paths with '/' and '.'
-			bool isPath = false;
-			while (ist.get(ch) && (isalpha(ch) || isdigit(ch) || ch=='_' || ch=='/' || ch=='.'))
-			{
-				name += ch;
-				if (ch=='/' || ch=='.') isPath = true;     // Flag to indicate that we have read a path instead of variable
-			}
-			ist.putback(ch);  // Last character not part of variable name, put it back
+		if (std::isalpha(ch)){			// If letter, start reading string
+			bool isPath;
+			std::string_view name = in.readName(ch, names, isPath);
 
 			if (name==quitString) return Token{quit};
 			if (name==sqrtString) return Token{sq};
 			if (name==powString) return Token{pwr};
 			if (name==fromString) return Token{from};
 			if (name==toString) return Token{to};
+			// stats is a command only when it is the whole statement, save and load only at the start of one and
+			// followed by a path (which starts with a letter), anywhere else they are names like any other
+			if (first && name==statString) {
+				char next = in.peekPastBlanks();
+				if (next==print || next=='\n' || next==0) return Token{statistics};
+			}
+			if (first && (name==saveString || name==loadString) && isalpha(in.peekPastBlanks())) return Token{name==saveString ? save : load};
 			if (isPath) return Token{path, name};
 			return Token{var, name};
 		}
-		error("Token not recognized:", ch);
-		return Token{err};    // Return some Token for completeness of function
+		fail("Token not recognized:: ", std::to_string(int(ch)));     // Same message error("Token not recognized:", ch) gave
+		return Token{err, double(ch)};
 	}
-}
\ No newline at end of file
+}
+
+}	// namespace calc
+
+#endif
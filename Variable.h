@@ -1,49 +1,505 @@
-#include "std_lib_facilities.h"
+#ifndef VARIABLE_H
+#define VARIABLE_H
 
-class Variable{
+#include "Common.h"
+#include "Program.h"
+#include "Stats.h"
+#include "Memo.h"
+#include "MappedFile.h"
+#include "Number.h"
+#include <string_view>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+
+namespace calc {
+
+template<class T> class BasicVariable{
 	public:
-	string name;
-	double value;
+	std::string_view name;       // Interned, points into the name arena of the AvailableVariables
+	T value;
 	bool isConst = false;   // Initialize non constant variables by default
+	bool isDefined = true;  // Slots reserved by the compiler stay undefined until their definition runs
+	int binding = -1;       // For bound variables (# bind y = ...), index of the expression that keeps them up to date
+	uint64_t version = 0;   // Counts the writes, so results computed from the variable can tell they are out of date
+};
+
+// User defined function (# f(x, y) = x*x + y), its body is compiled once when it is defined
+template<class T> struct BasicFunction{
+	std::string_view name;
+	BasicProgram<T> body;          // Parameters are read with Op::arg, so the body never touches the variable table for them
+};
+
+// Storage for variable names: each name is copied once into big chunks that are never moved,
+// so the string_views held by the variables stay valid for the lifetime of the table
+class NameArena{
+	public:
+	std::string_view store(std::string_view name);
+
+	private:
+	std::vector<std::unique_ptr<char[]>> chunks;
+	size_t used = 0;        // Bytes used in the last chunk
+	size_t capacity = 0;    // Size of the last chunk
 };
 
-class AvailableVariables{
+// Variables are kept in a vector, and their position in it is their slot: it never changes, so the compiler can keep it
+// Names are found through an open addressing hash table of slots, so lookups take a string_view and never allocate
+// A table can also look up names in a shared table it never writes to (eg. the constants every server session sees):
+// a variable found there is copied on first use, so the shared table is only ever read and needs no lock
+// Values are of the number type of the session (see Number.h), AvailableVariables is the table of doubles
+template<class T> class BasicVariables{
 	private:
-	vector<Variable> storedVars{};
+	using Variable = BasicVariable<T>;
+	using Program = BasicProgram<T>;
+	using Instruction = BasicInstruction<T>;
+
+	std::vector<Variable> storedVars{};
+	NameArena names;
+	const BasicVariables* shared = nullptr;
+
+	struct Entry {
+		uint64_t hash;
+		int slot;           // -1 for empty entries
+	};
+	std::vector<Entry> table{};  // Size is always a power of two, at most half full
+
+	// Bound variables: their expressions, in the order they were bound (which is also a valid order to recompute them),
+	// and for each slot the bound variables reading it
+	std::vector<Program> bindings{};
+	std::vector<std::vector<int>> dependents{};
+
+	// Functions can only be defined once, so programs calling them (or holding an inlined copy) never get out of date
+	std::vector<BasicFunction<T>> functions{};
+	std::unordered_map<std::string_view, int> functionIndex{};
+
+	std::shared_ptr<MappedFile> snapshot;     // Restored names point into it, so it stays mapped as long as the table
+
+	static uint64_t hashName(std::string_view name);
+	void grow();
+	int lookup(std::string_view name);      // findSlot, also looking in the shared table
+	BasicMemoCache<T> memo;
 
 	public:
-	double getVar(string name);
-	void setVar(string name, double value, bool isConst);
-	bool checkVarExists(string n);
-	void replaceVar(string name, double value);
+	BasicVariables () {};
+	explicit BasicVariables (const BasicVariables* sharedTable): shared {sharedTable}, memo {sharedTable->memo.getCapacity()} {};     // Memo sized like the shared table's
+
+	T getVar(std::string_view name);
+	void setVar(std::string_view name, T value, bool isConst);
+	bool checkVarExists(std::string_view n);
+	void replaceVar(std::string_view name, T value);
+
+	// Slot access, used by compiled programs so that names are only looked up once at compile time
+	int findSlot(std::string_view name) const;      // -1 if the name was never seen
+	int getSlot(std::string_view name);
+	std::string_view getName(int slot) const;
+	bool isConstant(int slot) const;            // Defined with const, so its value can never change
+	bool isDefined(int slot) const { return storedVars[slot].isDefined; };
+	T getValue(int slot);
+	void assignValue(int slot, T value);
+	void defineValue(int slot, T value, bool isConst);
+	const Variable* variables() const { return storedVars.data(); };     // Read directly by native code (Jit.h)
+
+	// Bound variables, kept up to date by propagate() in Evaluator.h
+	void bindValue(int slot, T value, const Program& expression);
+	void updateBound(int slot, T value);
+	const Program* getBinding(int slot) const;  // nullptr if the variable is not bound
+	int getBindingOrder(int slot) const;
+	bool hasDependents(int slot) const;
+	const std::vector<int>& getDependents(int slot) const;
+	void reserveBindings(int count);            // Room for count more, see StatementGraph::run
+
+	// Functions, compiled by Compiler.h
+	int findFunction(std::string_view name) const;   // -1 if there is no such function
+	int defineFunction(std::string_view name, Program body);
+	const Program& getFunction(int f) const { return functions[f].body; };
+	std::string_view intern(std::string_view name) { return names.store(name); };      // Copy of name that lives as long as the table
+	std::vector<int> readSlots(const Program& p) const;      // Variables p loads, also through the functions it calls and its reductions
+
+	// Results of statements evaluated on this table, see evaluateMemo() in Evaluator.h
+	uint64_t getVersion(int slot) const { return storedVars[slot].version; };
+	BasicMemoCache<T>& getMemo() { return memo; };
+
+	// Binary snapshot of the variables (save file / load file), see SnapshotHeader below
+	void saveSnapshot(const std::string& fileName) const;
+	void loadSnapshot(const std::string& fileName);
 };
 
-// AvailableVariables function definitions 
+using Variable = BasicVariable<double>;
+using Function = BasicFunction<double>;
+using AvailableVariables = BasicVariables<double>;
+
+// Layout of a snapshot file, in the byte order of the machine that wrote it:
+//	header, one record per slot, the hash table exactly as AvailableVariables keeps it, then all names back to back
+// Loading an empty table maps the file once: the names are used in place and the hash table is copied as is,
+// so nothing is parsed or hashed again. A table that already has variables gets them one by one instead
+// Bound variables are saved with their current value only, functions are not saved
+// Values are kept in the number type of the table (see Number.h), and only a table of the same type can load them
+struct SnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;          // Slots
+	uint32_t tableSize;      // Entries of the hash table, a power of two
+	uint32_t namesSize;      // Bytes of names
+	uint8_t numbers;         // NumberType of the values
+	uint8_t reserved[7];
+};
+
+template<class T> struct SnapshotRecord {
+	uint32_t nameOffset;     // In the names block
+	uint32_t nameLength;
+	uint8_t isConst;
+	uint8_t isDefined;
+	uint8_t padding[6];
+	T value;
+};
+
+const char snapshotMagic[8] = {'C', 'A', 'L', 'C', 'S', 'N', 'A', 'P'};
+const uint32_t snapshotVersion = 1;
+
+// NameArena function definitions
 
-double AvailableVariables::getVar(string n){
-	for (Variable v : storedVars) if (v.name == n) return v.value;    
-	error("Variable with name "+n+" not found.");
+inline std::string_view NameArena::store(std::string_view name){
+	if (used + name.size() > capacity) {       // Start a new chunk, big names get one of their own
+		capacity = std::max<size_t>(4096, name.size());
+		chunks.push_back(std::unique_ptr<char[]>(new char[capacity]));
+		used = 0;
+	}
+	char* dest = chunks.back().get() + used;
+	std::memcpy(dest, name.data(), name.size());
+	used += name.size();
+	return std::string_view{dest, name.size()};
 }
 
-void AvailableVariables::setVar(string n, double v, bool isConst){    // Sets new variable if not already defined
-	if (checkVarExists(n)) error("Variable is already defined. Usage: v = 5;");
-	storedVars.push_back(Variable{n, v, isConst});
+// BasicVariables function definitions
+
+template<class T> uint64_t BasicVariables<T>::hashName(std::string_view name){     // FNV-1a
+	uint64_t h = 14695981039346656037ull;
+	for (char c : name) {
+		h ^= (unsigned char)c;
+		h *= 1099511628211ull;
+	}
+	return h;
 }
 
-bool AvailableVariables::checkVarExists(string n){
-	for (Variable v : storedVars) if (v.name == n) return true;  
-	return false;
+template<class T> void BasicVariables<T>::grow(){
+	size_t size = table.empty() ? 64 : table.size() * 2;
+	std::vector<Entry> old;
+	old.swap(table);
+	table.assign(size, Entry{0, -1});
+
+	Entry* entries = table.data();
+	size_t mask = size - 1;
+	for (const Entry& e : old) {
+		if (e.slot < 0) continue;
+		size_t i = e.hash & mask;
+		while (entries[i].slot >= 0) i = (i+1) & mask;     // Linear probing
+		entries[i] = e;
+	}
 }
 
-void AvailableVariables::replaceVar(string n, double v){     
-	if (!checkVarExists(n)) error ("Tried to assign value to nonexistent variable");
-	for (Variable& var : storedVars) {     // Take care to loop by reference, to store changes
-		if (var.name == n) {
-			if (!var.isConst) var.value = v;
-			else error("Tried to assign value to constant variable!");
-			return;
+template<class T> int BasicVariables<T>::findSlot(std::string_view n) const {
+	STATS_COUNT(lookups);
+	if (table.empty()) {
+		STATS_COUNT(lookupMisses);
+		return -1;
+	}
+	uint64_t h = hashName(n);
+	const Entry* entries = table.data();
+	const Variable* vars = storedVars.data();
+	size_t mask = table.size() - 1;
+	for (size_t i = h & mask; entries[i].slot >= 0; i = (i+1) & mask) {
+		const Entry& e = entries[i];
+		if (e.hash == h && vars[e.slot].name == n) return e.slot;
+	}
+	STATS_COUNT(lookupMisses);
+	return -1;
+}
+
+template<class T> int BasicVariables<T>::getSlot(std::string_view n){     // Returns the slot of a variable, reserving an undefined one if needed
+	int slot = findSlot(n);
+	if (slot >= 0) return slot;
+
+	if (2 * (storedVars.size() + 1) > table.size()) grow();
+	slot = storedVars.size();     // Slots never move, since variables are only ever appended
+	storedVars.push_back(Variable{names.store(n), 0, false, false});
+	if (shared) {      // First use of a shared variable, take a copy of it
+		int s = shared->findSlot(n);
+		if (s >= 0 && shared->storedVars[s].isDefined) {
+			storedVars.back().value = shared->storedVars[s].value;
+			storedVars.back().isConst = shared->storedVars[s].isConst;
+			storedVars.back().isDefined = true;
 		}
 	}
-} 
 
+	uint64_t h = hashName(n);
+	Entry* entries = table.data();
+	size_t mask = table.size() - 1;
+	size_t i = h & mask;
+	while (entries[i].slot >= 0) i = (i+1) & mask;
+	entries[i] = Entry{h, slot};
+	return slot;
+}
+
+template<class T> int BasicVariables<T>::lookup(std::string_view n){
+	int slot = findSlot(n);
+	if (slot < 0 && shared && shared->findSlot(n) >= 0) slot = getSlot(n);
+	return slot;
+}
+
+template<class T> std::string_view BasicVariables<T>::getName(int slot) const {
+	return storedVars[slot].name;
+}
+
+template<class T> bool BasicVariables<T>::isConstant(int slot) const {
+	return storedVars[slot].isDefined && storedVars[slot].isConst;
+}
+
+template<class T> T BasicVariables<T>::getVar(std::string_view n){
+	int slot = lookup(n);
+	if (slot < 0 || !storedVars[slot].isDefined) error("Variable with name "+std::string(n)+" not found.");
+	return storedVars[slot].value;
+}
+
+template<class T> void BasicVariables<T>::setVar(std::string_view n, T v, bool isConst){    // Sets new variable if not already defined
+	defineValue(getSlot(n), v, isConst);
+}
+
+template<class T> bool BasicVariables<T>::checkVarExists(std::string_view n){
+	int slot = lookup(n);
+	return slot >= 0 && storedVars[slot].isDefined;
+}
+
+template<class T> void BasicVariables<T>::replaceVar(std::string_view n, T v){
+	int slot = lookup(n);
+	if (slot < 0 || !storedVars[slot].isDefined) error ("Tried to assign value to nonexistent variable");
+	if (storedVars[slot].isConst) error("Tried to assign value to constant variable!");
+	if (storedVars[slot].binding >= 0) error("Tried to assign value to bound variable!");
+	storedVars[slot].value = v;
+	storedVars[slot].version++;
+}
+
+template<class T> T BasicVariables<T>::getValue(int slot){
+	Variable& var = storedVars[slot];
+	if (!var.isDefined) error("Variable with name "+std::string(var.name)+" not found.");
+	return var.value;
+}
+
+template<class T> void BasicVariables<T>::assignValue(int slot, T v){
+	Variable& var = storedVars[slot];
+	if (!var.isDefined) error("Variable with name "+std::string(var.name)+" not found.");
+	if (var.isConst) error("Tried to assign value to constant variable!");
+	if (var.binding >= 0) error("Tried to assign value to bound variable!");
+	var.value = v;
+	var.version++;
+}
+
+template<class T> void BasicVariables<T>::defineValue(int slot, T v, bool isConst){
+	Variable& var = storedVars[slot];
+	if (var.isDefined) error("Variable is already defined. Usage: v = 5;");
+	var.value = v;
+	var.isConst = isConst;
+	var.isDefined = true;
+	var.version++;
+}
+
+template<class T> void BasicVariables<T>::bindValue(int slot, T v, const Program& expression){
+	defineValue(slot, v, false);
+	storedVars[slot].binding = bindings.size();
+	bindings.push_back(expression);
+
+	// Register with every variable the expression reads
+	for (int read : readSlots(expression)) {
+		if (read >= dependents.size()) dependents.resize(read+1);
+		std::vector<int>& d = dependents[read];
+		if (std::find(d.begin(), d.end(), slot) == d.end()) d.push_back(slot);
+	}
+}
+
+template<class T> void BasicVariables<T>::updateBound(int slot, T v){
+	storedVars[slot].value = v;
+	storedVars[slot].version++;
+}
+
+template<class T> const BasicProgram<T>* BasicVariables<T>::getBinding(int slot) const {
+	int b = storedVars[slot].binding;
+	return b < 0 ? nullptr : &bindings[b];
+}
+
+template<class T> int BasicVariables<T>::getBindingOrder(int slot) const {
+	return storedVars[slot].binding;
+}
+
+template<class T> bool BasicVariables<T>::hasDependents(int slot) const {
+	return slot < dependents.size() && !dependents[slot].empty();
+}
+
+template<class T> const std::vector<int>& BasicVariables<T>::getDependents(int slot) const {
+	return dependents[slot];
+}
+
+// Binding then neither moves the bound expressions nor the lists of dependents, which statements running at the same time read
+template<class T> void BasicVariables<T>::reserveBindings(int count){
+	bindings.reserve(bindings.size() + count);
+	if (dependents.size() < storedVars.size()) dependents.resize(storedVars.size());
+}
+
+template<class T> int BasicVariables<T>::findFunction(std::string_view n) const {
+	auto found = functionIndex.find(n);
+	return found == functionIndex.end() ? -1 : found->second;
+}
+
+template<class T> int BasicVariables<T>::defineFunction(std::string_view n, Program body){
+	if (findFunction(n) >= 0) error("Function '"+std::string(n)+"' is already defined.");
+	functions.push_back(BasicFunction<T>{names.store(n), std::move(body)});
+	functionIndex[functions.back().name] = functions.size() - 1;
+	return functions.size() - 1;
+}
+
+template<class T> void BasicVariables<T>::saveSnapshot(const std::string& fileName) const {
+	SnapshotHeader header {};
+	std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = snapshotVersion;
+	header.count = storedVars.size();
+	header.tableSize = table.size();
+	header.numbers = uint8_t(Number<T>::type);
+
+	std::vector<SnapshotRecord<T>> records (storedVars.size());
+	std::string namesBlock;
+	for (int slot = 0; slot < storedVars.size(); slot++) {
+		const Variable& var = storedVars[slot];
+		SnapshotRecord<T>& r = records[slot];
+		r.nameOffset = namesBlock.size();
+		r.nameLength = var.name.size();
+		r.isConst = var.isConst;
+		r.isDefined = var.isDefined;
+		r.value = var.value;
+		namesBlock += var.name;
+	}
+	header.namesSize = namesBlock.size();
+
+	std::ofstream os {fileName, std::ios_base::binary};
+	if (!os) error("Unable to write snapshot to " + fileName + ".");
+	os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	os.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SnapshotRecord<T>));
+	os.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Entry));
+	os.write(namesBlock.data(), namesBlock.size());
+	if (!os) error("Unable to write snapshot to " + fileName + ".");
+}
+
+template<class T> void BasicVariables<T>::loadSnapshot(const std::string& fileName){
+	auto file = std::make_shared<MappedFile>(fileName);
+	if (!*file) error("Error ocurred for opening of file.");
+	size_t size = file->end() - file->begin();
+
+	// Check everything before anything is changed, a bad file leaves the table as it was
+	SnapshotHeader header;
+	if (size < sizeof(header)) error("Not a calculator snapshot: " + fileName);
+	std::memcpy(&header, file->begin(), sizeof(header));
+	if (std::memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != snapshotVersion) error("Not a calculator snapshot: " + fileName);
+	if (header.numbers != uint8_t(Number<T>::type)) {
+		error("Snapshot " + fileName + " holds " + numberTypeName(NumberType(header.numbers)) + " numbers, not " + Number<T>::name + ".");
+	}
+	size_t recordsSize = size_t(header.count) * sizeof(SnapshotRecord<T>);
+	size_t tableBytes = size_t(header.tableSize) * sizeof(Entry);
+	bool tableValid = (header.tableSize == 0 && header.count == 0) ||
+		(header.tableSize >= 2 * size_t(header.count) && (header.tableSize & (header.tableSize - 1)) == 0);
+	if (!tableValid || sizeof(header) + recordsSize + tableBytes + header.namesSize != size) error("Snapshot " + fileName + " is damaged.");
+
+	const SnapshotRecord<T>* records = reinterpret_cast<const SnapshotRecord<T>*>(file->begin() + sizeof(header));      // Aligned, the map starts on a page
+	const Entry* entries = reinterpret_cast<const Entry*>(file->begin() + sizeof(header) + recordsSize);
+	const char* namesBlock = file->begin() + sizeof(header) + recordsSize + tableBytes;
+	for (uint32_t i = 0; i < header.count; i++) {
+		if (size_t(records[i].nameOffset) + records[i].nameLength > header.namesSize) error("Snapshot " + fileName + " is damaged.");
+	}
+	auto name = [&](uint32_t i) { return std::string_view{namesBlock + records[i].nameOffset, records[i].nameLength}; };
+
+	if (storedVars.empty() && !shared) {
+		// Fresh table: names are read straight from the map and the hash table is taken over as it is, when findSlot can
+		// probe it: every slot once, under the hash of its name and reached from that hash without passing an empty entry
+		// (the table is at least twice the slots, so probing always ends). Otherwise it is built again from the names
+		size_t mask = header.tableSize - 1;
+		std::vector<char> seen(header.count, false);
+		uint32_t used = 0;
+		bool usable = true;
+		for (uint32_t i = 0; i < header.tableSize && usable; i++) {
+			int slot = entries[i].slot;
+			if (slot < 0) continue;
+			if (slot >= int(header.count) || seen[slot] || entries[i].hash != hashName(name(slot))) {
+				usable = false;
+				break;
+			}
+			seen[slot] = true;
+			used++;
+			for (size_t j = entries[i].hash & mask; j != i; j = (j+1) & mask) {
+				int other = entries[j].slot;
+				if (other < 0 || other >= int(header.count)) {
+					usable = false;
+					break;
+				}
+				if (entries[j].hash == entries[i].hash && name(other) == name(slot)) error("Snapshot " + fileName + " is damaged.");
+			}
+		}
+
+		std::vector<Entry> rebuilt;
+		if (!usable || used != header.count) {
+			size_t tableSize = 64;
+			while (2 * size_t(header.count) > tableSize) tableSize *= 2;
+			rebuilt.assign(tableSize, Entry{0, -1});
+			mask = tableSize - 1;
+			for (uint32_t slot = 0; slot < header.count; slot++) {
+				uint64_t h = hashName(name(slot));
+				size_t i = h & mask;
+				for (; rebuilt[i].slot >= 0; i = (i+1) & mask) {      // Two variables of one name would leave the second unreachable
+					if (rebuilt[i].hash == h && name(rebuilt[i].slot) == name(slot)) error("Snapshot " + fileName + " is damaged.");
+				}
+				rebuilt[i] = Entry{h, int(slot)};
+			}
+		}
+
+		storedVars.reserve(header.count);
+		for (uint32_t i = 0; i < header.count; i++) {
+			const SnapshotRecord<T>& r = records[i];
+			storedVars.push_back(Variable{name(i), r.value, bool(r.isConst), bool(r.isDefined)});
+			storedVars.back().version = r.isDefined;
+		}
+		if (rebuilt.empty()) table.assign(entries, entries + header.tableSize);
+		else table = std::move(rebuilt);
+		snapshot = std::move(file);
+		return;
+	}
+
+	// Variables already defined keep their slot and get the saved value; constants have to agree with the snapshot
+	for (uint32_t i = 0; i < header.count; i++) {
+		if (!records[i].isDefined) continue;
+		int slot = lookup(name(i));
+		if (slot < 0 || !storedVars[slot].isDefined) continue;
+		const Variable& var = storedVars[slot];
+		if (var.binding >= 0) error("Snapshot assigns bound variable " + std::string(name(i)) + ".");
+		if ((var.isConst || records[i].isConst) && (var.isConst != bool(records[i].isConst) || var.value != records[i].value)) {
+			error("Snapshot changes constant variable " + std::string(name(i)) + ".");
+		}
+	}
+	for (uint32_t i = 0; i < header.count; i++) {
+		const SnapshotRecord<T>& r = records[i];
+		if (!r.isDefined) continue;
+		int slot = getSlot(name(i));      // Copies the name, the file is closed afterwards
+		if (!storedVars[slot].isDefined) defineValue(slot, r.value, r.isConst);
+		else if (!r.isConst) assignValue(slot, r.value);
+	}
+}
+
+template<class T> std::vector<int> BasicVariables<T>::readSlots(const Program& p) const {
+	std::vector<int> slots;
+	for (const Instruction& in : p.code) {
+		if (in.op == Op::load) slots.push_back(in.slot);
+		if (in.op == Op::call || in.op == Op::reduce) {      // Bodies only call functions defined before them, so this always ends
+			std::vector<int> body = readSlots(in.op == Op::call ? functions[int(in.value)].body : p.subprograms[int(in.value)]);
+			slots.insert(slots.end(), body.begin(), body.end());
+		}
+	}
+	return slots;
+}
+
+}	// namespace calc
 
+#endif
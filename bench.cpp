@@ -0,0 +1,571 @@
+#include "Token.h"
+#include "Variable.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+#include "Optimizer.h"
+#include "Jit.h"
+#include "Batch.h"
+#include <new>
+#include <chrono>
+#include <atomic>
+
+using namespace std;
+using namespace calc;
+
+// Benchmarks for the pieces of the calculator: lexing (TokenStream::get), compiling (the parser in Compiler.h),
+// evaluating compiled programs (as compiled, after optimize(), as native code and over columns), writing results and the variable table
+// Workloads are generated, so runs are repeatable without any input files
+//
+// Usage: bench [--json] [--scale n]
+//	--json     one JSON object per line instead of a table, to keep track of results over releases
+//	--scale    multiply the size of every workload (default 1)
+
+
+// Count every allocation made through new, to report allocations per statement
+// Every form of the global operators is replaced, plain, array and aligned, so each delete frees what its own new allocated
+
+static atomic<size_t> allocations {0};      // Pools and pipelines allocate from several threads at once
+
+void* allocate(size_t size, size_t alignment = alignof(max_align_t)){
+	allocations.fetch_add(1, memory_order_relaxed);
+	if (size == 0) size = 1;
+	void* p = alignment <= alignof(max_align_t) ? malloc(size) : aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+	if (!p) throw bad_alloc();
+	return p;
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+void* operator new(size_t size, align_val_t a) { return allocate(size, size_t(a)); }
+void* operator new[](size_t size, align_val_t a) { return allocate(size, size_t(a)); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, align_val_t) noexcept { free(p); }
+void operator delete[](void* p, align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, align_val_t) noexcept { free(p); }
+
+
+// Workloads: each one is a script with one statement per line
+
+struct Workload {
+	string name;
+	string setup;       // Run once before the statements are evaluated, eg. variable definitions
+	string script;
+};
+
+string nested(int depth, int i){     // ((((i+1)*2)-3)... with depth levels of brackets
+	string s;
+	for (int d = 0; d < depth; d++) s += '(';
+	s += to_string(i % 10 + 1);
+	const char ops[] = {'+', '*', '-', '/'};
+	for (int d = 0; d < depth; d++) s += " " + string(1, ops[d % 4]) + " " + to_string(d % 9 + 1) + ")";
+	return s;
+}
+
+vector<Workload> makeWorkloads(int scale){
+	vector<Workload> w;
+
+	Workload nest {"nested"};
+	for (int i = 0; i < 2000 * scale; i++) nest.script += nested(40, i) + "\n";
+	w.push_back(nest);
+
+	Workload script {"long_script"};
+	for (int i = 0; i < 50000 * scale; i++) script.script += to_string(i) + " + " + to_string(i % 7 + 1) + " * 3.5 - " + to_string(i % 11) + " % 4\n";
+	w.push_back(script);
+
+	Workload vars {"many_variables"};
+	int n = 20000 * scale;
+	for (int i = 0; i < n; i++) vars.setup += "# v" + to_string(i) + " = " + to_string(i) + "\n";
+	for (int i = 0; i < n; i++) vars.script += "v" + to_string((i * 7919) % n) + " + v" + to_string((i * 104729) % n) + " * 2\n";
+	w.push_back(vars);
+
+	Workload repeated {"repeated_terms"};     // Subterms worth folding and sharing
+	repeated.setup = "# const pi = 3.1415926535\n";
+	for (int i = 0; i < 20000 * scale; i++) repeated.setup += "# r" + to_string(i) + " = " + to_string(i) + "\n";
+	for (int i = 0; i < 20000 * scale; i++) {
+		string r = "r" + to_string(i);
+		repeated.script += "pow(pi, 2) * (sqrt " + r + " * " + r + " + 1) + pow(pi, 2) * (sqrt " + r + " * " + r + " + 1) + 4 * 3\n";
+	}
+	w.push_back(repeated);
+
+	Workload math {"pow_sqrt_fact"};
+	for (int i = 0; i < 20000 * scale; i++) math.script += "pow(" + to_string(i % 13) + ".5, 3) + (sqrt " + to_string(i) + ") * 2 - " + to_string(i % 8) + "! \n";
+	w.push_back(math);
+
+	// The same formula written out on every line, and as a user function defined once (inlined by the compiler)
+	Workload pasted {"formula_pasted"};
+	Workload called {"formula_called"};
+	pasted.setup = called.setup = "# a = 1.5\n# b = 2\n";
+	called.setup += "# f(x, y) = (x * x + y) / (x + 1) - sqrt (y * y + 1)\n";
+	for (int i = 0; i < 20000 * scale; i++) {
+		string x = "a + " + to_string(i % 17), y = "b * " + to_string(i % 5 + 1);
+		pasted.script += "((" + x + ") * (" + x + ") + " + y + ") / ((" + x + ") + 1) - sqrt (" + y + ") * (" + y + ") + 1\n";
+		called.script += "f(" + x + ", " + y + ")\n";
+	}
+	w.push_back(pasted);
+	w.push_back(called);
+
+	return w;
+}
+
+
+// Measurements
+
+struct Result {
+	string workload;
+	string phase;
+	long statements = 0;
+	long tokens = 0;
+	double seconds = 0;
+	double p50 = 0;      // Latency of one statement, in nanoseconds
+	double p99 = 0;
+	double allocationsPerStatement = 0;
+};
+
+typedef chrono::steady_clock Clock;
+
+double nanoseconds(Clock::duration d){
+	return chrono::duration<double, nano>(d).count();
+}
+
+void percentiles(Result& r, vector<double>& latencies){
+	if (latencies.empty()) return;
+	sort(latencies.begin(), latencies.end());
+	r.p50 = latencies[latencies.size() / 2];
+	r.p99 = latencies[min(latencies.size() - 1, latencies.size() * 99 / 100)];
+}
+
+Result lexPhase(const Workload& w, bool stream){      // From the buffer, or through an istream as for cin
+	Result r {w.name, stream ? "lex_stream" : "lex"};
+	ostringstream os;
+	istringstream is {w.script};
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+
+	TokenStream ts = stream ? TokenStream {is, os} : TokenStream {w.script.data(), w.script.data() + w.script.size(), os};
+	while (true) {
+		Token t = ts.get();
+		if (t.kind == eof) break;
+		if (t.kind == print) r.statements++;
+		r.tokens++;
+	}
+
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+	return r;
+}
+
+vector<Program> compileAll(const string& script, AvailableVariables& vt, Result& r, vector<double>& latencies){
+	vector<Program> programs;
+	long lines = count(script.begin(), script.end(), '\n');
+	programs.reserve(lines);      // Keep our own bookkeeping out of the allocation counts
+	latencies.reserve(latencies.size() + lines);
+	ostringstream os;
+	TokenStream ts (script.data(), script.data() + script.size(), os);
+	while (true) {
+		Clock::time_point start = Clock::now();
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) break;
+		ts.putBack(t);
+		programs.push_back(compileStatement(ts, vt));
+		latencies.push_back(nanoseconds(Clock::now() - start));
+	}
+	r.statements = programs.size();
+	return programs;
+}
+
+void runSetup(const Workload& w, AvailableVariables& vt){
+	Result ignored;
+	vector<double> latencies;
+	for (const Program& p : compileAll(w.setup, vt, ignored, latencies)) if (!p.code.empty()) evaluate(p, vt);     // Empty for function definitions
+}
+
+long countTokens(const Workload& w){
+	return lexPhase(w, false).tokens;
+}
+
+Result compilePhase(const Workload& w){
+	Result r {w.name, "compile"};
+	AvailableVariables vt;
+	runSetup(w, vt);
+	vector<double> latencies;
+
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	compileAll(w.script, vt, r, latencies);
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+
+	r.tokens = countTokens(w);
+	percentiles(r, latencies);
+	return r;
+}
+
+Result evaluatePhase(const Workload& w, bool optimized){
+	Result r {w.name, optimized ? "optimized" : "evaluate"};
+	AvailableVariables vt;
+	runSetup(w, vt);
+	vector<double> latencies;
+	vector<Program> programs = compileAll(w.script, vt, r, latencies);
+	if (optimized) for (Program& p : programs) p = optimize(p, vt);
+	const int rounds = 5;
+	latencies.clear();
+	latencies.reserve(rounds * programs.size());
+
+	double sink = 0;
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	for (int round = 0; round < rounds; round++) {
+		for (const Program& p : programs) {
+			Clock::time_point s = Clock::now();
+			sink += evaluate(p, vt);
+			latencies.push_back(nanoseconds(Clock::now() - s));
+		}
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.statements *= rounds;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+	if (sink == 1.2345) cerr << "";      // Keep the results alive
+
+	percentiles(r, latencies);
+	return r;
+}
+
+// A handful of formulas evaluated over and over, the case the native backend in Jit.h is meant for
+// Latencies are per run, timed over blocks of runs since one run is about as short as reading the clock
+Result hotPhase(const Workload& w, bool native){
+	Result r {w.name, native ? "hot_native" : "hot_interp"};
+	AvailableVariables vt;
+	runSetup(w, vt);
+	vector<double> latencies;
+	vector<Program> all = compileAll(w.script, vt, r, latencies);
+	const int formulas = min<int>(8, all.size());
+	deque<NativeProgram> programs;
+	for (int i = 0; i < formulas; i++) programs.emplace_back(optimize(all[i], vt));
+	const int blocks = 200;
+	const int runs = 1000;
+	latencies.clear();
+	latencies.reserve(blocks * formulas);
+
+	double sink = 0;
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	for (int block = 0; block < blocks; block++) {
+		for (NativeProgram& p : programs) {
+			Clock::time_point s = Clock::now();
+			if (native) for (int i = 0; i < runs; i++) sink += p.run(vt);
+			else for (int i = 0; i < runs; i++) sink += evaluate(p.getProgram(), vt);
+			latencies.push_back(nanoseconds(Clock::now() - s) / runs);
+		}
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.statements = long(blocks) * runs * formulas;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+	if (sink == 1.2345) cerr << "";
+
+	percentiles(r, latencies);
+	return r;
+}
+
+Result outputPhase(const Workload& w, ResultWriter::Format format){      // Writing the results, as calculate() does after evaluating
+	Result r {w.name, format == ResultWriter::Format::plain ? "out_plain" : "out_prompt"};
+	AvailableVariables vt;
+	runSetup(w, vt);
+	vector<double> latencies;
+	vector<double> values;
+	for (const Program& p : compileAll(w.script, vt, r, latencies)) values.push_back(evaluate(p, vt));
+	ostringstream os;
+	os.str(string(64 * values.size(), ' '));      // Room for all the output, so growing the string is not measured
+	os.seekp(0);
+
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	{
+		ResultWriter out {os, format};
+		for (double d : values) {
+			out.prompt();
+			out.result();
+			out.value(d);
+		}
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+	return r;
+}
+
+Result endToEndPhase(const Workload& w){      // Lex, compile and evaluate each statement, as calculate() does
+	Result r {w.name, "end_to_end"};
+	AvailableVariables vt;
+	runSetup(w, vt);
+	vector<double> latencies;
+	latencies.reserve(count(w.script.begin(), w.script.end(), '\n'));
+	ostringstream os;
+	double sink = 0;
+
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	TokenStream ts (w.script.data(), w.script.data() + w.script.size(), os);
+	while (true) {
+		Clock::time_point s = Clock::now();
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) break;
+		ts.putBack(t);
+		Program p = compileStatement(ts, vt);
+		sink += evaluate(p, vt);
+		latencies.push_back(nanoseconds(Clock::now() - s));
+		r.statements++;
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+	if (sink == 1.2345) cerr << "";
+
+	r.tokens = countTokens(w);
+	percentiles(r, latencies);
+	return r;
+}
+
+// Lines that fail to compile or to evaluate, against the same number of good lines, both through the status path of calculate()
+Result errorPathPhase(int scale, bool malformed){
+	Result r {"error_path", malformed ? "malformed" : "valid"};
+	const char* bad[] = {" + * 3", " @ 3", " + (3", " / 0"};       // Syntax error, unknown char, missing ')', division by zero
+	string script;
+	for (int i = 0; i < 50000 * scale; i++) script += to_string(i) + (malformed ? bad[i % 4] : " + 3 * 3") + "\n";
+	AvailableVariables vt;
+	vector<double> latencies;
+	latencies.reserve(50000 * scale);
+	ostringstream os;
+	double sink = 0;
+
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	TokenStream ts (script.data(), script.data() + script.size(), os);
+	ts.in.setName("script");      // Errors get their file position too
+	while (true) {
+		Clock::time_point s = Clock::now();
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) break;
+		ts.putBack(t);
+		Program p;
+		double value = 0;
+		Status status;
+		if (!compileStatement(ts, vt, p)) ts.clean();
+		else if (!(status = tryEvaluate(p, vt, value))) {
+			ts.failStatement(faultMessage(status, vt));
+			ts.clean();
+		}
+		sink += value;
+		latencies.push_back(nanoseconds(Clock::now() - s));
+		r.statements++;
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.allocationsPerStatement = double(allocations - before) / max(r.statements, 1L);
+	if (sink == 1.2345) cerr << "";
+
+	percentiles(r, latencies);
+	return r;
+}
+
+// A series written out as one line per term (the only way before reductions), against one sum() statement
+// Statements count the terms, so both rows are in terms per second
+Result seriesPhase(int scale, bool reduction){
+	Result r {"series", reduction ? "sum" : "lines"};
+	long terms = 200000L * scale;
+	string script = "# s = 0\n";
+	if (reduction) script += "s = sum(n, 1, " + to_string(terms) + ", 1 / (n * n + 1))\n";
+	else for (long n = 1; n <= terms; n++) script += "s = s + 1 / (" + to_string(n) + " * " + to_string(n) + " + 1)\n";
+	AvailableVariables vt;
+	ostringstream os;
+
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	TokenStream ts (script.data(), script.data() + script.size(), os);
+	while (true) {
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) break;
+		ts.putBack(t);
+		evaluate(compileStatement(ts, vt), vt);
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.statements = terms;
+	r.allocationsPerStatement = double(allocations - before) / terms;
+	if (vt.getVar("s") == 1.2345) cerr << "";
+	return r;
+}
+
+// The same integer script compiled and evaluated with each number type of Number.h, everything else the same
+template<class T> Result numbersPhase(int scale){
+	Result r {"numbers", Number<T>::name};
+	string script;
+	for (int i = 0; i < 20000 * scale; i++) script += to_string(i) + " * 3 + (" + to_string(i) + " % 7) * 11 - " + to_string(i + 1) + " / 4\n";
+	BasicVariables<T> vt;
+	vector<BasicProgram<T>> programs;
+	TokenStream ts (script.data(), script.data() + script.size());
+	while (true) {
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) break;
+		ts.putBack(t);
+		programs.push_back(compileStatement(ts, vt));
+	}
+
+	const int runs = 20;
+	T sink = 0;
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	for (int run = 0; run < runs; run++) {
+		for (const BasicProgram<T>& p : programs) sink += evaluate(p, vt);
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.statements = long(runs) * programs.size();
+	r.allocationsPerStatement = double(allocations - before) / r.statements;
+	if (sink == T(12345)) cerr << "";
+	return r;
+}
+
+// One formula over columns of inputs: a row at a time through evaluate(), against evaluateBatch() (Batch.h)
+// Statements count the rows
+Result batchPhase(int scale, bool batch){
+	Result r {"columns", batch ? "batch" : "rows"};
+	size_t rows = 1000000 * scale;
+	vector<double> xs(rows), ys(rows), out(rows);
+	for (size_t i = 0; i < rows; i++) {
+		xs[i] = double(i % 1000) / 7;
+		ys[i] = double(i % 17) + 0.5;
+	}
+	AvailableVariables vt;
+	vt.setVar("x", 0, false);
+	vt.setVar("y", 0, false);
+	string formula = "(x * x + y) / (x + 1) - sqrt (y * y + 1)\n";
+	TokenStream ts (formula.data(), formula.data() + formula.size());
+	Program p = compileStatement(ts, vt);
+	int x = vt.findSlot("x"), y = vt.findSlot("y");
+
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	if (batch) {
+		BatchInputs in;
+		in.bind(vt, "x", xs.data());
+		in.bind(vt, "y", ys.data());
+		evaluateBatch(p, vt, in, rows, out.data());
+	}
+	else {
+		for (size_t i = 0; i < rows; i++) {
+			vt.assignValue(x, xs[i]);
+			vt.assignValue(y, ys[i]);
+			out[i] = evaluate(p, vt);
+		}
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.statements = rows;
+	r.allocationsPerStatement = double(allocations - before) / rows;
+	if (out[rows / 2] == 1.2345) cerr << "";
+	return r;
+}
+
+Result variableTablePhase(int scale){      // setVar for new names, then getVar on existing ones in scattered order
+	Result r {"variable_table", "lookup"};
+	int n = 100000 * scale;
+	vector<string> names;
+	for (int i = 0; i < n; i++) names.push_back("name_" + to_string(i));
+
+	AvailableVariables vt;
+	vector<double> latencies;
+	latencies.reserve(n);
+	double sink = 0;
+	size_t before = allocations;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < n; i++) vt.setVar(names[i], i, false);
+	for (int i = 0; i < n; i++) {
+		Clock::time_point s = Clock::now();
+		sink += vt.getVar(names[(i * 7919L) % n]);
+		latencies.push_back(nanoseconds(Clock::now() - s));
+	}
+	r.seconds = nanoseconds(Clock::now() - start) * 1e-9;
+	r.statements = 2L * n;
+	r.allocationsPerStatement = double(allocations - before) / r.statements;
+	if (sink == 1.2345) cerr << "";
+
+	percentiles(r, latencies);
+	return r;
+}
+
+
+// Output
+
+void printTable(const vector<Result>& results){
+	cout << left << setw(16) << "workload" << setw(12) << "phase"
+		<< right << setw(14) << "stmts/s" << setw(14) << "tokens/s"
+		<< setw(11) << "p50 ns" << setw(11) << "p99 ns" << setw(13) << "allocs/stmt" << '\n';
+	for (const Result& r : results) {
+		cout << left << setw(16) << r.workload << setw(12) << r.phase << right << fixed << setprecision(0)
+			<< setw(14) << r.statements / r.seconds
+			<< setw(14) << (r.tokens ? r.tokens / r.seconds : 0)
+			<< setw(11) << r.p50 << setw(11) << r.p99
+			<< setprecision(2) << setw(13) << r.allocationsPerStatement << '\n';
+	}
+}
+
+void printJson(const vector<Result>& results){
+	for (const Result& r : results) {
+		cout << "{\"workload\":\"" << r.workload << "\",\"phase\":\"" << r.phase << "\""
+			<< ",\"statements\":" << r.statements << ",\"tokens\":" << r.tokens
+			<< ",\"seconds\":" << r.seconds
+			<< ",\"statements_per_second\":" << r.statements / r.seconds
+			<< ",\"tokens_per_second\":" << (r.tokens ? r.tokens / r.seconds : 0)
+			<< ",\"p50_ns\":" << r.p50 << ",\"p99_ns\":" << r.p99
+			<< ",\"allocations_per_statement\":" << r.allocationsPerStatement << "}\n";
+	}
+}
+
+
+int main(int argc, char* argv[])
+try {
+	bool json = false;
+	int scale = 1;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--json") json = true;
+		else if (arg == "--scale" && i + 1 < argc) scale = max(1, atoi(argv[++i]));
+		else error("Usage: bench [--json] [--scale n]");
+	}
+
+	vector<Result> results;
+	for (const Workload& w : makeWorkloads(scale)) {
+		results.push_back(lexPhase(w, false));
+		results.push_back(lexPhase(w, true));
+		results.push_back(compilePhase(w));
+		results.push_back(evaluatePhase(w, false));
+		results.push_back(evaluatePhase(w, true));
+		results.push_back(hotPhase(w, false));
+		results.push_back(hotPhase(w, true));
+		results.push_back(outputPhase(w, ResultWriter::Format::interactive));
+		results.push_back(outputPhase(w, ResultWriter::Format::plain));
+		results.push_back(endToEndPhase(w));
+	}
+	results.push_back(seriesPhase(scale, false));
+	results.push_back(seriesPhase(scale, true));
+	results.push_back(errorPathPhase(scale, false));
+	results.push_back(errorPathPhase(scale, true));
+	results.push_back(numbersPhase<double>(scale));
+	results.push_back(numbersPhase<float>(scale));
+	results.push_back(numbersPhase<long double>(scale));
+	results.push_back(numbersPhase<int64_t>(scale));
+	results.push_back(batchPhase(scale, false));
+	results.push_back(batchPhase(scale, true));
+	results.push_back(variableTablePhase(scale));
+
+	if (json) printJson(results);
+	else printTable(results);
+	return 0;
+}
+catch (exception& e) {
+	cerr << e.what() << '\n';
+	return 1;
+}
@@ -1,6 +1,18 @@
-#include "std_lib_facilities.h"
 #include "Token.h"
 #include "Variable.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+#include "Optimizer.h"
+#include "MappedFile.h"
+#include "StatementGraph.h"
+#include "Pipeline.h"
+#include "Server.h"
+#include "Stats.h"
+#include "Profiler.h"
+#include "ScriptCache.h"
+
+using namespace std;
+using namespace calc;      // The calculator itself is only one user of the library, see Context.h for embedding it
 
 // This exercise was actually incredibly helpful to demonstrate tokens and grammars
 // I did not anticipate a seemingly simple calculator to become so intricate 
@@ -10,7 +22,7 @@ Simple calculator
 Taken from book C++ Programing Principles and Practices
 
 This program implements a basic expression calculator.
-Input from cin; output to cout.
+Input from cin; output to cout (the library itself only reads and writes the streams it is given).
 The grammar for input is:
 
 Calculate:
@@ -47,6 +59,8 @@ Primary:
 	Let Definition 
 	var
 	var = Expression
+	var( Arguments )
+	Reduction( var, Expression, Expression, Expression )
 	pow( Expression, Expression )
 	sqrt Expression
 Number:
@@ -58,40 +72,137 @@ Let:
 Definition:
 	var = Expression
 	const var = Expression
+	bind var = Expression
+	var( Parameters ) = Expression       (only as a whole statement, defines a function)
+Arguments:
+	Expression
+	Arguments , Expression
+Reduction:
+	sum
+	prod
+	min
+	max
+Parameters:
+	var
+	Parameters , var
 
 Input comes from cin through the TokenStream called ts.
 Variables are handled through the AvailableVariables vt.
+Each statement is first compiled into a Program (Compiler.h), folded and shared by optimize() (Optimizer.h) and then evaluated (Evaluator.h).
 */
 
 
 // Declarations allows tells the compiler to trust that this function is defined somewhere
 // Passing TokenStram and Available variables by reference allows to modify them at each step
-void calculate (TokenStream&, AvailableVariables&);
-void inputFile (TokenStream&, AvailableVariables&);
-void outputFile (TokenStream&, AvailableVariables&);
-double definition (TokenStream&, AvailableVariables&);
-double expression (TokenStream&, AvailableVariables&);     
-double term (TokenStream&, AvailableVariables&);
-double secondary (TokenStream&, AvailableVariables&);
-double primary (TokenStream&, AvailableVariables&);
-void printWelcome();   
-void printHelp();
-
-
-int main()
+// Most are templates on the numbers the session calculates with (calculator --numbers, see Number.h)
+template<class T> void setUp (BasicVariables<T>&, const string& snapshot, int memo);
+template<class T> void calculate (TokenStream&, BasicVariables<T>&, ScriptRecorder<T>* = nullptr);
+template<class T> bool statement (TokenStream&, BasicVariables<T>&, ScriptRecorder<T>* = nullptr);
+template<class T> void runScript (const string& path, ResultWriter&, BasicVariables<T>&);
+template<class T> void replay (CachedScript<T>&, ResultWriter&, BasicVariables<T>&);
+void calculateParallel (TokenStream&, AvailableVariables&);
+template<class T> bool command (Token, TokenStream&, BasicVariables<T>&);
+template<class T> void inputFile (TokenStream&, BasicVariables<T>&);
+template<class T> void outputFile (TokenStream&, BasicVariables<T>&);
+template<class T> void snapshotFile (Token, TokenStream&, BasicVariables<T>&);
+void printWelcome(ostream&);   
+void printHelp(ostream&);
+void keep_window_open(string s);
+
+Profiler* profiler = nullptr;      // Set while a script runs with 'from profile', see Profiler.h
+string scriptDirectory;            // calculator --script-cache dir, see ScriptCache.h
+
+template<class T> BasicScriptCache<T>& scriptCache(){      // Scripts run with from so far
+	static BasicScriptCache<T> cache {scriptDirectory};
+	return cache;
+}
+
+
+int main(int argc, char* argv[])
 try {
 	// Create object to store and retrive user defined variables
-	TokenStream ts;        // ts for token stream
-	AvailableVariables vt; // vt for variable table       
+	ResultWriter output {cout, ResultWriter::Format::interactive, cerr};     // Results to cout, errors to cerr
+	TokenStream ts {cin, output};        // ts for token stream
+
+	// calculator --serve address [--threads n]: serve sessions over a socket instead, see Server.h
+	// calculator --stats file.json: write the statistics (see Stats.h) to the file at exit
+	// calculator --memo n: keep the results of up to n statements (see Memo.h), 0 turns it off
+	// calculator --load file: start with the variables of a snapshot written by save
+	// calculator --numbers float|double|long|int64: the numbers to calculate with, double by default
+	// calculator --script-cache dir: also keep the scripts compiled by from in dir, for later processes (see ScriptCache.h)
+	string address;
+	string statsFile;
+	string snapshot;
+	int threads = 0;
+	int memo = -1;      // Size the cache starts with
+	NumberType numbers = NumberType::real;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--serve" && i + 1 < argc) address = argv[++i];
+		else if (arg == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (arg == "--stats" && i + 1 < argc) statsFile = argv[++i];
+		else if (arg == "--memo" && i + 1 < argc) memo = atoi(argv[++i]);
+		else if (arg == "--load" && i + 1 < argc) snapshot = argv[++i];
+		else if (arg == "--numbers" && i + 1 < argc && parseNumberType(argv[i+1], numbers)) i++;
+		else if (arg == "--script-cache" && i + 1 < argc) scriptDirectory = argv[++i];
+		else error("Usage: calculator [--serve port|socket-path [--threads n]] [--stats file.json] [--memo n] [--load snapshot] [--numbers float|double|long|int64] [--script-cache dir]");
+	}
+
+	if (!scriptDirectory.empty()) {
+		error_code failed;
+		filesystem::create_directories(scriptDirectory, failed);
+		if (failed) error("Unable to use " + scriptDirectory + " for the script cache.");
+	}
+
+	if (!address.empty()) {
+		if (numbers != NumberType::real) error("The server only calculates with double.");
+		AvailableVariables vt;
+		setUp(vt, snapshot, memo);
+		Server server {address, vt, threads};     // The constants and the memo size are shared by every session
+		cout << "Serving on " << address << '\n';
+		server.run();
+		return 0;
+	}
 
-	// Set constant variables
-	vt.setVar("pi", 3.1415926535, true);
-	vt.setVar("e", 2.7182818284, true);
-	vt.setVar("k", 1000, true);
+	printWelcome(cout);
 
-	printWelcome();
+	// Each number type is a calculator of its own, compiled from the same templates
+	switch (numbers) {
+	case NumberType::real:
+	{
+		AvailableVariables vt; // vt for variable table
+		setUp(vt, snapshot, memo);
+		calculate(ts, vt);
+		break;
+	}
+	case NumberType::single:
+	{
+		BasicVariables<float> vt;
+		setUp(vt, snapshot, memo);
+		calculate(ts, vt);
+		break;
+	}
+	case NumberType::extended:
+	{
+		BasicVariables<long double> vt;
+		setUp(vt, snapshot, memo);
+		calculate(ts, vt);
+		break;
+	}
+	case NumberType::integer:
+	{
+		BasicVariables<int64_t> vt;
+		setUp(vt, snapshot, memo);
+		calculate(ts, vt);
+		break;
+	}
+	}
 
-	calculate(ts, vt);
+	if (!statsFile.empty()) {
+		ofstream os {statsFile};
+		if (!os) error("Unable to write statistics to " + statsFile + ".");
+		stats::printJson(os);
+	}
 
 	return 0;            // Return zero to show successful completion
 }
@@ -108,265 +219,325 @@ catch (...) {
 }
 
 
-// Grammar
+template<class T> void setUp(BasicVariables<T>& vt, const string& snapshot, int memo){
+	if (memo >= 0) vt.getMemo().setCapacity(memo);
+	if (!snapshot.empty()) vt.loadSnapshot(snapshot);      // First, so an empty table can take the snapshot as it is
 
-void calculate(TokenStream& ts, AvailableVariables& vt){   // Passed by reference because we want functions modigying only one object
+	// Set constant variables, unless the snapshot already had them (int64 has no pi or e)
+	if constexpr (!is_integral_v<T>) {
+		if (!vt.checkVarExists("pi")) vt.setVar("pi", T(3.1415926535), true);
+		if (!vt.checkVarExists("e")) vt.setVar("e", T(2.7182818284), true);
+	}
+	if (!vt.checkVarExists("k")) vt.setVar("k", 1000, true);
+}
 
-	while (ts.ist) 
-	try {
-		ts.ost << prompt;
-		Token t = ts.get();
 
-		// Eats up the ; character, so the next input read by cin starts anew
-		while (t.kind==print) t = ts.get();    
-		if (t.kind==quit || t.kind==eof) return;    // Take into acount end of input stream to quit as well       
-		if (t.kind==help) {printHelp(); cout<<'\n'; continue;} // Use error to clean stream and skip to next iteration
-		// Currently this output stream stays open indefinitelyy, need to think of a way to close it
-		if (t.kind==to) {outputFile(ts, vt); cout<<'\n'; continue;}
-		if (t.kind==from) {inputFile(ts, vt); cout<<'\n'; continue;}  // Creates inner loop to calculate from file
+// Grammar
 
-		ts.putBack(t);
-		ts.ost << result << expression(ts, vt) << "\n";   
-	}
-	catch (exception& e){
-		cerr << e.what() << '\n';
-		ts.clean();
+template<class T> void calculate(TokenStream& ts, BasicVariables<T>& vt, ScriptRecorder<T>* recorder){   // Passed by reference because we want functions modigying only one object
+	while (ts.in) {
+		ts.out.prompt();
+		if (!statement(ts, vt, recorder)) return;
 	}
 }
 
 
-double expression(TokenStream& ts, AvailableVariables& vt) {
-
-	double buffer = term(ts, vt);
+// Runs the next statement of ts, false at the end of the input or on exit
+// Malformed statements and failed checks come back as a status, only commands still throw
+// With a recorder, the statement is also added to the script it records (see ScriptCache.h)
+template<class T> bool statement(TokenStream& ts, BasicVariables<T>& vt, ScriptRecorder<T>* recorder)
+try {
 	Token t = ts.get();
 
-	while (true) {
-		switch (t.kind) {
-		case '+':
-			buffer += term(ts, vt);
-			t = ts.get();            
-			break;
-		case '-':
-			buffer -= term(ts, vt);
-			t = ts.get();
-			break;
-		default:
-			ts.putBack(t);
-			return buffer;
-		}
+	// Eats up the ; character, so the next input read by cin starts anew
+	while (t.kind==print) t = ts.get();    
+	if (t.kind==eof) {
+		if (recorder) recorder->ended();
+		return false;
+	}
+	if (recorder) recorder->begin(ts);
+	if (t.kind==quit) {       // Take into acount end of input stream to quit as well
+		if (recorder) recorder->add(ts, vt);
+		return false;
+	}
+	Profiler::Scope profile {profiler, ts};     // Nothing unless profiling, a nested from counts as a statement too
+	if (command(t, ts, vt)) {
+		if (recorder) recorder->add(ts, vt);
+		return true;
 	}
-}
-
 
-double term(TokenStream& ts, AvailableVariables& vt) {
+	ts.putBack(t);
+	STATS_TIME(statement);
+	BasicProgram<T> p;
+	if (!compileStatement(ts, vt, p)) {      // Parse the whole statement first, then run it
+		STATS_COUNT(errors);
+		ts.out.result();
+		ts.out.error(ts.diagnostic().message);
+		ts.clean();
+		if (recorder) recorder->add(ts, vt);
+		return true;
+	}
+	if (p.code.empty()) {                    // Function definition, nothing to run
+		if (recorder) recorder->add(ts, vt);
+		return true;
+	}
+	BasicProgram<T> optimized = optimize(p, vt);      // p is recorded as compiled, a replay optimizes it in the table it runs in
+	ts.out.result();
+	T value;
+	Status s;
+	{
+		STATS_TIME(evaluate);
+		s = tryEvaluateMemo(optimized, vt, value);
+	}
+	if (!s) {
+		STATS_COUNT(errors);
+		ts.failStatement(faultMessage(s, vt));
+		ts.out.error(ts.diagnostic().message);
+		bool ended = ts.endsStatement();      // Otherwise clean() drops the rest of the line, which may run another time
+		ts.clean();
+		if (recorder) recorder->add(ts, vt, ended ? &p : nullptr);
+		return true;
+	}
+	ts.out.value(value);
+	STATS_COUNT(statements);
+	if (recorder) recorder->add(ts, vt, &p);
+	return true;
+}
+catch (exception& e){
+	STATS_COUNT(errors);
+	ts.out.error(e.what());
+	ts.clean();
+	if (recorder) recorder->add(ts, vt);
+	return true;
+}
 
-	double buffer = secondary(ts, vt);
-	Token t = ts.get();
 
-	while (true) {
-		switch (t.kind) {
-		case '*':
-			buffer *= secondary(ts, vt);
-			t = ts.get();
-			break;
-		case '/':
-		{
-			double d = secondary(ts, vt);
-			if (d == 0) error("Cannot divide by zero!");
-			buffer /= d;
-			t = ts.get();
-			break;
-		}
-		case '%':
-		 {
-			// Need to check for zero
-			double d  = secondary(ts, vt);
-			if (d == 0) error("Cannot perform modulo by zero!");
-			buffer = fmod(buffer, d);
-			t = ts.get();
-			break;
-		 }
-		default:
-			ts.putBack(t);
-			return buffer;
-		}
-	}
+template<class T> bool command(Token t, TokenStream& ts, BasicVariables<T>& vt){   // Runs help, stats, to, from, save and load commands, false if t is none of them
+	if (t.kind==help) {printHelp(cout); cout<<'\n'; return true;} // Use error to clean stream and skip to next iteration
+	if (t.kind==statistics) {stats::print(cout); cout<<'\n'; return true;}
+	// Currently this output stream stays open indefinitelyy, need to think of a way to close it
+	if (t.kind==to) {outputFile(ts, vt); cout<<'\n'; return true;}
+	if (t.kind==from) {inputFile(ts, vt); cout<<'\n'; return true;}  // Creates inner loop to calculate from file
+	if (t.kind==save || t.kind==load) {snapshotFile(t, ts, vt); return true;}
+	return false;
 }
 
 
-// Introduce new layer just for factorial (stronger binding than *, /, %)
-double secondary(TokenStream& ts, AvailableVariables& vt) {  
-	double buffer = primary(ts, vt);
+// Same results as calculate(), but the whole script is compiled before anything runs
+// Statements that do not touch the same variables are then evaluated at the same time, see StatementGraph.h
+void calculateParallel(TokenStream& ts, AvailableVariables& vt){
 
-	while (true) {
+	ThreadPool pool;
+	StatementGraph graph;
 
+	while (ts.in) {
 		Token t = ts.get();
-
-		switch(t.kind){
-		case '!': 
-		{
-			int x = narrow_cast<int>(buffer);
-			int fact = 1;
-			for (int i = 1; i <= x; i++) {
-				fact *= i;      // Should see over flow over 12! but seeing it at 17!
-				if (fact < 0) error("Overflow of factorial!");   // Using double means this doesn't catch alll wrong factorials
+		while (t.kind==print) t = ts.get();
+		if (t.kind!=quit && t.kind!=eof && !isCommand(t.kind)) {
+			ts.putBack(t);
+			Program p;
+			if (compileStatement(ts, vt, p)) graph.add(optimize(p, vt), vt, ts.statementLocation());
+			else {
+				STATS_COUNT(errors);
+				graph.addError(ts.diagnostic().message);
+				ts.clean();
 			}
-			buffer = fact;
-			break;
+			continue;
 		}
-		case k:
-			buffer *= 1000;
-			break;
 
-		default:	
-			ts.putBack(t);
-			return buffer;
+		// Commands run in script order, so everything compiled before them is evaluated first
+		graph.run(pool, vt);
+		graph.print(ts.out);
+		graph.clear();
+
+		ts.out.prompt();
+		if (t.kind==quit || t.kind==eof) return;
+		try {
+			command(t, ts, vt);
+		}
+		catch (exception& e){
+			STATS_COUNT(errors);
+			ts.out.error(e.what());
+			ts.clean();
 		}
 	}
+	graph.run(pool, vt);
+	graph.print(ts.out);
 }
 
 
-double primary(TokenStream& ts, AvailableVariables& vt) {
+template<class T> void inputFile (TokenStream& ts, BasicVariables<T>& vt)
+{	// Token from was already read
 
 	Token t = ts.get();
 
-	switch (t.kind) {
-	case '(':
-	{                                  
-		double d = expression(ts, vt); 
-		Token t = ts.get();
-		if (t.kind != ')'){       // Notice that char ')' gets eaten
-			error("missing ')'");
-		}          
-		return d;
+	bool parallel = false;
+	bool stream = false;
+	bool profile = false;
+	if (t.kind == var && t.name == "parallel") {     // from parallel path
+		parallel = true;
+		t = ts.get();  // Get path following "parallel"
 	}
-	case '{':
-	{                                  
-		double d = expression(ts, vt);
-		Token t = ts.get();
-		if (t.kind != '}'){
-			error("missing '}'");
-		}          
-		return d;
+	else if (t.kind == var && t.name == "stream") {  // from stream path: read, evaluate and write on separate threads
+		stream = true;
+		t = ts.get();
 	}
-	case number:
-		return t.value;
-
-	case '-':                  // Add the possibility for negative numbers
-		return -primary(ts, vt);
-	
-	case '+':                 // This will mean that repeated +'s are skiped: eg. 1++++2; works
-		return primary(ts, vt);
-
-	case let:
-		return definition(ts, vt);
-
-	case var:
-	{
-		string name = t.name;    // Extract name of variable before modifying Token t
-		double value = vt.getVar(name);    // In case var is detected, read double from stored variables
-
-		// Assignment of existing variable
-		Token t = ts.get();
-		if (t.kind=='='){
-			double d = expression(ts, vt);
-			vt.replaceVar(name, d);
-			return d;
-		}
-		ts.putBack(t);
-		return value;    // The beauty of Tokens is that string input types can just as easily be handled by the switch statement
+	else if (t.kind == var && t.name == "profile") { // from profile path: time every line, see Profiler.h
+		profile = true;
+		t = ts.get();
 	}
-
-	// Square root function, works with or without brakets
-	case sq: 
-	{  
-		double d = expression(ts, vt);
-		if (d<0) error("Square root of negative number not allowed.");
-		return sqrt(d);
+	if (t.kind != path) error ("Unable to find path specified, make sure to include '.' and '/' in path name");
+	if constexpr (!is_same_v<T, double>) {
+		if (parallel || stream) error ("'from parallel' and 'from stream' only calculate with double.");
 	}
-	
-	// Power function, requires brackets as in pow(double base, int i)
-	case pwr:
-	{   
-		t = ts.get();
-		if (t.kind != '(') error ("'(' expected for calling function pow(double n, int i).");
-		double base = expression(ts, vt);
-		t = ts.get();
-		if (t.kind != ',') error ("Missing ',' when calling pow(double n, int i).");
-		double exponent = expression(ts, vt);
-		int i = narrow_cast<int>(exponent);
-		t = ts.get();
-		if (t.kind != ')') error ("Missing ')' when calling pow(double n, int i).");
-		return pow(base, i);
+	else if (stream) {
+		calculateStream(string(t.name), vt, ts.out);
+		return;
 	}
-	
-
-
-	default:
-	 	ts.putBack(t);
-		error("Primary expected.");
-		break;
+	string name {t.name};
+	if constexpr (is_same_v<T, double>) {
+		if (parallel) {
+			MappedFile ifile {name};
+			if (!ifile) error ("Error ocurred for opening of file.");
+
+			// Change private input stream to file by initializing token stream, lexed straight from the mapped file
+			TokenStream tsf (ifile.begin(), ifile.end(), ts.out);
+			tsf.in.setName(name);      // Errors in the file tell where they are
+			calculateParallel (tsf, vt);
+			return;
+		}
 	}
+	if (profile && !profiler) {      // Inside a script already profiled it is a plain from, its lines are in that profile
+		Profiler run;
+		profiler = &run;
+		try {
+			runScript (name, ts.out, vt);
+		}
+		catch (...) {
+			profiler = nullptr;
+			throw;
+		}
+		profiler = nullptr;
+
+		string trace = name + ".trace.json";
+		ofstream ofile {trace};
+		run.report(cout);
+		if (ofile) run.writeTrace(ofile);
+		cout << '\n' << (ofile ? "Trace written to " : "Unable to write the trace to ") << trace;
+		return;
+	}
+	runScript (name, ts.out, vt);    // Start reading from file
+	return;
 }
 
 
-double definition(TokenStream& ts, AvailableVariables& vt){
-	// 'let' was already read 
-
-	Token t = ts.get();
-
-	bool isConst = false;
-	if (t.name == "const") {
-		isConst = true;
-		t = ts.get();  // Get var following "const"
+// Runs a script file, from the statements it compiled to before when it did not change since (see ScriptCache.h)
+template<class T> void runScript (const string& path, ResultWriter& out, BasicVariables<T>& vt)
+{
+	BasicScriptCache<T>& cache = scriptCache<T>();
+	ScriptFile file;
+	CachedScript<T>* script = cache.find(path, file);
+	if (script && script->replayable) {
+		replay(*script, out, vt);
+		return;
 	}
-	if (t.kind != var) error("Variable name expected.");
-	string varName = t.name;     // Read name of variable
 
-	t = ts.get();
-	if (t.kind != '=') error("Equal sign '=' expected after variable '"+varName+"'.");
+	MappedFile ifile {path};
+	if (!ifile) error ("Error ocurred for opening of file.");
+	if (!script) script = cache.find(path, file, ifile.begin(), ifile.end());
+	if (script && script->replayable) {
+		replay(*script, out, vt);
+		return;
+	}
 
-	double d = expression(ts, vt);
-	vt.setVar(varName, d, isConst);     // Store variable 
-	return d;     // return double to keep consistency with other functions
+	// Change private input stream to file by initializing token stream, lexed straight from the mapped file
+	TokenStream tsf (ifile.begin(), ifile.end(), out);
+	tsf.in.setName(path);      // Errors in the file tell where they are
+	if (script) {              // Known to run only as it is
+		calculate (tsf, vt);
+		return;
+	}
+	ScriptRecorder<T> recorder {path, file, ifile.begin(), ifile.end()};
+	calculate (tsf, vt, &recorder);
+	cache.store(move(recorder.script), vt);
 }
 
-void inputFile (TokenStream& ts, AvailableVariables& vt)
-{	// Token from was already read
-
-	Token t = ts.get();
 
-	if (t.kind != path) error ("Unable to find path specified, make sure to include '.' and '/' in path name");
-	ifstream ifile {t.name};
-	if (!ifile) error ("Error ocurred for opening of file.");
-
-	// Change private input stream to file by initializing token stream 
-	TokenStream tsf (ifile, ts.ost);
-	calculate (tsf, vt);    // Start reading from file
-	return;
+// Same prompts, results and errors as calculate() gave running the file
+template<class T> void replay (CachedScript<T>& script, ResultWriter& out, BasicVariables<T>& vt)
+{
+	for (CachedStatement<T>& s : script.statements) {
+		out.prompt();
+		if (!prepare(s, vt)) {       // Compiled again from its chars, errors still tell the line and column
+			string text = script.text(s);
+			TokenStream tss (text.data(), text.data() + text.size(), out);
+			tss.in.setName(script.path, s.line);
+			if (!statement(tss, vt)) return;
+			continue;
+		}
+		try {
+			Profiler::Scope profile {profiler, script.path, s.line};
+			STATS_TIME(statement);
+			out.result();
+			T value;
+			Status status;
+			{
+				STATS_TIME(evaluate);
+				status = tryEvaluateMemo(s.program, vt, value);
+			}
+			if (!status) {
+				STATS_COUNT(errors);
+				out.error(script.location(s) + faultMessage(status, vt));
+				continue;
+			}
+			out.value(value);
+			STATS_COUNT(statements);
+		}
+		catch (exception& e){
+			STATS_COUNT(errors);
+			out.error(e.what());
+		}
+	}
+	if (script.promptAtEnd) out.prompt();
 }
 
 
-void outputFile (TokenStream& ts, AvailableVariables& vt)
+template<class T> void outputFile (TokenStream& ts, BasicVariables<T>& vt)
 {
 	// Token to was already read
 
 	Token t = ts.get();
 
+	// to plain path: only the results, one per line, to binary path: fixed size records
+	ResultWriter::Format format = ResultWriter::Format::interactive;
+	if (t.kind == var && t.name == "plain") format = ResultWriter::Format::plain;
+	if (t.kind == var && t.name == "binary") format = ResultWriter::Format::binary;
+	if (format != ResultWriter::Format::interactive) t = ts.get();  // Get path following the format
+
 	if (t.kind != path) error ("Unable to find path specified, make sure to include '.' and '/' in path name");
-	ofstream ofile {t.name};
+	ofstream ofile {string(t.name), format == ResultWriter::Format::binary ? ios_base::binary : ios_base::out};
 	if (!ofile) error ("Error ocurred for opening of file.");
 
 	// Initialize a new calculate loop with the new output stream
-	TokenStream tsf (ts.ist, ofile);
+	ResultWriter output {ofile, format, cerr};
+	TokenStream tsf (ts.in, output);
 	calculate (tsf, vt);
 	return;
 
 }
+template<class T> void snapshotFile (Token command, TokenStream& ts, BasicVariables<T>& vt)
+{
+	// save path: write every variable to a binary snapshot, load path: define the variables of a snapshot
+	Token t = ts.get();
+	if (t.kind != path) error ("Unable to find path specified, make sure to include '.' and '/' in path name");
+	if (command.kind == save) vt.saveSnapshot(string(t.name));
+	else vt.loadSnapshot(string(t.name));
+}
+
 // Printing functions
 
-void printWelcome(){
-    cout << "Welcome to our simple calculator."
+void printWelcome(ostream& os){
+    os << "Welcome to our simple calculator."
         << "\nPlease enter floating point numbers."
         << "\nExpressions available: +, -, *, /, %, !"
         << "\nPress " << print << " to return value and " << quit << " to quit."
@@ -374,8 +545,8 @@ void printWelcome(){
     return;
 }
 
-void printHelp(){
-    cout << "You have reached the Help page."
+void printHelp(ostream& os){
+    os << "You have reached the Help page."
          << "\nUnfortunately this section is under development."
         << "\nBut as a general guidance for the calculator:"
         << "\n\nType numbers and +, -, *, /, %, ! for usual calculations."
@@ -384,6 +555,27 @@ void printHelp(){
         << "\nType exit to exit."
         << "\nThis calculator accepts defiining variables!"
         << "\nUse '# var = 1' to define variable"
-        << "\nCan assign different value to defined variable ie 'var = 2'";
+        << "\nCan assign different value to defined variable ie 'var = 2'"
+        << "\nUse '# bind y = x * 2' to keep y up to date whenever x changes"
+        << "\nUse '# f(x, y) = x * x + y' to define a function, then call it as f(2, 3)"
+        << "\nUse sum(i, 1, 100, 1 / i) for a sum over i = 1 to 100, and prod, min and max the same way"
+        << "\nUse 'from file.txt' to read input from a file, 'from parallel file.txt' to run independent lines at the same time"
+        << "\nUse 'from stream file.txt' for big files: reading, evaluating and writing results then overlap"
+        << "\nUse 'from profile file.txt' to time every line of a script, the hot lines are shown and a trace is written to file.txt.trace.json"
+        << "\nUse 'save vars.snap' to keep all variables in a file, and 'load vars.snap' (or calculator --load vars.snap) to get them back"
+        << "\nStart with calculator --numbers float, long or int64 to calculate with those instead of double"
+        << "\nFiles run again with from replay what they compiled to, start with calculator --script-cache dir to keep that for later runs too"
+        << "\nType stats to see how many statements ran and where the time went"
+        << "\nUse 'to file.txt' to write results to a file, 'to plain file.txt' for results only, 'to binary file.bin' for binary records";
 }
 
+void keep_window_open(string s)     // As in std_lib_facilities.h, which the library no longer uses
+{
+	if (s == "") return;
+	cin.clear();
+	cin.ignore(120, '\n');
+	cout << "Please enter " << s << " to exit\n";
+	string ss;
+	while (cin >> ss && ss != s)
+		cout << "Please enter " << s << " to exit\n";
+}
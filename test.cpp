@@ -0,0 +1,1751 @@
+#include "Common.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+#include "Optimizer.h"
+#include "Batch.h"
+#include "Jit.h"
+#include "Memo.h"
+#include "Number.h"
+#include "MappedFile.h"
+#include "StatementGraph.h"
+#include "ThreadPool.h"
+#include "Pipeline.h"
+#include "Server.h"
+#include "Stats.h"
+#include "Profiler.h"
+#include "ScriptCache.h"
+#include "Context.h"
+#include <random>
+
+using namespace std;
+using namespace calc;
+
+// Checks of the calculator, build and run with make test
+// Most compare two ways of computing the same thing (eg. a batch against evaluate() row by row), so they need no expected values
+// Prints each check that fails and exits with 1 if any did
+
+int failures = 0;
+
+void check(bool ok, const string& what){
+	if (ok) return;
+	failures++;
+	cerr << "FAILED: " << what << '\n';
+}
+
+Program compile(const string& statement, AvailableVariables& vt){
+	istringstream is {statement + '\n'};      // Ended as a typed line, the stream lexer needs the newline after a name at the very end
+	ostringstream os;
+	TokenStream ts (is, os);
+	return compileStatement(ts, vt);
+}
+
+void run(const string& statements, AvailableVariables& vt){      // Statements that have to work, eg. definitions
+	istringstream is {statements + '\n'};
+	ostringstream os;
+	TokenStream ts (is, os);
+	while (true) {
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) return;
+		ts.putBack(t);
+		Program p = compileStatement(ts, vt);
+		evaluate(p, vt);
+	}
+}
+
+string errorOf(const string& statement, AvailableVariables& vt){      // Message of the error compiling or running statement gives
+	try {
+		Program p = compile(statement, vt);
+		evaluate(p, vt);
+	}
+	catch (exception& e) {
+		return e.what();
+	}
+	return "";
+}
+
+
+// Same double, bit for bit, so 0 and -0 are apart. Any NaN equals any other: which one an operation on two NaNs gives
+// depends on the order the compiler put the operands in, which nothing in the calculator fixes
+bool sameBits(double a, double b){
+	if (isnan(a) && isnan(b)) return true;
+	return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+// Compiler.h, Evaluator.h: a compiled statement gives the value and the error the grammar gives it
+
+void testStatements(){
+	const pair<string, double> values[] = {
+		{"1 + 2 * 3", 7}, {"(1 + 2) * 3", 9}, {"{2 + 3} * 2", 10}, {"2 - 3 - 4", -5}, {"10 / 4", 2.5}, {"7 % 3", 1},
+		{"-2 * -3", 6}, {"+-+2", -2}, {"3!", 6}, {"pow(2, 10)", 1024}, {"sqrt 16", 4}, {"x * 2 + c", 8}, {"x = x + 1", 4},
+		{"# y = x * 2", 6}, {"(# z = 2) + z", 4},
+	};
+	for (const auto& [statement, expected] : values) {
+		AvailableVariables vt;
+		run("# x = 3; # const c = 2", vt);
+		double value = evaluate(compile(statement, vt), vt);
+		check(value == expected, statement + " = " + to_string(value) + ", expected " + to_string(expected));
+	}
+
+	const pair<string, string> errors[] = {
+		{"1 / 0", "Cannot divide by zero!"}, {"5 % 0", "Cannot perform modulo by zero!"},
+		{"sqrt (0 - 4)", "Square root of negative number not allowed."}, {"u + 1", "Variable with name u not found."},
+		{"u = 1", "Variable with name u not found."}, {"c = 1", "Tried to assign value to constant variable!"},
+		{"# x = 1", "Variable is already defined. Usage: v = 5;"}, {"(1 + 2", "missing ')'"}, {"{1", "missing '}'"},
+		{"pow(2 3)", "Missing ',' when calling pow(double n, int i)."}, {"pow(2, 0.5)", "info loss"}, {"*", "Primary expected."},
+		{"# 1 = 2", "Variable name expected."},
+	};
+	for (const auto& [statement, expected] : errors) {
+		AvailableVariables vt;
+		run("# x = 3; # const c = 2", vt);
+		string message = errorOf(statement, vt);
+		check(message == expected, statement + ": error '" + message + "', expected '" + expected + "'");
+	}
+}
+
+// A program only keeps slots, so it sees every later value of its variables, and its definitions happen when it runs
+
+void testCompiledOnce(){
+	AvailableVariables vt;
+	run("# x = 1", vt);
+	Program p = compile("x * 2", vt);
+	for (int x : {1, 5, -3}) {
+		run("x = " + to_string(x), vt);
+		check(evaluate(p, vt) == 2 * x, "x * 2 after x = " + to_string(x));
+	}
+
+	Program define = compile("# y = x", vt);
+	check(!vt.checkVarExists("y"), "y is not defined by compiling its definition");
+	evaluate(define, vt);
+	check(vt.checkVarExists("y") && vt.getVar("y") == -3, "y is defined by running its definition");
+	check(errorOf("u", vt) == "Variable with name u not found.", "slot reserved for u by compiling is still undefined");
+	check(evaluate(Program {}, vt) == 0, "an empty program gives 0");
+}
+
+
+// Variable.h: every name keeps one slot while the table grows, and the table keeps its own copy of the name
+
+void testVariableTable(){
+	AvailableVariables vt;
+	const int count = 20000;
+	vector<int> slots;
+	for (int i = 0; i < count; i++) {
+		string name = "v" + to_string(i);      // Gone after each iteration, the table must not point into it
+		slots.push_back(vt.getSlot(name));
+		if (i % 2) vt.setVar(name, i, false);
+	}
+	const string longName (10000, 'n');      // Bigger than a chunk of the name arena
+	int longSlot = vt.getSlot(longName);
+
+	for (int i = 0; i < count; i++) {
+		string name = "v" + to_string(i);
+		if (vt.findSlot(name) != slots[i] || vt.getSlot(name) != slots[i] || vt.getName(slots[i]) != name) {
+			check(false, "slot of " + name);
+			break;
+		}
+		if (vt.checkVarExists(name) != bool(i % 2) || (i % 2 && vt.getVar(name) != i)) {
+			check(false, "value of " + name);
+			break;
+		}
+	}
+	sort(slots.begin(), slots.end());
+	check(unique(slots.begin(), slots.end()) == slots.end(), "every name has its own slot");
+	check(vt.findSlot(longName) == longSlot && vt.getName(longSlot) == longName, "slot of a long name");
+	check(vt.findSlot("v") < 0 && vt.findSlot("v" + to_string(count)) < 0 && vt.findSlot("") < 0, "names never seen have no slot");
+}
+
+
+// Token.h, MappedFile.h: a script lexed from a mapped file gives the tokens it gives read from a stream
+
+string describe(TokenStream& ts){      // Every token up to the end, and the error that stopped the lexer if one did
+	string tokens;
+	try {
+		for (Token t = ts.get(); t.kind != eof; t = ts.get()) tokens += string(1, t.kind) + ' ' + to_string(t.value * (t.kind == number)) + ' ' + string(t.kind == number ? "" : t.name) + '\n';      // Literals by value, their chars are spelled as each path read them
+	}
+	catch (exception& e) {
+		tokens += e.what();
+	}
+	return tokens;
+}
+
+void testMappedLexing(){
+	const string file = "test.calc";
+	const char* scripts[] = {
+		"# x = 1.5e3; y = x * .5 + 3. - 2\n",
+		"1e+2 1E-2 0.25.5 007 12345678901234567890\n",
+		"from dir/file.txt; to out.txt\n  sqrt pow(2, 3)! {4} % exit h\n",
+		"x_1 = y2\n\n;; # const k = 2\n",
+		"1 + $\n",
+		"",
+	};
+	for (const char* script : scripts) {
+		ofstream os {file, ios_base::binary};
+		os << script;
+		os.close();
+
+		istringstream is {script};
+		ostringstream out;
+		TokenStream stream (is, out);
+		MappedFile mapped {file};
+		check(bool(mapped) && string(mapped.begin(), mapped.end()) == script, string("contents of a mapped file: ") + script);
+		TokenStream buffer (mapped.begin(), mapped.end(), out);
+		string expected = describe(stream);
+		string tokens = describe(buffer);
+		check(tokens == expected, string("tokens of a mapped file:\n") + tokens + "expected:\n" + expected);
+	}
+	remove(file.c_str());
+	check(!MappedFile("test.missing"), "a missing file does not open");
+}
+
+
+// Token.h: tokens are plain values, and the names they view stay valid until the stream starts the next statement
+
+static_assert(is_trivially_copyable<Token>::value, "tokens are copied without touching the heap");
+
+void testTokenNames(){
+	// One statement with names long enough to need several chunks, every token still read before looking at them
+	string statement;
+	vector<string> names;
+	for (int i = 0; i < 40; i++) {
+		names.push_back("v" + string(50 + 13 * i, 'a' + i % 26) + to_string(i));      // Not starting with h, which is help
+		statement += (i ? " + " : "") + names.back();
+	}
+	istringstream is {statement + "\n"};
+	ostringstream os;
+	TokenStream ts (is, os);
+	vector<Token> tokens;
+	for (Token t = ts.get(); t.kind != print; t = ts.get()) tokens.push_back(t);
+	vector<string> seen;
+	for (const Token& t : tokens) if (t.kind == var) seen.push_back(string(t.name));
+	check(seen == names, "names of one statement stay valid while the stream moves to bigger chunks");
+
+	// Names lexed from a buffer are views of the buffer itself
+	const string script = "alpha + beta\n";
+	TokenStream buffered (script.data(), script.data() + script.size(), os);
+	Token t = buffered.get();
+	check(t.kind == var && t.name == "alpha" && t.name.data() == script.data(), "a name from a buffer views the buffer");
+
+	// The table keeps its own copy of a name it interns
+	AvailableVariables vt;
+	for (int i = 0; i < 5; i++) run("# " + names[i] + " = " + to_string(i), vt);
+	for (int i = 0; i < 5; i++) check(vt.getVar(names[i]) == i, "variable named by a token " + to_string(i));
+}
+
+
+// Token.h: numeric literals read with from_chars give the value, the stream state and the remaining input operator>> gives
+
+void testLiterals(){
+	vector<string> literals = {
+		"0", "7", "3.25", "0.1", ".5", "5.", "1e10", "1E-5", "2.5e+3", "1e", "1e+", "1.5e-", "12x", "1.2.3", "1e5e5", "9e999",
+		"1e-999", "4.9e-324", "1.7976931348623157e308", "1.8e308", "123456789012345678901234567890", ".", "0.000000000000000000001",
+		"00012", "1ee2", "3.14159265358979323846264338327950288",
+	};
+	mt19937 random {12345};
+	const string chars = "0123456789.eE+-";
+	for (int i = 0; i < 20000; i++) {      // Digits first, then anything a literal could be made of
+		string literal (1, char('0' + random() % 10));
+		int length = random() % 12;
+		for (int j = 0; j < length; j++) literal += chars[random() % (j < 6 ? 10 : chars.size())];
+		literals.push_back(literal);
+	}
+
+	for (const string& literal : literals) {
+		for (const string& after : {string(""), string(" + 1")}) {
+			istringstream expected {literal + after};
+			double e = 0;
+			bool ok = bool(expected >> e);
+			bool ended = expected.eof();
+			string rest;
+			expected.clear();
+			getline(expected, rest, '\0');
+
+			istringstream is {literal + after};
+			CharSource source {is};
+			double v = 0;
+			string_view text;
+			bool read = source.readNumber(v, text);
+			bool same = read == ok && is.fail() == !ok && is.eof() == ended;
+			is.clear();
+			string left;
+			getline(is, left, '\0');
+			if (!sameBits(v, e) || !same || left != rest) {
+				check(false, "'" + literal + after + "' read as " + to_string(v) + " with " + left + " left, operator>> gives " + to_string(e) + " with " + rest + " left");
+				break;
+			}
+
+			// The buffer path agrees with the stream on every literal the stream reads whole
+			if (!ok || !after.empty() || !ended) continue;
+			CharSource buffer {literal.data(), literal.data() + literal.size()};
+			double b = 0;
+			string_view chars;
+			if (!buffer.readNumber(b, chars) || !sameBits(b, v) || chars != literal) {
+				check(false, "'" + literal + "' read from a buffer as " + to_string(b) + ", expected " + to_string(v));
+				break;
+			}
+		}
+	}
+}
+
+
+// Batch.h: every row of a batch gives what evaluate() gives with the values of the row
+
+void testBatch(){
+	const vector<double> values = {1, -1, 2, -3, 0.5, -7.25, 10, 1e300};
+	const char* formulas[] = {
+		"-x", "x + y", "x - y", "x * y", "-x * y + x", "x / y", "x % y", "(sqrt (x * x)) - y", "pow(x, 2) + y", "pow(y, n)",
+		"n! + y", "(x + y) * -(x - y)", "{x / 2} - -y", "x * s + 1",
+	};
+
+	// Every pair of values with n from 0 to 5, repeated so the rows fill more than one block and end in a partial vector
+	vector<double> xs, ys, ns;
+	while (xs.size() < 1100) {
+		for (double x : values) for (double y : values) {
+			xs.push_back(x);
+			ys.push_back(y);
+			ns.push_back(xs.size() % 6);
+		}
+	}
+	xs.push_back(3);
+	ys.push_back(4);
+	ns.push_back(2);
+	size_t rows = xs.size();
+
+	for (const char* formula : formulas) {
+		AvailableVariables vt;
+		run("# x = 0; # y = 0; # n = 0; # s = 3", vt);      // s is not bound, every row reads it from the table
+		Program p = compile(formula, vt);
+		BatchInputs in;
+		in.bind(vt, "x", xs.data());
+		in.bind(vt, "y", ys.data());
+		in.bind(vt, "n", ns.data());
+		vector<double> out(rows);
+		evaluateBatch(p, vt, in, rows, out.data());
+
+		for (size_t r = 0; r < rows; r++) {
+			vt.replaceVar("x", xs[r]);
+			vt.replaceVar("y", ys[r]);
+			vt.replaceVar("n", ns[r]);
+			double expected = evaluate(p, vt);
+			if (out[r] != expected) {
+				check(false, string(formula) + ": row " + to_string(r) + " is " + to_string(out[r]) + ", expected " + to_string(expected));
+				break;
+			}
+		}
+	}
+
+	// A batch fails with the error of its failing rows, and refuses programs that assign
+	AvailableVariables vt;
+	run("# x = 0; # y = 0", vt);
+	vector<double> out(rows);
+	const pair<string, string> errors[] = {
+		{"1 / (x - 2)", "Cannot divide by zero!"}, {"x % (x + 1)", "Cannot perform modulo by zero!"},
+		{"sqrt x", "Square root of negative number not allowed."}, {"x!", "info loss"}, {"y = x", "Assignments are not supported in batch evaluation."},
+	};
+	for (const auto& [formula, expected] : errors) {
+		Program p = compile(formula, vt);
+		BatchInputs in;
+		in.bind(vt, "x", xs.data());
+		string message;
+		try {
+			evaluateBatch(p, vt, in, rows, out.data());
+		}
+		catch (exception& e) {
+			message = e.what();
+		}
+		check(message == expected, formula + ": batch error '" + message + "', expected '" + expected + "'");
+	}
+
+	// Programs with ops the kernels do not have are refused rather than run
+	Program body;
+	body.emit(Op::arg, 0, 0);
+	body.emit(Op::number, 1);
+	body.emit(Op::add);
+	Program unknown;
+	unknown.emit(Op::number, 1);
+	unknown.code.push_back(Instruction{Op(100), false, 0, 0});
+	const pair<Program, string> refused[] = {
+		{body, "Function bodies are not supported in batch evaluation."}, {unknown, "Instruction not supported in batch evaluation."},
+	};
+	for (const auto& [p, expected] : refused) {
+		string message;
+		try {
+			evaluateBatch(p, vt, BatchInputs {}, rows, out.data());
+		}
+		catch (exception& e) {
+			message = e.what();
+		}
+		check(message == expected, "batch error '" + message + "', expected '" + expected + "'");
+	}
+}
+
+// Batch.h: every row, and every block, gives what evaluate() gives with the values of the row, bit for bit, 0, -0, NaN and infinities too
+
+void testBatchRows(){
+	const double nan = numeric_limits<double>::quiet_NaN();
+	const double inf = numeric_limits<double>::infinity();
+	const vector<double> values = {0, -0.0, 1, -1, 2.5, -7.25, 3, 1e308, -1e-310, nan, -nan, inf, -inf};
+	const char* formulas[] = {
+		"-x", "-(x * y)", "x + y", "x - y", "x * y", "-x * y + x", "x / y", "x % y", "sqrt x", "sqrt (x * x) - y",
+		"pow(x, 2) + y", "pow(y, x)", "x! + y", "(x + y) * -(x - y)", "{x / 2} - -y",
+	};
+
+	// Every pair of values, repeated so the rows fill whole vectors and more than one block
+	vector<double> xs, ys;
+	while (xs.size() < 1100) {
+		for (double x : values) for (double y : values) {
+			xs.push_back(x);
+			ys.push_back(y);
+		}
+	}
+	size_t rows = xs.size();
+
+	for (const char* formula : formulas) {
+		AvailableVariables vt;
+		run("# x = 0; # y = 0", vt);
+		Program p = compile(formula, vt);
+		int x = vt.findSlot("x"), y = vt.findSlot("y");
+
+		// Row by row, as the calculator would run the formula after x = ...; y = ...
+		vector<double> expected(rows);
+		vector<string> errors(rows);
+		int firstError = -1;
+		for (size_t r = 0; r < rows; r++) {
+			vt.assignValue(x, xs[r]);
+			vt.assignValue(y, ys[r]);
+			Status s = tryEvaluate(p, vt, expected[r]);
+			if (!s) errors[r] = faultMessage(s, vt);
+			if (!s && firstError < 0) firstError = r;
+		}
+
+		BatchInputs in;
+		in.bind(vt, "x", xs.data());
+		in.bind(vt, "y", ys.data());
+		for (size_t r = 0; r < rows; r++) {      // One row each
+			double value;
+			string message;
+			try {
+				BatchInputs one;
+				one.bind(vt, "x", &xs[r]);
+				one.bind(vt, "y", &ys[r]);
+				evaluateBatch(p, vt, one, 1, &value);
+			}
+			catch (exception& e) {
+				message = e.what();
+			}
+			string row = string(formula) + " with x = " + to_string(xs[r]) + ", y = " + to_string(ys[r]);
+			check(message == errors[r], row + ": error '" + message + "', expected '" + errors[r] + "'");
+			if (errors[r].empty() && message.empty()) check(sameBits(value, expected[r]), row + ": " + to_string(value) + ", expected " + to_string(expected[r]));
+		}
+
+		vector<double> out(rows);      // All rows at once
+		string message;
+		try {
+			evaluateBatch(p, vt, in, rows, out.data());
+		}
+		catch (exception& e) {
+			message = e.what();
+		}
+		if (firstError >= 0) check(message == errors[firstError], string(formula) + ": batch error '" + message + "', expected '" + errors[firstError] + "'");
+		else {
+			check(message.empty(), string(formula) + ": batch error '" + message + "'");
+			for (size_t r = 0; r < rows && message.empty(); r++) {
+				if (!sameBits(out[r], expected[r])) {
+					check(false, string(formula) + ": batch row " + to_string(r) + " differs");
+					break;
+				}
+			}
+		}
+
+		// Rows without errors only, so the whole batch runs
+		vector<double> goodX, goodY;
+		for (size_t r = 0; r < rows; r++) {
+			if (!errors[r].empty()) continue;
+			goodX.push_back(xs[r]);
+			goodY.push_back(ys[r]);
+		}
+		BatchInputs good;
+		good.bind(vt, "x", goodX.data());
+		good.bind(vt, "y", goodY.data());
+		vector<double> goodOut(goodX.size());
+		evaluateBatch(p, vt, good, goodX.size(), goodOut.data());
+		for (size_t r = 0, g = 0; r < rows; r++) {
+			if (!errors[r].empty()) continue;
+			if (!sameBits(goodOut[g], expected[r])) {
+				check(false, string(formula) + ": batch of good rows differs at row " + to_string(r));
+				break;
+			}
+			g++;
+		}
+	}
+}
+
+
+
+// StatementGraph.h: a script run as a graph on several threads prints and leaves what it does run line by line
+
+string runScript(const string& script, AvailableVariables& vt, bool parallel, ResultWriter::Format format = ResultWriter::Format::interactive,
+	const string& name = ""){
+	// Output and errors, as calculate() prints them for a script read with 'from name'
+	ostringstream out, errors;
+	ResultWriter writer {out, format, errors};
+	TokenStream input (script.data(), script.data() + script.size(), writer);
+	if (!name.empty()) input.in.setName(name);
+	ThreadPool pool {8};      // More threads than statements at a time, even on one core
+	StatementGraph graph;
+	while (true) {
+		Token t = input.get();
+		while (t.kind == print) t = input.get();
+		if (t.kind == eof) break;
+		input.putBack(t);
+		Program p;
+		if (!compileStatement(input, vt, p)) {
+			if (parallel) graph.addError(input.diagnostic().message);
+			else {
+				writer.prompt();
+				writer.result();
+				writer.error(input.diagnostic().message);
+			}
+			input.clean();
+			continue;
+		}
+		if (parallel) {
+			graph.add(p, vt, input.statementLocation());
+			continue;
+		}
+		writer.prompt();
+		if (p.code.empty()) continue;      // Function definition
+		writer.result();
+		double value;
+		Status s = tryEvaluate(p, vt, value);
+		if (s) writer.value(value);
+		else {
+			input.failStatement(faultMessage(s, vt));
+			writer.error(input.diagnostic().message);
+			input.clean();
+		}
+	}
+	graph.run(pool, vt);
+	graph.print(writer);
+	writer.flush();
+	return out.str() + errors.str();
+}
+
+void testParallelScript(){
+	string script = "# a = 1\n# b = 2\n# c = a + b\na = c * 2\nb = a + b\n1 / (a - 6)\n# d = u\n(1 + \nd = 3\n# a = 2\n";
+	const int lines = 300;
+	for (int i = 0; i < lines; i++) script += "# v" + to_string(i) + " = " + to_string(i) + " * a\n";      // Independent of each other
+	for (int i = 1; i < lines; i++) script += "v" + to_string(i) + " = v" + to_string(i) + " + v" + to_string(i-1) + "\n";     // A chain
+	for (int i = 0; i < lines; i += 7) script += "b = b + v" + to_string(i) + "\nsqrt (v" + to_string(i) + " - 100)\n";
+
+	AvailableVariables sequential, parallel;
+	string expected = runScript(script, sequential, false);
+	string output = runScript(script, parallel, true);
+	check(output == expected, "output of a parallel script");
+	for (string name : {"a", "b", "c"}) check(parallel.getVar(name) == sequential.getVar(name), name + " after a parallel script");
+	for (int i = 0; i < lines; i++) {
+		string name = "v" + to_string(i);
+		if (parallel.getVar(name) != sequential.getVar(name)) {
+			check(false, name + " after a parallel script");
+			break;
+		}
+	}
+}
+
+// Token.h: results written as plain text or binary records say what the interactive output says
+
+void testResultFormats(){
+	string script = "# x = 2\n1 / 3\nx * 1e300 * 1e10\n-x * 0\n1 / 0\n(1 + \nx = x * 3\n0.000012345678\n123456789\n";
+	for (int i = 0; i < 5000; i++) script += "x = x * 1.01 - " + to_string(i % 7) + "\n";      // More than one block of output
+
+	AvailableVariables a, b, c, d;
+	string interactive = runScript(script, a, false);
+	string plain = runScript(script, b, false, ResultWriter::Format::plain);
+	string binary = runScript(script, c, false, ResultWriter::Format::binary);
+	string parallelPlain = runScript(script, d, true, ResultWriter::Format::plain);
+
+	// Interactive results are the lines after ">=", a statement that failed running has the next prompt there instead
+	string expected;
+	size_t at = 0;
+	while ((at = interactive.find(string(1, prompt) + result, at)) != string::npos) {
+		at += 2;
+		size_t end = interactive.find_first_of(string("\n") + prompt, at);
+		if (interactive[end] == '\n') expected += interactive.substr(at, end - at + 1);
+	}
+	string errors = "Cannot divide by zero!\nPrimary expected.\n";
+	check(plain == expected + errors, "plain output is the interactive results, one per line");
+	check(parallelPlain == plain, "plain output of a parallel script");
+
+	// Records: index of the statement, failing ones included, and the value
+	check(binary.size() == errors.size() + 16 * (count(expected.begin(), expected.end(), '\n')), "one binary record per result");
+	istringstream values {expected};
+	uint64_t last = 0;
+	for (size_t r = 0; r + 16 <= binary.size() - errors.size(); r += 16) {
+		uint64_t index;
+		double value;
+		memcpy(&index, &binary[r], 8);
+		memcpy(&value, &binary[r + 8], 8);
+		ostringstream text;
+		text << value;
+		string line;
+		getline(values, line);
+		if (text.str() != line || (r && index <= last)) {
+			check(false, "binary record " + to_string(index) + " is " + text.str() + ", expected " + line);
+			break;
+		}
+		last = index;
+	}
+	check(last == 5000 + 8, "binary records count the failing statements");
+}
+
+
+// Server.h: sessions served at the same time each get their own variables and the results of their own lines
+
+#ifdef CALCULATOR_SERVER
+string talk(const string& path, const string& lines){      // Everything the server answers to lines, until it closes the connection
+	sockaddr_un a {};
+	a.sun_family = AF_UNIX;
+	memcpy(a.sun_path, path.c_str(), path.size());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	while (connect(fd, reinterpret_cast<sockaddr*>(&a), sizeof(a)) != 0) this_thread::sleep_for(chrono::milliseconds(10));
+
+	for (size_t at = 0; at < lines.size(); ) {      // A piece at a time, so lines arrive split
+		ssize_t n = write(fd, lines.data() + at, min<size_t>(7, lines.size() - at));
+		if (n <= 0) break;
+		at += n;
+	}
+	string answer;
+	char buffer[4096];
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0) answer.append(buffer, n);
+	::close(fd);
+	return answer;
+}
+
+void testServer(){
+	const string path = "/tmp/calculator-test-" + to_string(getpid()) + ".sock";
+	AvailableVariables constants;
+	constants.setVar("pi", 3.1415926535, true);
+	Server* server = new Server {path, constants, 4};      // Serves until the test exits
+	thread {[server] { server->run(); }}.detach();
+
+	const int clients = 20;
+	vector<string> answers(clients);
+	vector<thread> threads;
+	for (int i = 0; i < clients; i++) {
+		threads.emplace_back([&, i] {
+			string lines = "# x = " + to_string(i) + "\n";
+			for (int j = 0; j < 50; j++) lines += "x = x + 1; x * 2\n";
+			lines += "1 / 0\npi\n(1 +\nfrom a.txt\nexit\nx\n";
+			answers[i] = talk(path, lines);
+		});
+	}
+	for (thread& t : threads) t.join();
+
+	for (int i = 0; i < clients; i++) {
+		string expected = to_string(i) + "\n";
+		for (int j = 1; j <= 50; j++) expected += to_string(i + j) + "\n" + to_string(2 * (i + j)) + "\n";
+		expected += "Cannot divide by zero!\n3.14159\nPrimary expected.\nCommand not available in server sessions.\n";
+		check(answers[i] == expected, "answers of session " + to_string(i) + ": " + answers[i].substr(0, 200));
+	}
+	check(talk(path, "x\nexit\n") == "Variable with name x not found.\n", "a new session does not see the variables of the others");
+	check(talk(path, "pi = 3\npi\nexit\n") == "Tried to assign value to constant variable!\n3.14159\n", "constants are shared and cannot be assigned");
+	check(talk(path, "# f(a) = a * 2; f(3)\n# g(b) = b\ng(1)\nexit\n") == "Function defined.\n6\nFunction defined.\n1\n", "function definitions get a line too");
+	unlink(path.c_str());      // The server keeps running until the test exits, its socket file goes now
+}
+#else
+void testServer() {}
+#endif
+
+
+// Stats.h: counts made on many threads at once add up to what was done, and every timed call lands in the histogram
+
+void testStats(){
+#if CALC_STATS
+	using stats::Counter;
+	using stats::Phase;
+	stats::Totals before = stats::totals();
+
+	const int threads = 8, rounds = 500;
+	vector<thread> workers;
+	for (int w = 0; w < threads; w++) {
+		workers.emplace_back([] {
+			AvailableVariables vt;
+			run("# a = 1", vt);      // 4 tokens and the print, 1 lookup finding nothing
+			for (int i = 0; i < rounds; i++) compile("a + a * 2", vt);      // 5 tokens, 2 lookups each
+			vt.findSlot("missing");
+		});
+	}
+	for (thread& t : workers) t.join();
+
+	AvailableVariables vt;
+	string script;
+	for (int i = 0; i < 100; i++) script += "# v" + to_string(i) + " = " + to_string(i) + "\n1 / (v" + to_string(i) + " - 50)\n";
+	runScript(script, vt, true);
+
+	stats::Totals after = stats::totals();
+	auto counted = [&](Counter c) { return after.counters[int(c)] - before.counters[int(c)]; };
+	auto calls = [&](Phase p) { return after.calls[int(p)] - before.calls[int(p)]; };
+	check(counted(Counter::lookups) >= threads * (2 * rounds + 2), "lookups from every thread are counted");
+	check(counted(Counter::lookupMisses) >= threads * 2, "lookup misses are counted");
+	check(counted(Counter::tokens) >= threads * (5 * rounds + 5), "tokens from every thread are counted");
+	check(calls(Phase::compile) >= threads * (rounds + 1) + 200, "compiles from every thread are timed");
+	check(counted(Counter::statements) == 199 && counted(Counter::errors) == 1, "statements of a parallel script, " + to_string(counted(Counter::statements)) + " ran and " + to_string(counted(Counter::errors)) + " failed");
+	check(calls(Phase::evaluate) == 200, "every statement of the script is timed");
+	for (int p = 0; p < stats::phases; p++) {
+		uint64_t inHistogram = 0;
+		for (int i = 0; i < stats::buckets; i++) inHistogram += after.histogram[p][i];
+		check(inHistogram == after.calls[p], string(stats::phaseNames[p]) + ": every call is in the histogram");
+	}
+
+	ostringstream json;
+	stats::printJson(json);
+	check(json.str().find("\"enabled\":true") != string::npos && json.str().find("\"tokens\":") != string::npos, "statistics as JSON");
+#endif
+}
+
+
+// Evaluator.h: bound variables follow the variables they read, directly or through other bound variables
+
+void testBinds(){
+	AvailableVariables vt;
+	run("# x = 2; # bind y = x * 4; # bind z = y + x; # w = y", vt);
+	check(vt.getVar("y") == 8 && vt.getVar("z") == 10, "bound variables get their value when bound");
+	run("x = 3", vt);
+	check(vt.getVar("y") == 12 && vt.getVar("z") == 15, "bound variables follow an assignment");
+	check(vt.getVar("w") == 8, "a variable defined from a bound one keeps its value");
+	check(errorOf("y = 1", vt) == "Tried to assign value to bound variable!", "bound variables cannot be assigned");
+	check(errorOf("# bind a = (x = 1)", vt) == "Bound variable 'a' cannot assign other variables.", "bound expressions cannot assign");
+	check(errorOf("# bind a = 1 / (x - 3)", vt) == "Cannot divide by zero!", "a bound expression that fails binds nothing");
+	check(!vt.checkVarExists("a"), "the failed bind left no variable");
+
+	// Many bound variables on one input are all brought up to date, each once
+	run("# n = 0", vt);
+	string chain = "n";
+	for (int i = 0; i < 200; i++) {
+		string name = "b" + to_string(i);
+		run("# bind " + name + " = " + chain + " + 1", vt);
+		chain = name;
+	}
+	run("n = 10", vt);
+	check(vt.getVar("b199") == 210, "a chain of 200 bound variables after n = 10 gives " + to_string(vt.getVar("b199")));
+	Program p = compile("(n = 1) + b199", vt);
+	check(evaluate(p, vt) == 202, "a statement reads a bound variable after the assignment it depends on");
+}
+
+
+// Optimizer.h: a program after optimize() gives what it gave before, and leaves the variables the same
+
+void testOptimizer(){
+	const string setup = "# x = 1; # const c = 2; # u = 3; # bind y = x * 4; # bind v = y + c";
+	const char* statements[] = {
+		"(sqrt y) + (x = 9) + (sqrt y)",
+		"u * 2 + (x = 3) + u * 2 + (u = x + 1) * 2 + u * 2",
+		"y * 2 + (x = 3) + y * 2 + v * 2 + (x = 4) + v * 2",
+		"(# bind w = y + 1) + w * 3 + (x = 5) + w * 3",
+		"pow(c, 3) * x + pow(c, 3) * x + c * c",
+		"x * x + (x = 2) * x * x",
+		"sqrt (x - 10) + sqrt (x - 10)",
+		"(x = 0) + 1 / x + 1 / x",
+		"(x = 0) * -1 + 0",
+		"1 / 0 + c",
+		"(# z = x * 2) + (# w = x * 2) + z",
+		"(c + 1)! * (c + 1)! + 7 % c",
+	};
+	for (const char* statement : statements) {
+		AvailableVariables plain, optimized;
+		run(setup, plain);
+		run(setup, optimized);
+		Program p = compile(statement, plain);
+		Program o = optimize(compile(statement, optimized), optimized);
+		double a = 0, b = 0;
+		string ea, eb;
+		try { a = evaluate(p, plain); } catch (exception& e) { ea = e.what(); }
+		try { b = evaluate(o, optimized); } catch (exception& e) { eb = e.what(); }
+		check(ea == eb, string(statement) + ": optimized error '" + eb + "', expected '" + ea + "'");
+		check(sameBits(a, b), string(statement) + ": optimized " + to_string(b) + ", expected " + to_string(a));
+		for (const char* name : {"x", "y", "z", "w", "u", "v"}) {
+			if (plain.checkVarExists(name) != optimized.checkVarExists(name) || (plain.checkVarExists(name) && plain.getVar(name) != optimized.getVar(name))) {
+				check(false, string(statement) + ": " + name + " differs after the optimized program");
+			}
+		}
+	}
+
+	// Constants are folded and repeated subterms computed once, in evaluate() and over a batch
+	AvailableVariables vt;
+	run(setup, vt);
+	Program folded = optimize(compile("pow(c, 3) + c * 4", vt), vt);
+	check(folded.code.size() == 1 && folded.code[0].op == Op::number && folded.code[0].value == 16, "constants fold into one number");
+	Program shared = optimize(compile("(sqrt (x * 4 + 1)) + (sqrt (x * 4 + 1))", vt), vt);
+	int sqrts = 0;
+	for (const Instruction& in : shared.code) sqrts += in.op == Op::sqrt;
+	check(sqrts == 1, "a repeated subterm is computed once");
+
+	vector<double> xs = {0, 1, 2, 6, 20};
+	vector<double> out(xs.size());
+	BatchInputs in;
+	in.bind(vt, "x", xs.data());
+	evaluateBatch(shared, vt, in, xs.size(), out.data());
+	for (size_t r = 0; r < xs.size(); r++) check(out[r] == 2 * sqrt(xs[r] * 4 + 1), "optimized program over a batch, row " + to_string(r));
+}
+
+
+// Jit.h: native code gives the value and the error evaluate() gives, and programs it cannot run stay with evaluate()
+
+string outcome(const function<double()>& f){      // Value bit for bit, or the error raised
+	try {
+		double d = f();
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(double));
+		return to_string(bits);
+	}
+	catch (exception& e) {
+		return string("error: ") + e.what();
+	}
+}
+
+void testNative(){
+	const char* formulas[] = {
+		"x + y * 2", "x - y - 1", "-x * y", "x / y", "x % y", "sqrt x", "sqrt (x * y)", "pow(x, 3) + pow(y, n)", "n! + x",
+		"(x + 1)! * 2", "x / (y - y)", "x % 0", "1 / (x * 0)", "sqrt (-1 - x * x)", "pow(x, y)", "x * 1e308 * 10 - x * 1e308 * 10",
+		"sqrt (x * 1e308 * 10 - x * 1e308 * 10)", "u + x", "x * c + c", "(x * y + 1) * (x * y + 1) + (x * y + 1)",
+		"(# w = x) + 1", "x = x + 1", "(# bind b = x * 2) + 1",
+	};
+	const double values[] = {0, 1, -1, 2.5, -3, 7, 0.5, 1e300, -0.0};
+
+	for (const char* formula : formulas) {
+		for (double x : values) for (double y : {2.0, -0.5, 0.0}) {
+			AvailableVariables interpreted, native;
+			for (AvailableVariables* vt : {&interpreted, &native}) {
+				run("# x = " + to_string(x) + "; # y = " + to_string(y) + "; # n = 4; # const c = 3", *vt);
+				vt->replaceVar("x", x);      // Exactly, to_string rounds
+			}
+			Program p = compile(formula, interpreted);
+			NativeProgram code {optimize(compile(formula, native), native)};
+			string expected = outcome([&] { return evaluate(p, interpreted); });
+			string got = outcome([&] { return code.run(native); });
+			if (got != expected) {
+				check(false, string(formula) + " with x = " + to_string(x) + ", y = " + to_string(y) + ": native gives " + got + ", expected " + expected);
+				break;
+			}
+			check(native.getVar("x") == interpreted.getVar("x"), string(formula) + ": x after the native program");
+		}
+	}
+
+#ifdef CALCULATOR_JIT
+	AvailableVariables vt;
+	run("# x = 1; # y = 2", vt);
+	check(NativeProgram(compile("sqrt (x * y) + pow(x, 2) % y", vt)).isNative(), "expressions run as native code");
+	check(!NativeProgram(compile("x = y + 1", vt)).isNative(), "assignments stay with evaluate()");
+	check(!NativeProgram(compile("(# bind z = x) + 1", vt)).isNative(), "binds stay with evaluate()");
+
+	// Programs compiled while others run on another thread: the pages of running code never stop being executable
+	vector<unique_ptr<NativeProgram>> running;
+	for (int i = 0; i < 64; i++) running.push_back(make_unique<NativeProgram>(compile("x * y + " + to_string(i), vt)));
+	atomic<bool> done {false};
+	atomic<long> wrong {0};
+	thread runner {[&] {
+		AvailableVariables own;
+		run("# x = 1; # y = 2", own);
+		while (!done) {
+			for (int i = 0; i < 64; i++) wrong += running[i]->run(own) != 2 + i;
+		}
+	}};
+	for (int i = 0; i < 50000; i++) {
+		NativeProgram later {compile("x - y * " + to_string(i), vt)};
+		wrong += later.run(vt) != 1 - 2.0 * i;
+	}
+	done = true;
+	runner.join();
+	check(wrong == 0, "native programs compiled while others run");
+#endif
+}
+
+// Memo.h, Evaluator.h: a memoized statement gives what evaluate() gives, and is only found again while its inputs stay the same
+
+void testMemo(){
+	const string setup = "# x = 1; # y = 2; # bind z = x * y";
+	const char* statements[] = {"x + y", "z * 2", "x + y", "(x = x + 1) + 0", "x + y", "z * 2", "1 / (x - 2)", "sqrt z", "u", "x + y"};
+	AvailableVariables memo, plain;
+	run(setup, memo);
+	run(setup, plain);
+	memo.getMemo().setCapacity(4);      // Small, so entries are also evicted
+	for (int round = 0; round < 20; round++) {
+		for (const char* statement : statements) {
+			Program p = compile(statement, plain);
+			Program m = compile(statement, memo);
+			string expected = outcome([&] { return evaluate(p, plain); });
+			string got = outcome([&] { return evaluateMemo(m, memo); });
+			check(got == expected, string(statement) + " in round " + to_string(round) + ": memoized " + got + ", expected " + expected);
+		}
+		if (round % 3 == 0) {
+			run("y = y + 1", plain);
+			run("y = y + 1", memo);
+		}
+	}
+	check(memo.getMemo().getHits() > 0, "repeated statements are found in the cache");
+
+	// Errors are raised again every time, and a cache of size 0 keeps nothing
+	AvailableVariables vt;
+	run("# x = 0", vt);
+	Program p = compile("1 / x", vt);
+	for (int i = 0; i < 2; i++) check(outcome([&] { return evaluateMemo(p, vt); }) == "error: Cannot divide by zero!", "errors are not kept");
+	vt.getMemo().setCapacity(0);
+	run("x = 4", vt);
+	for (int i = 0; i < 3; i++) evaluateMemo(p, vt);
+	check(vt.getMemo().getHits() == 0, "a cache of size 0 finds nothing");
+
+	// The least recently used entry goes first
+	MemoCache cache {2};
+	double value;
+	cache.store({1}, 10);
+	cache.store({2}, 20);
+	cache.find({1}, value);
+	cache.store({3}, 30);
+	check(cache.find({1}, value) && value == 10 && !cache.find({2}, value) && cache.find({3}, value) && value == 30, "least recently used entry evicted");
+}
+
+
+// Compiler.h: a call gives what the body pasted in with the arguments gives, inlined or run with Op::call
+
+void testFunctions(){
+	const string setup = "# x = 3; # y = -2; # f(a, b) = a * a + b * x; # g(a) = sqrt (f(a, 1) + 100); # one() = x + 1";
+	string big = "a";
+	for (int i = 0; i < 40; i++) big += " + a * " + to_string(i);      // More code than is inlined
+	const pair<string, string> calls[] = {
+		{"f(2, 5)", "2 * 2 + 5 * x"}, {"f(x + 1, y) * 2", "((x + 1) * (x + 1) + y * x) * 2"}, {"g(y) - 1", "(sqrt ((y * y + 1 * x) + 100)) - 1"},
+		{"one() * one()", "(x + 1) * (x + 1)"}, {"f(f(1, 2), 3)", "(1 * 1 + 2 * x) * (1 * 1 + 2 * x) + 3 * x"},
+		{"big(y) + 1", "(" + big.substr(0) + ") + 1"}, {"f(1 / (x - 3), 1)", "1 / (x - 3)"},
+	};
+	for (const auto& [call, pasted] : calls) {
+		AvailableVariables vt;
+		run(setup + "; # big(a) = " + big, vt);
+		Program p = compile(call, vt);
+		string expected;
+		{
+			AvailableVariables plain;
+			run("# x = 3; # y = -2", plain);
+			string formula = pasted;
+			if (call.find("big") == 0) {
+				formula = "";
+				for (char c : pasted) formula += c == 'a' ? string("y") : string(1, c);
+			}
+			expected = outcome([&] { return evaluate(compile(formula, plain), plain); });
+		}
+		check(outcome([&] { return evaluate(p, vt); }) == expected, call + " gives what " + pasted + " gives");
+		check(outcome([&] { return evaluate(optimize(p, vt), vt); }) == expected, call + " optimized");
+	}
+
+	auto callOps = [](const Program& p) { return count_if(p.code.begin(), p.code.end(), [](const Instruction& in) { return in.op == Op::call; }); };
+	AvailableVariables inlined;
+	run(setup + "; # big(a) = " + big, inlined);
+	check(callOps(compile("f(x + 1, y) + g(2)", inlined)) == 0, "small bodies are inlined");
+	check(callOps(compile("big(2)", inlined)) == 1 && callOps(compile("f(x = 1, 2)", inlined)) == 1, "big bodies and arguments that assign use Op::call");
+
+	// Bodies see the variables as they are when called, bound variables see the variables read through calls
+	AvailableVariables vt;
+	run(setup + "; # bind z = f(1, 0) + one()", vt);
+	run("x = 10", vt);
+	check(vt.getVar("z") == 12, "a bound variable follows a variable read by the functions it calls");
+	check(outcome([&] { return evaluate(compile("f(1, 1)", vt), vt); }) == outcome([] { return 11.0; }), "a body reads the variable as it is now");
+
+	const pair<string, string> errors[] = {
+		{"# f(a) = a", "Function 'f' is already defined."}, {"# m(a, a) = a", "Parameter 'a' given twice."},
+		{"# m(a) = (x = a)", "Function 'm' cannot assign variables."}, {"# m(a) = (a = 1)", "Cannot assign to parameter 'a'."},
+		{"f(1)", "Function takes 2 argument(s), 1 given."}, {"1 + (# m(a) = a)", "Function 'm' has to be defined in a statement of its own."},
+	};
+	for (const auto& [statement, expected] : errors) {
+		string message = errorOf(statement, vt);
+		check(message.find(expected) == 0, statement + ": error '" + message + "', expected '" + expected + "'");
+	}
+}
+
+
+// Pipeline.h: a script streamed through the reader, evaluator and writer threads gives what it gives run line by line
+
+string streamScript(const string& script, AvailableVariables& vt, ResultWriter::Format format){
+	const string file = "test.stream.calc";
+	ofstream {file, ios_base::binary} << script;
+	ostringstream out, errors;
+	{
+		ResultWriter writer {out, format, errors};
+		calculateStream(file, vt, writer);
+	}
+	remove(file.c_str());
+	return out.str() + errors.str();
+}
+
+void testStreaming(){
+	string script = "# x = 1\n# f(a) = a * x + 1\n1 / 0\n(1 +\n";
+	for (int i = 0; i < 60000; i++) {      // Longer than a few blocks of the reader, so statements are cut between blocks
+		script += "x = f(x) % 1000 + " + to_string(i % 13) + "\n";
+		if (i % 997 == 0) script += "sqrt (x - 2000)\n# y" + to_string(i) + " = x * 2; y" + to_string(i) + " + 0.5\n";
+	}
+
+	AvailableVariables sequential, streamed;
+	string expected = runScript(script, sequential, false, ResultWriter::Format::plain, "test.stream.calc");
+	string output = streamScript(script, streamed, ResultWriter::Format::plain);
+	check(output == expected, "output of a streamed script");
+	check(streamed.getVar("x") == sequential.getVar("x"), "x after a streamed script");
+
+	AvailableVariables a;
+	const string small = "# z = 2\nz * 3\n# g(a) = a\ng(z) / 0\nfrom x.calc\n2 * )\n4\nexit\n5\n";
+	check(streamScript(small, a, ResultWriter::Format::interactive) == ">=2\n>=6\n>>=>>=>=4\n>test.stream.calc:4:1: Cannot divide by zero!\nCommand not available in streaming mode.\ntest.stream.calc:6:5: Primary expected.\n",
+		"a streamed script prompts as calculate() does, and stops at exit");
+}
+
+
+// Token.h, Evaluator.h: errors come back as a status, with the file, line and column of where they were found
+
+void testDiagnostics(){
+	const string script = "1 +\n2 * (3 4\n# x = 1\nx / (x - 1)\n  sqrt (0 - x); pow(2, 0.5)\n2 $ 3\nu + 1\n# y(a) = a; y(1, 2)\n4!\nx = 2; x % 0\n# x = 3\n";
+	const string expected = "1\n24\n2\n"
+		"s.calc:1:4: Primary expected.\ns.calc:2:8: missing ')'\ns.calc:4:1: Cannot divide by zero!\n"
+		"s.calc:5:3: Square root of negative number not allowed.\ns.calc:5:17: info loss\ns.calc:6:3: Token not recognized:: 36\n"
+		"s.calc:7:1: Variable with name u not found.\ns.calc:8:19: Function takes 1 argument(s), 2 given.\n"
+		"s.calc:10:8: Cannot perform modulo by zero!\ns.calc:11:1: Variable is already defined. Usage: v = 5;\n";
+	AvailableVariables sequential, parallel;
+	check(runScript(script, sequential, false, ResultWriter::Format::plain, "s.calc") == expected, "errors of a script, with where they are");
+	check(runScript(script, parallel, true, ResultWriter::Format::plain, "s.calc") == expected, "errors of a parallel script, with where they are");
+
+	// Without a file name only the message is given, and every check of the evaluator has its own fault
+	AvailableVariables vt;
+	run("# x = 0; # const c = 1; # bind b = x + 1", vt);
+	const pair<string, Fault> faults[] = {
+		{"1 / x", Fault::divideByZero}, {"1 % x", Fault::moduloByZero}, {"sqrt (x - 1)", Fault::negativeRoot},
+		{"pow(2, 0.5)", Fault::infoLoss}, {"u", Fault::undefinedVariable}, {"c = 2", Fault::constantAssigned}, {"b = 2", Fault::boundAssigned},
+		{"# x = 1", Fault::alreadyDefined}, {"x + 2", Fault::none},
+	};
+	for (const auto& [statement, fault] : faults) {
+		double value;
+		Status s = tryEvaluate(compile(statement, vt), vt, value);
+		check(s.fault == fault, statement + ": fault " + to_string(int(s.fault)) + ", expected " + to_string(int(fault)));
+		if (!s) check(faultMessage(s, vt) == errorOf(statement, vt), statement + ": the fault message is what evaluate() raises");
+	}
+	istringstream is {"2 * (3\n"};
+	ostringstream os;
+	TokenStream ts (is, os);
+	Program p;
+	check(!compileStatement(ts, vt, p) && ts.diagnostic().message == "missing ')'", "a compile error without a file name");
+}
+
+
+// Variable.h: a snapshot brings back the variables it was saved from, into an empty table or one in use
+
+void testSnapshots(){
+	const string file = "test.snapshot";
+	AvailableVariables saved;
+	run("# const c = 2; # x = 1.5; # bind b = x * c; # f(a) = a + 1", saved);
+	for (int i = 0; i < 3000; i++) saved.setVar("v" + to_string(i), i * 0.25, false);
+	compile("u + 1", saved);      // A slot for u, never defined
+	saved.saveSnapshot(file);
+
+	AvailableVariables fresh;
+	fresh.loadSnapshot(file);
+	bool same = fresh.getVar("c") == 2 && fresh.getVar("x") == 1.5 && fresh.getVar("b") == 3 && !fresh.checkVarExists("u");
+	for (int i = 0; i < 3000 && same; i++) same = fresh.getVar("v" + to_string(i)) == i * 0.25;
+	check(same, "a snapshot loaded into an empty table has every variable");
+	check(errorOf("c = 1", fresh) == "Tried to assign value to constant variable!", "constants stay constant");
+	run("x = 4; # w = x + v10", fresh);
+	check(fresh.getVar("w") == 6.5 && fresh.getVar("b") == 3, "a loaded table takes new variables, bound ones are plain values");
+	check(errorOf("f(1)", fresh) == "Variable with name f not found.", "functions are not saved");
+
+	AvailableVariables used;
+	run("# x = 9; # y = 1", used);
+	used.loadSnapshot(file);
+	check(used.getVar("x") == 1.5 && used.getVar("y") == 1 && used.getVar("v2999") == 749.75, "a snapshot loaded into a table in use");
+	AvailableVariables conflict;
+	run("# const c = 3; # x = 0", conflict);
+	check(outcome([&] { conflict.loadSnapshot(file); return 0.0; }) == "error: Snapshot changes constant variable c.", "a snapshot cannot change a constant");
+	check(conflict.getVar("x") == 0, "a snapshot that fails leaves the table as it was");
+
+	// Files that are not whole snapshots are refused
+	ifstream in {file, ios_base::binary};
+	string bytes {istreambuf_iterator<char>(in), istreambuf_iterator<char>()};
+	in.close();
+	const pair<string, string> damaged[] = {
+		{bytes.substr(0, 10), "Not a calculator snapshot: " + file}, {"NOTASNAP" + bytes.substr(8), "Not a calculator snapshot: " + file},
+		{bytes.substr(0, bytes.size() - 1), "Snapshot " + file + " is damaged."}, {bytes + "x", "Snapshot " + file + " is damaged."},
+	};
+	for (const auto& [content, expected] : damaged) {
+		ofstream {file, ios_base::binary} << content;
+		AvailableVariables vt;
+		check(outcome([&] { vt.loadSnapshot(file); return 0.0; }) == "error: " + expected, "damaged snapshot: " + expected);
+	}
+	remove(file.c_str());
+}
+
+
+
+// Evaluator.h: reductions give the value of the loop they stand for, whatever the chunks and threads
+
+void testReductions(){
+	AvailableVariables vt;
+	run("# n = 100000; # x = 2; # f(m) = sum(i, 1, m, i * x); # sum = 3", vt);
+	auto value = [&](const string& statement) { return evaluate(compile(statement, vt), vt); };
+	check(value("sum(i, 1, n, i)") == 5000050000.0, "a sum over many chunks is exact for integers");
+	check(value("prod(i, 1, 10, i)") == 3628800, "prod");
+	check(value("min(i, -5, 5, i * i - 3)") == -3 && value("max(i, -5, 5, i * i - 3)") == 22, "min and max");
+	check(value("sum(i, 1, 3, sum(j, 1, i, j * x))") == 20, "nested reductions read the outer index");
+	check(value("f(4) + sum") == 23, "reductions in function bodies, a variable named sum");
+	check(value("sum(i, 5, 1, i)") == 0 && value("prod(i, 5, 1, i)") == 1, "empty sums and products");
+
+	double series = 0;
+	for (int i = 1; i <= 100000; i++) series += 1.0 / (double(i) * i);
+	double reduced = value("sum(i, 1, n, 1 / (i * i))");
+	check(fabs(reduced - series) < 1e-12, "a series as one sum");
+	check(sameBits(value("sum(i, 1, n, 1 / (i * i))"), reduced), "a sum gives the same bits every time");
+	AvailableVariables parallel;
+	string script = "# n = 100000\n";
+	for (int i = 0; i < 8; i++) script += "sum(i, 1, n, 1 / (i * i))\n";
+	AvailableVariables sequential;
+	check(runScript(script, parallel, true) == runScript(script, sequential, false), "sums under the parallel statement graph");
+
+	const pair<string, string> errors[] = {
+		{"min(i, 2, 1, i)", "Empty range for min or max."}, {"sum(i, 0.5, 2, i)", "info loss"},
+		{"sum(i, 1, n, 1 / (i - 20000))", "Cannot divide by zero!"}, {"sum(i, 1, 3, i + u)", "Variable with name u not found."},
+		{"sum(1, 1, 3, 1)", "Index name expected after 'sum('."}, {"prod(i, 1 3, i)", "Missing ',' between the bounds of 'prod'."},
+	};
+	for (const auto& [statement, expected] : errors) check(errorOf(statement, vt) == expected, "error of " + statement);
+}
+
+// Context.h: a context gives what the calculator gives, and shares nothing with another one
+
+void testContext(){
+	Context c;
+	Result r = c.evaluate("# r = 2; pi * r * r");
+	check(r && r.value == 3.1415926535 * 4, "a context evaluates statements, with the constants");
+	check(c.evaluate("# f(a) = a * r; f(3) + 1").value == 7, "functions defined in a context");
+	check(c.evaluate("r + 1\n").value == 3, "statements ended by a newline");
+
+	const pair<string, string> errors[] = {
+		{"1 / (r - 2)", "Cannot divide by zero!"}, {"u + 1", "Variable with name u not found."},
+		{"pi = 3", "Tried to assign value to constant variable!"}, {"from x.txt", "Command not available in a Context."},
+	};
+	for (const auto& [statement, expected] : errors) {
+		Result e = c.evaluate(statement);
+		check(!e && e.message == expected, "context error of " + statement);
+	}
+	r = c.evaluate("r = 5; 1 / 0; r = 7");
+	check(!r && c.get("r").value == 5, "a context stops at the first statement that fails");
+
+	check(c.set("x", 2) && c.evaluate("# bind y = x * 10").value == 20, "set defines a variable");
+	check(c.set("x", 3) && c.get("y").value == 30, "set assigns, and bound variables follow");
+	check(!c.set("pi", 3) && c.get("pi").value == 3.1415926535, "set cannot change a constant");
+	check(!c.set("y", 1) && !c.get("nothing"), "set cannot change a bound variable, get of a missing one fails");
+
+	Context plain {Options{false, 0, ""}};
+	check(!plain.evaluate("pi") && !plain.get("r"), "contexts without constants, sharing no variables");
+
+	// Each thread evaluates in its own context, with nothing to lock
+	const int threads = 8;
+	vector<double> totals (threads);
+	vector<thread> workers;
+	for (int t = 0; t < threads; t++) {
+		workers.emplace_back([t, &totals] {
+			Context own;
+			own.set("x", t);
+			for (int i = 0; i < 2000; i++) totals[t] = own.evaluate("x = x + 1; x * 2").value;
+		});
+	}
+	for (thread& w : workers) w.join();
+	bool same = true;
+	for (int t = 0; t < threads; t++) same = same && totals[t] == 2 * (t + 2000);
+	check(same, "contexts on several threads at once");
+}
+
+// Number.h: each number type calculates the way its arithmetic does, from literals rounded once
+
+Result numbersOf(const string& numbers, const string& statements){
+	Options options;
+	options.numbers = numbers;
+	Context c {options};
+	Result r = c.evaluate(statements);
+	if (!r) r.value = NAN;      // The message is only valid while the context lives
+	return r;
+}
+
+void testNumbers(){
+	Result big = numbersOf("int64", "# x = 9007199254740993; x * 1 + 0");
+	check(big && big.exact == 9007199254740993 && numbersOf("double", "9007199254740993 + 0").value == 9007199254740992.0, "int64 literals and sums are exact");
+	check(numbersOf("int64", "7 / 2").exact == 3 && numbersOf("int64", "-7 / 2").exact == -3 && numbersOf("int64", "-7 % 2").exact == -1, "int64 division truncates");
+	check(numbersOf("int64", "sqrt 17").exact == 4 && numbersOf("int64", "pow(3, 39)").exact == 4052555153018976267, "int64 roots and powers");
+	for (string overflow : {"9223372036854775807 + 1", "-9223372036854775807 - 2", "4294967296 * 4294967296", "pow(2, 63)"}) {
+		Options options;
+		options.numbers = "int64";
+		Context c {options};
+		Result r = c.evaluate(overflow);
+		check(!r && r.message == "Integer overflow.", "int64 overflow of " + overflow);
+	}
+
+	// Ranges reaching the ends of int64 stop on their last index, and ranges of more terms than an int64 counts are refused
+	check(numbersOf("int64", "max(i, 9223372036854775800, 9223372036854775807, i)").exact == 9223372036854775807 &&
+		numbersOf("int64", "sum(i, 9223372036854775800, 9223372036854775807, 1)").exact == 8, "int64 reductions up to the largest int64");
+	check(numbersOf("int64", "min(i, -9223372036854775807 - 1, -9223372036854775807 + 3, i)").exact == -9223372036854775807 - 1, "int64 reductions from the smallest int64");
+	Options exact;
+	exact.numbers = "int64";
+	Context wide {exact};
+	Result r = wide.evaluate("sum(i, -2, 9223372036854775807, 0)");
+	check(!r && r.message == "Integer overflow.", "int64 reductions of more terms than an int64 counts");
+
+	check(numbersOf("int64", "20!").exact == 2432902008176640000 && isnan(numbersOf("int64", "21!").value), "int64 factorials are exact up to 20!");
+	check(numbersOf("float", "0.1 + 0.2").value == double(0.1f + 0.2f), "float arithmetic");
+	check(numbersOf("float", "16777217 + 0").value == 16777216 && numbersOf("float", "0.1").value == double(0.1f), "float literals are rounded once");
+	check(numbersOf("long double", "1 / 3").value == double(1.0L / 3) && numbersOf("long", "pi").value == double(3.1415926535L), "long double");
+	check(numbersOf("double", "# x = 3; x / 2").value == 1.5, "double stays the default arithmetic");
+	check(outcome([] { return numbersOf("complex", "1").value; }) == "error: Unknown numbers complex, use double, float, long double or int64.", "unknown numbers");
+
+	// Snapshots keep their number type
+	const string file = "test.snapshot";
+	BasicVariables<int64_t> integers;
+	integers.setVar("x", 9007199254740993, false);
+	integers.saveSnapshot(file);
+	BasicVariables<int64_t> back;
+	back.loadSnapshot(file);
+	check(back.getVar("x") == 9007199254740993, "an int64 snapshot");
+	AvailableVariables reals;
+	check(outcome([&] { reals.loadSnapshot(file); return 0.0; }) == "error: Snapshot " + file + " holds int64 numbers, not double.", "a snapshot of other numbers");
+	remove(file.c_str());
+}
+
+// Compiler.h: deep nesting compiles without running out of stack, and the grammar is the one it always was
+
+void testNesting(){
+	AvailableVariables vt;
+	run("# x = 3", vt);
+	const int depth = 200000;
+	string parens = string(depth, '(') + "x" + string(depth, ')') + " * 2";
+	check(evaluate(compile(parens, vt), vt) == 6, "deeply nested parentheses");
+	string braces;
+	for (int i = 0; i < depth; i++) braces += i % 2 ? "{" : "(";
+	braces += "1";
+	for (int i = depth - 1; i >= 0; i--) braces += i % 2 ? "}" : ")";
+	check(evaluate(compile(braces, vt), vt) == 1, "deeply nested braces and parentheses");
+	check(evaluate(compile(string(depth, '-') + "x", vt), vt) == 3 && evaluate(compile(string(depth + 1, '-') + "x", vt), vt) == -3, "a long chain of unary minus");
+	string sums;
+	for (int i = 0; i < depth; i++) sums += "1 + (";
+	sums += "0" + string(depth, ')');
+	check(evaluate(compile(sums, vt), vt) == depth, "a deep right nested sum");
+
+	// Precedence and what each construct takes as its operand
+	const pair<string, double> values[] = {
+		{"2 + 3 * 4 - 6 / 2", 11}, {"2 * 3!", 12}, {"-2 * -3", 6}, {"3! !", 720}, {"2 k + 1", 2001}, {"-x!", 1},      // (-3)!, unary minus binds tighter
+		{"{2 + 3} * 2 % 4", 2}, {"sqrt 16 + 9", 5}, {"pow(1 + 1, 2 * 2) - pow(2, pow(2, 2))", 0}, {"10 - 4 - 3", 3}, {"64 / 4 / 2", 8},
+		{"# y = x + 1", 4}, {"y = y * 2 + 1", 9}, {"1 + (y = 2) * 3", 7}, {"+2 - -x", 5},
+	};
+	for (const auto& [statement, expected] : values) check(evaluate(compile(statement, vt), vt) == expected, "value of " + statement);
+	const pair<string, string> errors[] = {
+		{"(1 + 2", "missing ')'"}, {"{1 + 2)", "missing '}'"}, {"2 * ", "Primary expected."},
+		{"pow(2 3)", "Missing ',' when calling pow(double n, int i)."}, {"pow(2, 3", "Missing ')' when calling pow(double n, int i)."}, {"1 + )", "Primary expected."},
+	};
+	for (const auto& [statement, expected] : errors) check(errorOf(statement, vt) == expected, "error of " + statement);
+}
+
+// Profiler.h: every statement of a file counts for its line, a nested file for the line that runs it and for its own lines
+
+void profiled(Profiler& profiler, const string& name, const string& script, AvailableVariables& vt, const string& nested){
+	TokenStream ts (script.data(), script.data() + script.size());
+	ts.in.setName(name);
+	while (true) {
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) return;
+		Profiler::Scope scope {&profiler, ts};
+		if (t.kind == var && t.name == "nested") {      // Stands for a 'from' of the nested file
+			profiled(profiler, "inner.calc", nested, vt, "");
+			continue;
+		}
+		ts.putBack(t);
+		evaluate(compileStatement(ts, vt), vt);
+	}
+}
+
+void testProfiler(){
+	Profiler profiler;
+	AvailableVariables vt;
+	profiled(profiler, "outer.calc", "# x = 1\nx = x + 1; x = x + 1\n\nnested\nnested; x * 2\n", vt, "x = x * 3\nx + x + x\n");
+	check(vt.getVar("x") == 27, "a profiled script runs as it would");
+
+	// Report rows: self ms, total ms, self %, calls, lookups, file:line
+	ostringstream report;
+	profiler.report(report);
+	istringstream rows {report.str()};
+	string row;
+	getline(rows, row);
+	check(row.find("Profile: 10 statements on 6 lines") == 0, "profile summary: " + row);
+	getline(rows, row);
+	unordered_map<string, vector<double>> lines;
+	while (getline(rows, row)) {
+		istringstream fields {row};
+		vector<double> numbers (5);
+		string where;
+		for (double& n : numbers) fields >> n;
+		fields >> where;
+		lines[where] = numbers;
+	}
+	const tuple<string, int, int> expected[] = {      // Line, calls, lookups
+		{"outer.calc:1", 1, 1}, {"outer.calc:2", 2, 4}, {"outer.calc:4", 1, 0}, {"outer.calc:5", 2, 1}, {"inner.calc:1", 2, 4}, {"inner.calc:2", 2, 6},
+	};
+	for (const auto& [where, calls, lookups] : expected) {
+		auto found = lines.find(where);
+		bool ok = found != lines.end() && found->second[3] == calls && (!CALC_STATS || found->second[4] == lookups);
+		check(ok, "profile of " + where);
+	}
+	const vector<double>& from = lines["outer.calc:4"];
+	check(lines.size() == 6 && from[1] >= from[0] && from[1] >= lines["inner.calc:1"][1] / 2, "a nested file counts as total time of its line");
+
+	// Trace: one complete event per statement, the statements of the nested file one level deeper
+	ostringstream trace;
+	profiler.writeTrace(trace);
+	string json = trace.str();
+	auto count = [&json](const string& text) {
+		int n = 0;
+		for (size_t at = json.find(text); at != string::npos; at = json.find(text, at + 1)) n++;
+		return n;
+	};
+	check(json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[") == 0 && count("\"ph\":\"X\"") == 10, "trace events");
+	check(count("\"depth\":1}") == 4 && count("\"name\":\"inner.calc:") == 4 && count("\"dropped_events\":0}") == 1, "nested statements in the trace");
+}
+
+// ScriptCache.h: a script replayed from what it compiled to gives what running it again gives, in this process or a new one
+
+bool scriptStatement(TokenStream& ts, AvailableVariables& vt, ScriptRecorder<double>* recorder){      // As statement() in calculator.cpp
+	Token t = ts.get();
+	while (t.kind == print) t = ts.get();
+	if (t.kind == eof) {
+		if (recorder) recorder->ended();
+		return false;
+	}
+	if (recorder) recorder->begin(ts);
+	ts.putBack(t);
+	Program p;
+	if (!compileStatement(ts, vt, p)) {
+		ts.out.error(ts.diagnostic().message);
+		ts.clean();
+	}
+	else if (!p.code.empty()) {
+		ts.out.result();
+		double value;
+		Status s = tryEvaluateMemo(optimize(p, vt), vt, value);
+		if (s) ts.out.value(value);
+		else {
+			ts.failStatement(faultMessage(s, vt));
+			ts.out.error(ts.diagnostic().message);
+			bool ended = ts.endsStatement();
+			ts.clean();
+			if (recorder) recorder->add(ts, vt, ended ? &p : nullptr);
+			return true;
+		}
+		if (recorder) recorder->add(ts, vt, &p);
+		return true;
+	}
+	if (recorder) recorder->add(ts, vt);
+	return true;
+}
+
+string runCached(const string& path, AvailableVariables& vt, BasicScriptCache<double>& cache){      // As runScript() in calculator.cpp
+	ostringstream out;
+	ResultWriter writer {out};
+	ScriptFile file;
+	CachedScript<double>* script = cache.find(path, file);
+	MappedFile mapped {path};
+	if (!script) script = cache.find(path, file, mapped.begin(), mapped.end());
+	if (script && script->replayable) {
+		for (CachedStatement<double>& s : script->statements) {      // As replay()
+			if (!prepare(s, vt)) {
+				string text = script->text(s);
+				TokenStream tss (text.data(), text.data() + text.size(), writer);
+				tss.in.setName(script->path, s.line);
+				scriptStatement(tss, vt, nullptr);
+				continue;
+			}
+			writer.result();
+			double value;
+			Status status = tryEvaluateMemo(s.program, vt, value);
+			if (status) writer.value(value);
+			else writer.error(script->location(s) + faultMessage(status, vt));
+		}
+	}
+	else {
+		TokenStream ts (mapped.begin(), mapped.end(), writer);
+		ts.in.setName(path);
+		ScriptRecorder<double> recorder {path, file, mapped.begin(), mapped.end()};
+		while (scriptStatement(ts, vt, script ? nullptr : &recorder)) {}
+		if (!script) cache.store(move(recorder.script), vt);
+	}
+	writer.flush();
+	return out.str();
+}
+
+void testScriptCache(){
+	const string path = "test.script.calc", directory = "test.scripts";
+	const string script = "# x = 2\n# f(a) = a * x\nf(3) + x\n1 / (x - 2)\n# bind b = x * 10\nb + sum(i, 1, 4, i * x)\n"
+		"2 * (3 4\nx = x + 1; (sqrt (x * x)) + x\nu + 1\n";
+	ofstream {path, ios_base::binary} << script;
+	filesystem::remove_all(directory);
+	filesystem::create_directory(directory);
+
+	// The same script run three times over the same variables, without a cache and from one
+	AvailableVariables plain, cached;
+	BasicScriptCache<double> cache {directory};
+	for (int run = 0; run < 3; run++) {
+		BasicScriptCache<double> none;      // Empty, so the script runs as it is
+		string expected = runCached(path, plain, none);
+		check(runCached(path, cached, cache) == expected, "run " + to_string(run) + " of a cached script");
+	}
+	check(cached.getVar("x") == plain.getVar("x") && cached.getVar("b") == plain.getVar("b"), "variables after replays");
+	ScriptFile file;
+	CachedScript<double>* recorded = cache.find(path, file);
+	check(recorded && recorded->replayable && recorded->statements.size() == 10, "a script is recorded statement by statement");
+	check(recorded && recorded->statements[1].program.code.empty() && recorded->statements[4].program.code.empty(), "functions and binds run from their chars");
+	check(recorded && !recorded->statements[2].program.code.empty() && recorded->statements[2].optimized, "replayed programs are optimized once");
+
+	// A new process reads the script back from the directory, its variables are looked up by name in a table of its own
+	AvailableVariables first, fresh;
+	BasicScriptCache<double> none;
+	run("# w = 1; # z = 2", fresh);      // Slots taken, so the names of the script land elsewhere
+	BasicScriptCache<double> later {directory};
+	string expected = runCached(path, first, none);
+	check(runCached(path, fresh, later) == expected && fresh.getVar("x") == first.getVar("x"), "a script replayed from the cache directory");
+	check(later.find(path, file) && runCached(path, fresh, later) == runCached(path, first, none), "and replayed again in that process");
+
+	// A script written again hits on its contents, a changed one is recorded again
+	filesystem::last_write_time(path, filesystem::last_write_time(path) + chrono::hours(1));
+	check(later.find(path, file) == nullptr && runCached(path, fresh, later) == runCached(path, first, none) && later.find(path, file), "same chars, new write time");
+	ofstream {path, ios_base::binary} << "x * 3\n";
+	AvailableVariables changed;
+	run("# x = 5", changed);
+	check(runCached(path, changed, later) == "=15\n" && runCached(path, changed, later) == "=15\n", "a changed script");
+
+	filesystem::remove_all(directory);
+	remove(path.c_str());
+}
+
+// ScriptCache.h: files of the cache directory cut short, damaged or made up are ignored, and the script runs from its chars
+
+void testScriptCacheFiles(){
+	const string path = "test.script.calc", directory = "test.scripts";
+	ofstream {path, ios_base::binary} << "# x = 2\nx * 3\nsum(i, 1, 4, i * x)\n";
+	filesystem::remove_all(directory);
+	filesystem::create_directory(directory);
+
+	AvailableVariables recorded;
+	BasicScriptCache<double> cache {directory};
+	const string expected = runCached(path, recorded, cache);
+	check(expected == "=2\n=6\n=20\n", "a script recorded in the cache directory");
+	const filesystem::path cacheFile = filesystem::directory_iterator(directory)->path();
+	ifstream is {cacheFile, ios_base::binary};
+	const string good {istreambuf_iterator<char>(is), istreambuf_iterator<char>()};
+	is.close();
+
+	// Read back by a new process, as bytes or not at all
+	auto readBack = [&](const string& bytes, const string& what, bool taken) {
+		ofstream {cacheFile, ios_base::binary}.write(bytes.data(), bytes.size());
+		ScriptFile file;
+		BasicScriptCache<double> later {directory};
+		bool found = later.find(path, file) != nullptr;
+		AvailableVariables vt;
+		check(found == taken && runCached(path, vt, later) == expected, "cache file " + what);
+	};
+	readBack(good, "as written", true);
+	for (size_t size = 0; size < good.size(); size++) readBack(good.substr(0, size), "cut to " + to_string(size) + " bytes", false);
+	for (size_t at = 0; at < good.size(); at++) {
+		string damaged = good;
+		damaged[at] ^= 0x20;
+		readBack(damaged, "with byte " + to_string(at) + " changed", false);
+	}
+
+	// Made up files pass the checksum, their programs are checked before anything runs
+	vector<pair<string, Program>> madeUp;
+	Program p;
+	p.parameters.push_back("a");
+	p.emit(Op::arg, 0, 0);
+	madeUp.push_back({"with a parameter at the top", p});
+	p.clear();
+	p.parameters.clear();
+	p.emit(Op::arg, 0, 0);
+	madeUp.push_back({"with an argument at the top", p});
+	for (int parameters : {0, 2}) {
+		Program body;
+		for (int i = 0; i < parameters; i++) body.parameters.push_back(i ? "j" : "i");
+		body.emit(parameters ? Op::arg : Op::number, 1, 0);
+		p.clear();
+		p.emit(Op::number, 1);
+		p.emit(Op::number, 4);
+		p.subprograms.push_back(body);
+		p.emit(Op::reduce, 0, int(Reduction::sum));
+		madeUp.push_back({"with a reduction of " + to_string(parameters) + " parameters", p});
+	}
+	Program bound;
+	bound.parameters.push_back("a");
+	bound.emit(Op::arg, 0, 0);
+	p.clear();
+	p.subprograms.push_back(bound);
+	p.emit(Op::bind, 0, recorded.getSlot("y"));
+	madeUp.push_back({"with an argument in a bound expression", p});
+	for (Op op : {Op::keep, Op::pop}) {
+		p.clear();
+		p.emit(Op::number, 1);
+		p.emit(op, 0, 1 << 30);
+		if (op == Op::pop) p.emit(Op::recall, 0, 1 << 30);
+		madeUp.push_back({string(op == Op::keep ? "keeping" : "popping") + " to temporary slot 2^30", p});
+	}
+	ScriptFile file;
+	CachedScript<double> script = *cache.find(path, file);
+	madeUp.push_back({"as recorded", script.statements[1].program});
+	for (const auto& [what, program] : madeUp) {
+		script.statements[1].program = program;
+		script.statements[1].table = &recorded;
+		cache.store(script, recorded);      // Written with its checksum
+		ifstream is {cacheFile, ios_base::binary};
+		readBack(string {istreambuf_iterator<char>(is), istreambuf_iterator<char>()}, "made up " + what, what == "as recorded");
+	}
+
+	// A file ignored is written again, then replayed from memory and by the next process
+	readBack(good.substr(0, good.size() / 2), "cut in half", false);
+	BasicScriptCache<double> again {directory};
+	AvailableVariables first, second;
+	check(again.find(path, file) && runCached(path, first, again) == expected, "a script replayed from the directory written again");
+	check(runCached(path, second, again) == expected, "and replayed again in that process");
+
+	filesystem::remove_all(directory);
+	remove(path.c_str());
+}
+
+// StatementGraph.h: binds run on several threads give what they give one after the other
+// Build with -fsanitize=thread to see that binds never touch the table at the same time
+
+void testParallelBinds(){
+	AvailableVariables vt;
+	run("# x = 1", vt);
+	string script;
+	const int binds = 500;
+	for (int i = 0; i < binds; i++) script += "# bind y" + to_string(i) + " = x * " + to_string(i) + "\n# z" + to_string(i) + " = " + to_string(i) + "\n";
+	script += "x = 2\n";
+
+	ThreadPool pool {8};      // More threads than statements at a time, even on one core
+	StatementGraph graph;
+	TokenStream ts (script.data(), script.data() + script.size());
+	while (true) {
+		Token t = ts.get();
+		while (t.kind == print) t = ts.get();
+		if (t.kind == eof) break;
+		ts.putBack(t);
+		graph.add(compileStatement(ts, vt), vt);
+	}
+	graph.run(pool, vt);
+	for (int i = 0; i < binds; i++) {
+		check(vt.getVar("y" + to_string(i)) == 2 * i, "parallel bind y" + to_string(i) + " = " + to_string(vt.getVar("y" + to_string(i))));
+		check(vt.getVar("z" + to_string(i)) == i, "parallel definition z" + to_string(i));
+	}
+}
+
+// Token.h: command names are commands only where a command can be, elsewhere they are variables
+
+vector<char> kinds(const string& text, bool stream){      // Kinds of the tokens of text, lexed from a buffer or an istream
+	istringstream is {text};
+	ostringstream os;
+	TokenStream buffer (text.data(), text.data() + text.size());
+	TokenStream input (is, os);
+	TokenStream& ts = stream ? input : buffer;
+	vector<char> k;
+	for (Token t = ts.get(); t.kind != eof; t = ts.get()) k.push_back(t.kind);
+	return k;
+}
+
+void testCommandNames(){
+	const pair<string, vector<char>> cases[] = {
+		{"stats\n", {statistics, print}},
+		{"stats  ;1\n", {statistics, print, number, print}},
+		{"stats * 2\n", {var, '*', number, print}},
+		{"# stats = 3\n", {let, var, '=', number, print}},
+		{"x = stats; stats\n", {var, '=', var, print, statistics, print}},
+		{"save vars.snap\n", {save, path, print}},
+		{"  load  vars.snap\n", {load, path, print}},
+		{"save * load\n", {var, '*', var, print}},
+		{"# load = 1; x = save + load\n", {let, var, '=', number, print, var, '=', var, '+', var, print}},
+	};
+	for (bool stream : {false, true}) {
+		for (const auto& [text, expected] : cases) check(kinds(text, stream) == expected, "tokens of '" + text + (stream ? "' from a stream" : "'"));
+	}
+	check(kinds("1; stats", false) == vector<char>{number, print, statistics}, "stats at the end of a buffer");
+
+	AvailableVariables vt;
+	run("# stats = 3; # y = stats * 2; # save = 1; # load = save + y; load = load * 2", vt);
+	check(vt.getVar("y") == 6, "variable named stats");
+	check(vt.getVar("load") == 14, "variables named save and load");
+}
+
+// Compiler.h: an inlined call gives the value and the error the same call gives through Op::call
+
+void testInlinedCalls(){
+	string big = "b * a + b + 0 * (a";      // Too big to inline
+	for (int i = 0; i < 40; i++) big += " + a";
+	const string setup = "# x = 3; # f(a, b) = b * a + b; # g(a, b) = " + big + ")";
+	const char* arguments[] = {
+		"(x, 2)", "(u, 1 / 0)", "(1 / 0, u)", "(u, w)", "(w, u)", "(x, u)", "(u, x)", "(sqrt (0 - 1), 1 % 0)", "(1 % 0, sqrt (0 - 1))",
+	};
+	for (const char* args : arguments) {
+		AvailableVariables vt;
+		run(setup, vt);
+		Program inlined = compile(string("f") + args, vt);
+		Program called = compile(string("g") + args, vt);
+		check(none_of(inlined.code.begin(), inlined.code.end(), [](const Instruction& in) { return in.op == Op::call; }), string("f") + args + " is inlined");
+		check(any_of(called.code.begin(), called.code.end(), [](const Instruction& in) { return in.op == Op::call; }), string("g") + args + " is called");
+		double a = 0, b = 0;
+		Status sa = tryEvaluate(inlined, vt, a);
+		Status sb = tryEvaluate(called, vt, b);
+		check(sa.fault == sb.fault && sa.slot == sb.slot, string("f") + args + ": error '" + faultMessage(sa, vt) + "', called '" + faultMessage(sb, vt) + "'");
+		check(!sa || !sb || a == b, string("f") + args + ": " + to_string(a) + ", called " + to_string(b));
+	}
+}
+
+// Variable.h: a snapshot with a damaged hash table still loads, its table is built again from the names
+
+void testSnapshotTable(){
+	const string file = "build/test.snap";
+	AvailableVariables saved;
+	run("# x = 1; # y = 2; # const z = 3", saved);
+	saved.saveSnapshot(file);
+	ifstream is {file, ios_base::binary};
+	string good {istreambuf_iterator<char>(is), istreambuf_iterator<char>()};
+	is.close();
+
+	SnapshotHeader header;
+	memcpy(&header, good.data(), sizeof(header));
+	const size_t entries = sizeof(header) + header.count * sizeof(SnapshotRecord<double>);
+	const size_t entrySize = 16;      // uint64_t hash, int slot and padding
+	auto slotAt = [&](string& bytes, size_t i) { return bytes.data() + entries + i * entrySize + 8; };
+
+	vector<pair<string, string>> damaged;
+	string duplicates = good;      // Every bucket holds slot 0: probing for a name that is not there never ends
+	for (size_t i = 0; i < header.tableSize; i++) memset(slotAt(duplicates, i), 0, sizeof(int));
+	damaged.push_back({"duplicate slots", duplicates});
+	string outOfRange = good;
+	for (size_t i = 0; i < header.tableSize; i++) {
+		int slot;
+		memcpy(&slot, slotAt(outOfRange, i), sizeof(slot));
+		if (slot >= 0) slot += header.count;
+		memcpy(slotAt(outOfRange, i), &slot, sizeof(slot));
+	}
+	damaged.push_back({"slots out of range", outOfRange});
+	string missing = good;
+	for (size_t i = 0; i < header.tableSize; i++) {
+		int slot;
+		memcpy(&slot, slotAt(missing, i), sizeof(slot));
+		if (slot == 1) slot = -1;
+		memcpy(slotAt(missing, i), &slot, sizeof(slot));
+	}
+	damaged.push_back({"slot missing", missing});
+	auto hashAt = [&](string& bytes, size_t i) { return bytes.data() + entries + i * entrySize; };
+	auto bucketOf = [&](string& bytes, int slot) {
+		for (size_t i = 0; i < header.tableSize; i++) {
+			int s;
+			memcpy(&s, slotAt(bytes, i), sizeof(s));
+			if (s == slot) return i;
+		}
+		return size_t(header.tableSize);
+	};
+	string wrongHash = good;      // findSlot would never match x
+	hashAt(wrongHash, bucketOf(wrongHash, 0))[0] ^= 1;
+	damaged.push_back({"wrong hash", wrongHash});
+	string unreachable = good;    // Moved to the bucket before the one its hash starts at, probing stops at an empty one first
+	size_t from = bucketOf(unreachable, 0);
+	uint64_t hash;
+	memcpy(&hash, hashAt(unreachable, from), sizeof(hash));
+	size_t to = (hash + header.tableSize - 1) & (header.tableSize - 1);
+	check(bucketOf(unreachable, -1) < header.tableSize && to != from, "free bucket before a snapshot entry");
+	memcpy(hashAt(unreachable, to), hashAt(unreachable, from), entrySize);
+	int none = -1;
+	memcpy(slotAt(unreachable, from), &none, sizeof(none));
+	damaged.push_back({"entry out of reach", unreachable});
+	damaged.push_back({"as saved", good});
+
+	for (const auto& [what, bytes] : damaged) {
+		ofstream os {file, ios_base::binary};
+		os.write(bytes.data(), bytes.size());
+		os.close();
+		AvailableVariables vt;
+		vt.loadSnapshot(file);
+		check(vt.getVar("x") == 1 && vt.getVar("y") == 2 && vt.getVar("z") == 3, "variables of a snapshot, " + what);
+		check(!vt.checkVarExists("w"), "name not in a snapshot, " + what);
+		run("# w = 4", vt);
+		check(vt.getVar("w") == 4, "new variable after a snapshot, " + what);
+	}
+
+	// Two variables of one name are refused, whether or not the table says where both are, and nothing is loaded
+	string twice = good;
+	twice[twice.size() - 2] = 'x';       // Names are saved last, "xyz"
+	string twiceHashed = twice;
+	memcpy(hashAt(twiceHashed, bucketOf(twiceHashed, 1)), hashAt(twiceHashed, bucketOf(twiceHashed, 0)), sizeof(uint64_t));
+	for (const string& bytes : {twice, twiceHashed}) {
+		ofstream os {file, ios_base::binary};
+		os.write(bytes.data(), bytes.size());
+		os.close();
+		AvailableVariables vt;
+		bool refused = false;
+		try { vt.loadSnapshot(file); }
+		catch (exception& e) { refused = string(e.what()) == "Snapshot " + file + " is damaged."; }
+		check(refused && !vt.checkVarExists("x"), "snapshot with one name twice");
+		run("# x = 5", vt);
+		check(vt.getVar("x") == 5, "variables after a refused snapshot");
+	}
+	remove(file.c_str());
+}
+
+// test_link.cpp: every header is included there as well, so this links only if the headers define nothing twice
+
+double evaluateInOtherUnit(const string& statement);
+
+void testLink(){
+	check(evaluateInOtherUnit("2 * 3 + 1") == 7, "evaluate in a second translation unit");
+}
+
+int main()
+try {
+	testLink();
+	testStatements();
+	testCompiledOnce();
+	testVariableTable();
+	testMappedLexing();
+	testTokenNames();
+	testResultFormats();
+	testLiterals();
+	testServer();
+	testStats();
+	testBatch();
+	testBatchRows();
+	testParallelScript();
+	testBinds();
+	testOptimizer();
+	testNative();
+	testMemo();
+	testFunctions();
+	testStreaming();
+	testDiagnostics();
+	testSnapshots();
+	testReductions();
+	testContext();
+	testNumbers();
+	testNesting();
+	testProfiler();
+	testScriptCache();
+	testScriptCacheFiles();
+	testParallelBinds();
+	testCommandNames();
+	testInlinedCalls();
+	testSnapshotTable();
+
+	if (failures) {
+		cerr << failures << " check(s) failed\n";
+		return 1;
+	}
+	cout << "All checks passed\n";
+	return 0;
+}
+catch (exception& e) {
+	cerr << e.what() << '\n';
+	return 1;
+}
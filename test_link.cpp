@@ -0,0 +1,29 @@
+#include "Common.h"
+#include "Token.h"
+#include "Variable.h"
+#include "Program.h"
+#include "Compiler.h"
+#include "Evaluator.h"
+#include "Optimizer.h"
+#include "Batch.h"
+#include "Jit.h"
+#include "Memo.h"
+#include "Number.h"
+#include "MappedFile.h"
+#include "StatementGraph.h"
+#include "ThreadPool.h"
+#include "Pipeline.h"
+#include "Server.h"
+#include "Stats.h"
+#include "Profiler.h"
+#include "ScriptCache.h"
+
+// Second translation unit of make test: it includes every header of the library, and so does test.cpp
+// A function defined in a header without inline is then defined twice and the test does not link
+
+double evaluateInOtherUnit(const std::string& statement){
+	calc::AvailableVariables vt;
+	calc::TokenStream ts (statement.data(), statement.data() + statement.size());
+	calc::Program p = calc::compileStatement(ts, vt);
+	return calc::evaluate(p, vt);
+}